@@ -13,8 +13,11 @@
 // limitations under the License.
 
 #include "postgres.h"
+#include "miscadmin.h"
 #include "embedding.h"
 #include "math.h"
+#include <stdlib.h>
+#include <string.h>
 
 #ifdef __x86_64__
 #include <immintrin.h>
@@ -36,20 +39,42 @@ static dist_t l2_dist_impl_avx2(const coord_t *x, const coord_t *y, size_t n)
     __m256 sum = _mm256_set1_ps(0);
 	dist_t res;
 
-    while (x < pEnd1) {
-        v1 = _mm256_loadu_ps(x);
-        x += 8;
-        v2 = _mm256_loadu_ps(y);
-        y += 8;
-        diff = _mm256_sub_ps(v1, v2);
-        sum = _mm256_add_ps(sum, _mm256_mul_ps(diff, diff));
-
-        v1 = _mm256_loadu_ps(x);
-        x += 8;
-        v2 = _mm256_loadu_ps(y);
-        y += 8;
-        diff = _mm256_sub_ps(v1, v2);
-        sum = _mm256_add_ps(sum, _mm256_mul_ps(diff, diff));
+    if (((uintptr_t)y & 31) == 0)
+    {
+        // Vectors stored in slotted pages are aligned
+        while (x < pEnd1) {
+            v1 = _mm256_loadu_ps(x);
+            x += 8;
+            v2 = _mm256_load_ps(y);
+            y += 8;
+            diff = _mm256_sub_ps(v1, v2);
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(diff, diff));
+
+            v1 = _mm256_loadu_ps(x);
+            x += 8;
+            v2 = _mm256_load_ps(y);
+            y += 8;
+            diff = _mm256_sub_ps(v1, v2);
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(diff, diff));
+        }
+    }
+    else
+    {
+        while (x < pEnd1) {
+            v1 = _mm256_loadu_ps(x);
+            x += 8;
+            v2 = _mm256_loadu_ps(y);
+            y += 8;
+            diff = _mm256_sub_ps(v1, v2);
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(diff, diff));
+
+            v1 = _mm256_loadu_ps(x);
+            x += 8;
+            v2 = _mm256_loadu_ps(y);
+            y += 8;
+            diff = _mm256_sub_ps(v1, v2);
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(diff, diff));
+        }
     }
     _mm256_store_ps(TmpRes, sum);
     res = TmpRes[0] + TmpRes[1] + TmpRes[2] + TmpRes[3] + TmpRes[4] + TmpRes[5] + TmpRes[6] + TmpRes[7];
@@ -154,6 +179,919 @@ static dist_t manhattan_dist_impl(coord_t const* ax, coord_t const* bx, size_t d
 	return distance;
 }
 
+/*
+ * Kernels for int8 scalar quantized vectors: they calculate sum of squared or absolute differences of codes.
+ * Differences of unsigned codes do not fit in signed byte, so codes are widened to 16 bits and
+ * squared differences are accumulated by multiply-add of 16-bit integers.
+ */
+static uint64_t int8_l2_sum_impl(uint8_t const* x, uint8_t const* y, size_t n)
+{
+	uint64_t sum = 0;
+	for (size_t i = 0; i < n; i++)
+	{
+		int diff = (int)x[i] - (int)y[i];
+		sum += diff * diff;
+	}
+	return sum;
+}
+
+static uint64_t int8_l1_sum_impl(uint8_t const* x, uint8_t const* y, size_t n)
+{
+	uint64_t sum = 0;
+	for (size_t i = 0; i < n; i++)
+		sum += abs((int)x[i] - (int)y[i]);
+	return sum;
+}
+
+#ifdef __x86_64__
+__attribute__((target("avx2")))
+static uint64_t int8_l2_sum_avx2(uint8_t const* x, uint8_t const* y, size_t n)
+{
+	int32_t PORTABLE_ALIGN32 TmpRes[8];
+	__m256i sum = _mm256_setzero_si256();
+	size_t i = 0;
+	uint64_t res;
+
+	for (; i + 16 <= n; i += 16)
+	{
+		__m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i const*)(x + i)));
+		__m256i b = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i const*)(y + i)));
+		__m256i diff = _mm256_sub_epi16(a, b);
+		sum = _mm256_add_epi32(sum, _mm256_madd_epi16(diff, diff));
+	}
+	_mm256_store_si256((__m256i*)TmpRes, sum);
+	res = (uint64_t)TmpRes[0] + TmpRes[1] + TmpRes[2] + TmpRes[3] + TmpRes[4] + TmpRes[5] + TmpRes[6] + TmpRes[7];
+
+	return res + int8_l2_sum_impl(x + i, y + i, n - i);
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+static uint64_t int8_l2_sum_avx512(uint8_t const* x, uint8_t const* y, size_t n)
+{
+	__m512i sum = _mm512_setzero_si512();
+	size_t i = 0;
+
+	for (; i + 32 <= n; i += 32)
+	{
+		__m512i a = _mm512_cvtepu8_epi16(_mm256_loadu_si256((__m256i const*)(x + i)));
+		__m512i b = _mm512_cvtepu8_epi16(_mm256_loadu_si256((__m256i const*)(y + i)));
+		__m512i diff = _mm512_sub_epi16(a, b);
+		sum = _mm512_dpwssd_epi32(sum, diff, diff);
+	}
+	return (uint64_t)(uint32_t)_mm512_reduce_add_epi32(sum) + int8_l2_sum_impl(x + i, y + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static uint64_t int8_l1_sum_avx2(uint8_t const* x, uint8_t const* y, size_t n)
+{
+	int64_t PORTABLE_ALIGN32 TmpRes[4];
+	__m256i sum = _mm256_setzero_si256();
+	size_t i = 0;
+
+	for (; i + 32 <= n; i += 32)
+	{
+		__m256i a = _mm256_loadu_si256((__m256i const*)(x + i));
+		__m256i b = _mm256_loadu_si256((__m256i const*)(y + i));
+		sum = _mm256_add_epi64(sum, _mm256_sad_epu8(a, b));
+	}
+	_mm256_store_si256((__m256i*)TmpRes, sum);
+
+	return TmpRes[0] + TmpRes[1] + TmpRes[2] + TmpRes[3] + int8_l1_sum_impl(x + i, y + i, n - i);
+}
+#endif
+
+static uint64_t (*int8_l2_sum)(uint8_t const* x, uint8_t const* y, size_t n);
+static uint64_t (*int8_l1_sum)(uint8_t const* x, uint8_t const* y, size_t n);
+
+/*
+ * Cosine distance depends on offsets of coordinates, so codes are decoded
+ */
+static dist_t int8_cosine_dist(HnswMetadata* meta, uint8_t const* x, uint8_t const* y)
+{
+	dist_t 		distance = 0.0;
+	dist_t 		norma = 0.0;
+	dist_t 		normb = 0.0;
+	for (size_t i = 0; i < meta->dim; i++)
+	{
+		coord_t a = meta->sq_offsets[i] + meta->sq_scale * x[i];
+		coord_t b = meta->sq_offsets[i] + meta->sq_scale * y[i];
+		distance += a * b;
+		norma += a * a;
+		normb += b * b;
+	}
+	return 1 - (distance / sqrt(norma * normb));
+}
+
+static dist_t int8_dist(HnswMetadata* meta, uint8_t const* x, uint8_t const* y)
+{
+	switch (meta->dist_func)
+	{
+		case DIST_L2:
+			return meta->sq_scale * sqrtf((float)int8_l2_sum(x, y, meta->dim));
+		case DIST_MANHATTAN:
+			return meta->sq_scale * (float)int8_l1_sum(x, y, meta->dim);
+		default:
+			return int8_cosine_dist(meta, x, y);
+	}
+}
+
+/*
+ * Conversion of coordinates to and from 16-bit floats: IEEE half precision (float16) or
+ * truncated float (bfloat16). Values are rounded to nearest even.
+ */
+static uint16_t float_to_float16(float f)
+{
+	uint32_t x;
+	uint32_t sign;
+	uint32_t mant;
+	uint32_t h;
+	uint32_t rem;
+	int      exp;
+
+	memcpy(&x, &f, sizeof(x));
+	sign = (x >> 16) & 0x8000;
+	if ((x & 0x7fffffff) > 0x7f800000)
+		return sign | 0x7e00; /* NaN */
+	exp = (int)((x >> 23) & 0xff) - 127 + 15;
+	mant = x & 0x7fffff;
+	if (exp >= 31)
+		return sign | 0x7c00; /* overflow to infinity */
+	if (exp <= 0)
+	{
+		/* Subnormal half */
+		int shift;
+		if (exp < -10)
+			return sign;
+		mant |= 0x800000;
+		shift = 14 - exp;
+		h = mant >> shift;
+		rem = mant & ((1u << shift) - 1);
+		if (rem > (1u << (shift - 1)) || (rem == (1u << (shift - 1)) && (h & 1)))
+			h += 1;
+		return sign | h;
+	}
+	h = ((uint32_t)exp << 10) | (mant >> 13);
+	rem = mant & 0x1fff;
+	if (rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+		h += 1; /* carry to exponent is correct rounding */
+	return sign | h;
+}
+
+static inline float float16_to_float(uint16_t h)
+{
+	uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+	uint32_t exp = (h >> 10) & 0x1f;
+	uint32_t mant = h & 0x3ff;
+	uint32_t x;
+	float f;
+
+	if (exp == 0)
+	{
+		f = ldexpf((float)mant, -24);
+		return sign ? -f : f;
+	}
+	x = exp == 31
+		? sign | 0x7f800000 | (mant << 13)
+		: sign | ((exp - 15 + 127) << 23) | (mant << 13);
+	memcpy(&f, &x, sizeof(f));
+	return f;
+}
+
+static uint16_t float_to_bfloat16(float f)
+{
+	uint32_t x;
+	memcpy(&x, &f, sizeof(x));
+	if ((x & 0x7fffffff) > 0x7f800000)
+		return (x >> 16) | 0x40; /* keep NaN quiet */
+	x += 0x7fff + ((x >> 16) & 1);
+	return x >> 16;
+}
+
+static inline float bfloat16_to_float(uint16_t h)
+{
+	uint32_t x = (uint32_t)h << 16;
+	float f;
+	memcpy(&f, &x, sizeof(f));
+	return f;
+}
+
+static inline float half_to_float(quantization_t format, uint16_t h)
+{
+	return format == QUANT_FLOAT16 ? float16_to_float(h) : bfloat16_to_float(h);
+}
+
+static dist_t half_dist_impl(HnswMetadata* meta, uint16_t const* x, uint16_t const* y)
+{
+	dist_t 		distance = 0.0;
+	dist_t 		norma = 0.0;
+	dist_t 		normb = 0.0;
+	for (size_t i = 0; i < meta->dim; i++)
+	{
+		coord_t a = half_to_float(meta->quantization, x[i]);
+		coord_t b = half_to_float(meta->quantization, y[i]);
+		switch (meta->dist_func)
+		{
+			case DIST_L2:
+				distance += (a - b) * (a - b);
+				break;
+			case DIST_MANHATTAN:
+				distance += fabs(a - b);
+				break;
+			default:
+				distance += a * b;
+				norma += a * a;
+				normb += b * b;
+		}
+	}
+	return meta->dist_func == DIST_L2 ? sqrtf(distance)
+		: meta->dist_func == DIST_MANHATTAN ? distance
+		: 1 - (distance / sqrt(norma * normb));
+}
+
+#ifdef __x86_64__
+/*
+ * Half precision coordinates are converted to floats in registers: by F16C instruction for float16
+ * and by shift for bfloat16. AVX-512 BF16 calculates dot products of bfloat16 directly, it is used for cosine distance.
+ */
+__attribute__((target("avx2,f16c")))
+static dist_t float16_l2_dist_avx2(uint16_t const* x, uint16_t const* y, size_t n)
+{
+	coord_t PORTABLE_ALIGN32 TmpRes[8];
+	__m256 sum = _mm256_setzero_ps();
+	size_t i = 0;
+	dist_t res;
+
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256 v1 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i const*)(x + i)));
+		__m256 v2 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i const*)(y + i)));
+		__m256 diff = _mm256_sub_ps(v1, v2);
+		sum = _mm256_add_ps(sum, _mm256_mul_ps(diff, diff));
+	}
+	_mm256_store_ps(TmpRes, sum);
+	res = TmpRes[0] + TmpRes[1] + TmpRes[2] + TmpRes[3] + TmpRes[4] + TmpRes[5] + TmpRes[6] + TmpRes[7];
+
+	for (; i < n; i++)
+	{
+		dist_t diff = float16_to_float(x[i]) - float16_to_float(y[i]);
+		res += diff * diff;
+	}
+	return sqrtf(res);
+}
+
+__attribute__((target("avx2")))
+static dist_t bfloat16_l2_dist_avx2(uint16_t const* x, uint16_t const* y, size_t n)
+{
+	coord_t PORTABLE_ALIGN32 TmpRes[8];
+	__m256 sum = _mm256_setzero_ps();
+	size_t i = 0;
+	dist_t res;
+
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256 v1 = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i const*)(x + i))), 16));
+		__m256 v2 = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i const*)(y + i))), 16));
+		__m256 diff = _mm256_sub_ps(v1, v2);
+		sum = _mm256_add_ps(sum, _mm256_mul_ps(diff, diff));
+	}
+	_mm256_store_ps(TmpRes, sum);
+	res = TmpRes[0] + TmpRes[1] + TmpRes[2] + TmpRes[3] + TmpRes[4] + TmpRes[5] + TmpRes[6] + TmpRes[7];
+
+	for (; i < n; i++)
+	{
+		dist_t diff = bfloat16_to_float(x[i]) - bfloat16_to_float(y[i]);
+		res += diff * diff;
+	}
+	return sqrtf(res);
+}
+
+__attribute__((target("avx512f,avx512bf16")))
+static dist_t bfloat16_cosine_dist_avx512(uint16_t const* x, uint16_t const* y, size_t n)
+{
+	__m512 dot = _mm512_setzero_ps();
+	__m512 norma = _mm512_setzero_ps();
+	__m512 normb = _mm512_setzero_ps();
+	size_t i = 0;
+	dist_t distance, na, nb;
+
+	for (; i + 32 <= n; i += 32)
+	{
+		__m512bh a = (__m512bh)_mm512_loadu_si512((void const*)(x + i));
+		__m512bh b = (__m512bh)_mm512_loadu_si512((void const*)(y + i));
+		dot = _mm512_dpbf16_ps(dot, a, b);
+		norma = _mm512_dpbf16_ps(norma, a, a);
+		normb = _mm512_dpbf16_ps(normb, b, b);
+	}
+	distance = _mm512_reduce_add_ps(dot);
+	na = _mm512_reduce_add_ps(norma);
+	nb = _mm512_reduce_add_ps(normb);
+
+	for (; i < n; i++)
+	{
+		coord_t a = bfloat16_to_float(x[i]);
+		coord_t b = bfloat16_to_float(y[i]);
+		distance += a * b;
+		na += a * a;
+		nb += b * b;
+	}
+	return 1 - (distance / sqrt(na * nb));
+}
+#endif
+
+/* SIMD kernels for particular format and distance, NULL if not supported by CPU */
+static dist_t (*float16_l2_dist)(uint16_t const* x, uint16_t const* y, size_t n);
+static dist_t (*bfloat16_l2_dist)(uint16_t const* x, uint16_t const* y, size_t n);
+static dist_t (*bfloat16_cosine_dist)(uint16_t const* x, uint16_t const* y, size_t n);
+
+static dist_t half_dist(HnswMetadata* meta, uint16_t const* x, uint16_t const* y)
+{
+	if (meta->quantization == QUANT_FLOAT16)
+	{
+		if (meta->dist_func == DIST_L2 && float16_l2_dist)
+			return float16_l2_dist(x, y, meta->dim);
+	}
+	else
+	{
+		if (meta->dist_func == DIST_L2 && bfloat16_l2_dist)
+			return bfloat16_l2_dist(x, y, meta->dim);
+		if (meta->dist_func == DIST_COSINE && bfloat16_cosine_dist)
+			return bfloat16_cosine_dist(x, y, meta->dim);
+	}
+	return half_dist_impl(meta, x, y);
+}
+
+/*
+ * Product quantization: vector is split in pq_subvectors subvectors and each of them is encoded by the number of
+ * the nearest centroid trained for its subspace. Subvector j contains coordinates [PQ_START(j), PQ_START(j+1)).
+ * Centroids of subspace j are stored consecutively starting from PQ_START(j) * HNSW_PQ_CENTROIDS in the codebook.
+ * Subvectors are compared using squared L2 distance (L1 for Manhattan distance).
+ */
+#define PQ_START(meta, j) ((j) * (meta)->dim / (meta)->pq_subvectors)
+#define PQ_ITERATIONS     10 /* number of k-means iterations */
+
+static inline coord_t* pq_centroid(HnswMetadata* meta, size_t j, size_t c)
+{
+	size_t start = PQ_START(meta, j);
+	return meta->pq_codebook + start * HNSW_PQ_CENTROIDS + c * (PQ_START(meta, j + 1) - start);
+}
+
+static dist_t pq_subvector_dist(HnswMetadata* meta, coord_t const* x, coord_t const* y, size_t len)
+{
+	dist_t distance = 0;
+	if (meta->dist_func == DIST_MANHATTAN)
+	{
+		for (size_t i = 0; i < len; i++)
+			distance += fabs(x[i] - y[i]);
+	}
+	else
+	{
+		for (size_t i = 0; i < len; i++)
+			distance += (x[i] - y[i]) * (x[i] - y[i]);
+	}
+	return distance;
+}
+
+static int pq_nearest_centroid(HnswMetadata* meta, size_t j, coord_t const* x, dist_t* dist)
+{
+	size_t len = PQ_START(meta, j + 1) - PQ_START(meta, j);
+	coord_t const* centroids = pq_centroid(meta, j, 0);
+	int best = 0;
+	dist_t best_dist = pq_subvector_dist(meta, x, centroids, len);
+
+	for (int c = 1; c < HNSW_PQ_CENTROIDS; c++)
+	{
+		dist_t d = pq_subvector_dist(meta, x, centroids + c * len, len);
+		if (d < best_dist)
+		{
+			best_dist = d;
+			best = c;
+		}
+	}
+	*dist = best_dist;
+	return best;
+}
+
+/*
+ * Train centroids of each subspace by k-means. Initial centroids are sample vectors taken with equal steps.
+ * If sample contains not more vectors than centroids, they are used as centroids and encoded without error.
+ * Codebook should be allocated by caller.
+ */
+void hnsw_pq_train(HnswMetadata* meta, coord_t const* sample, size_t n_vectors)
+{
+	size_t dim = meta->dim;
+	size_t max_len = PQ_START(meta, 1);
+	float* sums;
+	size_t* counts = (size_t*)palloc(HNSW_PQ_CENTROIDS * sizeof(size_t));
+
+	for (size_t j = 1; j < meta->pq_subvectors; j++)
+		max_len = Max(max_len, PQ_START(meta, j + 1) - PQ_START(meta, j));
+	sums = (float*)palloc(HNSW_PQ_CENTROIDS * max_len * sizeof(float));
+
+	for (size_t j = 0; j < meta->pq_subvectors; j++)
+	{
+		size_t start = PQ_START(meta, j);
+		size_t len = PQ_START(meta, j + 1) - start;
+		coord_t* centroids = pq_centroid(meta, j, 0);
+
+		for (size_t c = 0; c < HNSW_PQ_CENTROIDS; c++)
+		{
+			if (n_vectors != 0)
+				memcpy(centroids + c * len, sample + c * n_vectors / HNSW_PQ_CENTROIDS * dim + start, len * sizeof(coord_t));
+			else
+				memset(centroids + c * len, 0, len * sizeof(coord_t));
+		}
+		for (int iter = 0; iter < PQ_ITERATIONS && n_vectors > HNSW_PQ_CENTROIDS; iter++)
+		{
+			memset(sums, 0, HNSW_PQ_CENTROIDS * len * sizeof(float));
+			memset(counts, 0, HNSW_PQ_CENTROIDS * sizeof(size_t));
+			for (size_t i = 0; i < n_vectors; i++)
+			{
+				coord_t const* x = sample + i * dim + start;
+				dist_t dist;
+				int c = pq_nearest_centroid(meta, j, x, &dist);
+				counts[c] += 1;
+				for (size_t k = 0; k < len; k++)
+					sums[c * len + k] += x[k];
+			}
+			/* Centroid without vectors is left unchanged */
+			for (size_t c = 0; c < HNSW_PQ_CENTROIDS; c++)
+			{
+				if (counts[c] != 0)
+				{
+					for (size_t k = 0; k < len; k++)
+						centroids[c * len + k] = sums[c * len + k] / counts[c];
+				}
+			}
+		}
+	}
+	pfree(sums);
+	pfree(counts);
+}
+
+/*
+ * Calculate distances between subvectors of the query and all centroids of their subspaces.
+ * For cosine distance table contains dot products, followed by squared norms of centroids and squared norm of the query.
+ */
+float* hnsw_pq_table(HnswMetadata* meta, coord_t const* query)
+{
+	size_t m = meta->pq_subvectors;
+	bool cosine = meta->dist_func == DIST_COSINE;
+	float* table = (float*)palloc((cosine ? 2 * m * HNSW_PQ_CENTROIDS + 1 : m * HNSW_PQ_CENTROIDS) * sizeof(float));
+	float* norms = table + m * HNSW_PQ_CENTROIDS;
+	dist_t query_norm = 0;
+
+	for (size_t j = 0; j < m; j++)
+	{
+		size_t start = PQ_START(meta, j);
+		size_t len = PQ_START(meta, j + 1) - start;
+		coord_t const* x = query + start;
+
+		for (size_t c = 0; c < HNSW_PQ_CENTROIDS; c++)
+		{
+			coord_t const* y = pq_centroid(meta, j, c);
+			if (cosine)
+			{
+				dist_t dot = 0;
+				dist_t norm = 0;
+				for (size_t k = 0; k < len; k++)
+				{
+					dot += x[k] * y[k];
+					norm += y[k] * y[k];
+				}
+				table[j * HNSW_PQ_CENTROIDS + c] = dot;
+				norms[j * HNSW_PQ_CENTROIDS + c] = norm;
+			}
+			else
+				table[j * HNSW_PQ_CENTROIDS + c] = pq_subvector_dist(meta, x, y, len);
+		}
+		for (size_t k = 0; k < len; k++)
+			query_norm += x[k] * x[k];
+	}
+	if (cosine)
+		table[2 * m * HNSW_PQ_CENTROIDS] = query_norm;
+	return table;
+}
+
+/*
+ * Sum of table entries selected by the codes: subspace j has HNSW_PQ_CENTROIDS entries starting from j * HNSW_PQ_CENTROIDS
+ */
+static dist_t pq_lookup_impl(float const* table, uint8_t const* codes, size_t m)
+{
+	dist_t sum = 0;
+	for (size_t j = 0; j < m; j++)
+		sum += table[j * HNSW_PQ_CENTROIDS + codes[j]];
+	return sum;
+}
+
+#ifdef __x86_64__
+__attribute__((target("avx2")))
+static dist_t pq_lookup_avx2(float const* table, uint8_t const* codes, size_t m)
+{
+	coord_t PORTABLE_ALIGN32 TmpRes[8];
+	__m256i offsets = _mm256_setr_epi32(0, HNSW_PQ_CENTROIDS, 2 * HNSW_PQ_CENTROIDS, 3 * HNSW_PQ_CENTROIDS,
+										4 * HNSW_PQ_CENTROIDS, 5 * HNSW_PQ_CENTROIDS, 6 * HNSW_PQ_CENTROIDS, 7 * HNSW_PQ_CENTROIDS);
+	__m256 sum = _mm256_setzero_ps();
+	size_t j = 0;
+	dist_t res;
+
+	/* Entries for 8 subspaces are loaded by one gather */
+	for (; j + 8 <= m; j += 8)
+	{
+		__m256i idx = _mm256_add_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i const*)(codes + j))), offsets);
+		sum = _mm256_add_ps(sum, _mm256_i32gather_ps(table + j * HNSW_PQ_CENTROIDS, idx, sizeof(float)));
+	}
+	_mm256_store_ps(TmpRes, sum);
+	res = TmpRes[0] + TmpRes[1] + TmpRes[2] + TmpRes[3] + TmpRes[4] + TmpRes[5] + TmpRes[6] + TmpRes[7];
+
+	return res + pq_lookup_impl(table + j * HNSW_PQ_CENTROIDS, codes + j, m - j);
+}
+#endif
+
+static dist_t (*pq_lookup)(float const* table, uint8_t const* codes, size_t m);
+
+/*
+ * Asymmetric distance between the query and PQ code calculated using table of the query
+ */
+static dist_t pq_table_dist(HnswMetadata* meta, uint8_t const* codes)
+{
+	size_t m = meta->pq_subvectors;
+	float const* table = meta->pq_table;
+
+	switch (meta->dist_func)
+	{
+		case DIST_L2:
+			return sqrtf(pq_lookup(table, codes, m));
+		case DIST_MANHATTAN:
+			return pq_lookup(table, codes, m);
+		default:
+			return 1 - pq_lookup(table, codes, m)
+				/ sqrt(table[2 * m * HNSW_PQ_CENTROIDS] * pq_lookup(table + m * HNSW_PQ_CENTROIDS, codes, m));
+	}
+}
+
+/*
+ * Symmetric distance between two PQ codes: it is used to connect elements when index is built
+ */
+static dist_t pq_code_dist(HnswMetadata* meta, uint8_t const* x, uint8_t const* y)
+{
+	dist_t 		distance = 0.0;
+	dist_t 		norma = 0.0;
+	dist_t 		normb = 0.0;
+
+	for (size_t j = 0; j < meta->pq_subvectors; j++)
+	{
+		size_t len = PQ_START(meta, j + 1) - PQ_START(meta, j);
+		coord_t const* a = pq_centroid(meta, j, x[j]);
+		coord_t const* b = pq_centroid(meta, j, y[j]);
+
+		if (meta->dist_func != DIST_COSINE)
+			distance += pq_subvector_dist(meta, a, b, len);
+		else
+		{
+			for (size_t k = 0; k < len; k++)
+			{
+				distance += a[k] * b[k];
+				norma += a[k] * a[k];
+				normb += b[k] * b[k];
+			}
+		}
+	}
+	return meta->dist_func == DIST_L2 ? sqrtf(distance)
+		: meta->dist_func == DIST_MANHATTAN ? distance
+		: 1 - (distance / sqrt(norma * normb));
+}
+
+/*
+ * Distance from the query to PQ code differs from the exact distance to the encoded vector
+ * at most by norm of its residual (triangle inequality), which is stored after the code.
+ * Cosine distance is not bounded.
+ */
+dist_t hnsw_distance_lower_bound(HnswMetadata* meta, dist_t dist, void const* code)
+{
+	float residual;
+	Assert(meta->quantization == QUANT_PQ && meta->dist_func != DIST_COSINE);
+	memcpy(&residual, (char const*)code + HNSW_PQ_RESIDUAL_OFFSET(meta->pq_subvectors), sizeof(residual));
+	return dist - residual;
+}
+
+/*
+ * Hamming distance between sign bits of binary quantized vectors
+ */
+static uint64_t hamming_impl(uint64_t const* x, uint64_t const* y, size_t n_words)
+{
+	uint64_t distance = 0;
+	for (size_t i = 0; i < n_words; i++)
+		distance += __builtin_popcountll(x[i] ^ y[i]);
+	return distance;
+}
+
+#ifdef __x86_64__
+__attribute__((target("popcnt")))
+static uint64_t hamming_popcnt(uint64_t const* x, uint64_t const* y, size_t n_words)
+{
+	uint64_t distance = 0;
+	for (size_t i = 0; i < n_words; i++)
+		distance += _mm_popcnt_u64(x[i] ^ y[i]);
+	return distance;
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static uint64_t hamming_avx512(uint64_t const* x, uint64_t const* y, size_t n_words)
+{
+	__m512i sum = _mm512_setzero_si512();
+	size_t i = 0;
+
+	for (; i + 8 <= n_words; i += 8)
+	{
+		__m512i diff = _mm512_xor_si512(_mm512_loadu_si512((void const*)(x + i)), _mm512_loadu_si512((void const*)(y + i)));
+		sum = _mm512_add_epi64(sum, _mm512_popcnt_epi64(diff));
+	}
+	return (uint64_t)_mm512_reduce_add_epi64(sum) + hamming_impl(x + i, y + i, n_words - i);
+}
+#endif
+
+static uint64_t (*hamming_dist)(uint64_t const* x, uint64_t const* y, size_t n_words);
+
+#define PROJECTION_SEED       0x9E3779B97F4A7C15 /* random projection is deterministic, so REINDEX reproduces it */
+#define PROJECTION_ITERATIONS 8 /* number of subspace iterations used to find principal components */
+
+static uint64_t projection_random(uint64_t* state)
+{
+	/* splitmix64 */
+	uint64_t z = (*state += 0x9E3779B97F4A7C15);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+	return z ^ (z >> 31);
+}
+
+static double projection_gaussian(uint64_t* state)
+{
+	/* Box-Muller transform of two uniform values in (0, 1] */
+	double u1 = ((projection_random(state) >> 11) + 1) * (1.0 / 9007199254740992.0);
+	double u2 = ((projection_random(state) >> 11) + 1) * (1.0 / 9007199254740992.0);
+	return sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+}
+
+/*
+ * Orthonormalize rows of the matrix by Gram-Schmidt process.
+ * Row which is linearly dependent on previous ones is replaced with random vector.
+ */
+static void projection_orthonormalize(double* rows, size_t n_rows, size_t dim, uint64_t* state)
+{
+	for (size_t i = 0; i < n_rows; i++)
+	{
+		double* row = rows + i * dim;
+		while (true)
+		{
+			double norm = 0;
+			for (size_t j = 0; j < i; j++)
+			{
+				double const* prev = rows + j * dim;
+				double dot = 0;
+				for (size_t k = 0; k < dim; k++)
+					dot += row[k] * prev[k];
+				for (size_t k = 0; k < dim; k++)
+					row[k] -= dot * prev[k];
+			}
+			for (size_t k = 0; k < dim; k++)
+				norm += row[k] * row[k];
+			if (norm > 1e-12)
+			{
+				norm = sqrt(norm);
+				for (size_t k = 0; k < dim; k++)
+					row[k] /= norm;
+				break;
+			}
+			for (size_t k = 0; k < dim; k++)
+				row[k] = projection_gaussian(state);
+		}
+	}
+}
+
+/*
+ * Calculate projection matrix with projection_dim orthonormal rows. Without sample it is random rotation
+ * followed by truncation. Otherwise rows are principal components of the sample: they are found by subspace
+ * iteration with covariance matrix started from the random rotation. Sample is not centered when projected,
+ * so projection is linear and distances between projected vectors do not depend on the mean.
+ * Matrix should be allocated by caller.
+ */
+void hnsw_projection_train(HnswMetadata* meta, coord_t const* sample, size_t n_vectors)
+{
+	size_t dim = meta->dim;
+	size_t r = meta->projection_dim;
+	uint64_t state = PROJECTION_SEED;
+	double* basis = (double*)palloc_extended(r * dim * sizeof(double), MCXT_ALLOC_HUGE);
+
+	for (size_t i = 0; i < r * dim; i++)
+		basis[i] = projection_gaussian(&state);
+	projection_orthonormalize(basis, r, dim, &state);
+
+	if (sample != NULL && n_vectors > 1)
+	{
+		double* cov = (double*)palloc_extended(dim * dim * sizeof(double), MCXT_ALLOC_HUGE | MCXT_ALLOC_ZERO);
+		double* mean = (double*)palloc0(dim * sizeof(double));
+		double* next = (double*)palloc_extended(r * dim * sizeof(double), MCXT_ALLOC_HUGE);
+		double* centered = (double*)palloc(dim * sizeof(double));
+
+		for (size_t i = 0; i < n_vectors; i++)
+			for (size_t k = 0; k < dim; k++)
+				mean[k] += sample[i * dim + k];
+		for (size_t k = 0; k < dim; k++)
+			mean[k] /= n_vectors;
+
+		/* Upper triangle is accumulated and then mirrored: it takes dim^2/2 operations per vector */
+		for (size_t i = 0; i < n_vectors; i++)
+		{
+			CHECK_FOR_INTERRUPTS();
+			for (size_t k = 0; k < dim; k++)
+				centered[k] = sample[i * dim + k] - mean[k];
+			for (size_t k = 0; k < dim; k++)
+				for (size_t l = k; l < dim; l++)
+					cov[k * dim + l] += centered[k] * centered[l];
+		}
+		for (size_t k = 0; k < dim; k++)
+			for (size_t l = 0; l < k; l++)
+				cov[k * dim + l] = cov[l * dim + k];
+
+		for (int iter = 0; iter < PROJECTION_ITERATIONS; iter++)
+		{
+			double* swap;
+			for (size_t i = 0; i < r; i++)
+			{
+				CHECK_FOR_INTERRUPTS();
+				for (size_t k = 0; k < dim; k++)
+				{
+					double sum = 0;
+					for (size_t l = 0; l < dim; l++)
+						sum += cov[k * dim + l] * basis[i * dim + l];
+					next[i * dim + k] = sum;
+				}
+			}
+			projection_orthonormalize(next, r, dim, &state);
+			swap = basis;
+			basis = next;
+			next = swap;
+		}
+		pfree(cov);
+		pfree(mean);
+		pfree(next);
+		pfree(centered);
+	}
+	for (size_t i = 0; i < r * dim; i++)
+		meta->projection[i] = (float)basis[i];
+	pfree(basis);
+}
+
+#define SIMHASH_BITS   64
+/*
+ * Number of differing bits is binomially distributed with standard deviation up to 4, so the margin of two
+ * standard deviations makes the bound optimistic for most neighbors, but not for all of them: neighbor which
+ * is closer than estimated can be missed, trading some recall for fewer page reads.
+ */
+#define SIMHASH_MARGIN 8
+
+/*
+ * SimHash of the vector: signs of its projections to 64 random directions. Direction coordinates are +1 or -1
+ * given by bits of pseudo random number generated from the coordinate number, so they are not stored.
+ */
+void hnsw_link_code(HnswMetadata* meta, coord_t const* vector, HnswLinkCode* code)
+{
+	float sums[SIMHASH_BITS] = {0};
+	float norm = 0;
+
+	for (size_t k = 0; k < meta->dim; k++)
+	{
+		uint64_t state = k;
+		uint64_t signs = projection_random(&state);
+		for (int i = 0; i < SIMHASH_BITS; i++)
+			sums[i] += (signs >> i) & 1 ? vector[k] : -vector[k];
+		norm += vector[k] * vector[k];
+	}
+	code->simhash = 0;
+	for (int i = 0; i < SIMHASH_BITS; i++)
+	{
+		if (sums[i] > 0)
+			code->simhash |= (uint64_t)1 << i;
+	}
+	code->norm = sqrtf(norm);
+}
+
+/*
+ * Optimistic estimation of the distance from the query (meta->query_code) to the vector with the given code.
+ * Angle between vectors is estimated from the number of differing SimHash bits minus the margin.
+ * L2 distance is calculated from the angle and norms, and Manhattan distance is not smaller than it.
+ */
+dist_t hnsw_link_code_bound(HnswMetadata* meta, HnswLinkCode const* code)
+{
+	int bits = (int)hamming_dist(&meta->query_code.simhash, &code->simhash, 1) - SIMHASH_MARGIN;
+	double cos_angle = bits <= 0 ? 1 : cos(M_PI * bits / SIMHASH_BITS);
+	double qnorm = meta->query_code.norm;
+	double l2;
+
+	if (meta->dist_func == DIST_COSINE)
+		return (dist_t)(1 - cos_angle);
+	l2 = qnorm * qnorm + code->norm * code->norm - 2 * qnorm * code->norm * cos_angle;
+	return (dist_t)sqrt(Max(l2, 0));
+}
+
+/*
+ * Encode vector in index format.
+ * Binary code contains sign bits of coordinates and projected vector - its projection_dim coordinates,
+ * both are followed by the original vector: it is stored separately from the code in vector page.
+ * For int8 scalar quantization code = (x - offset) / scale. Scale is the same for all dimensions,
+ * so that L2 and Manhattan distances between codes are calculated in integers.
+ * Coordinates out of trained range are clamped.
+ */
+void hnsw_quantize(HnswMetadata* meta, coord_t const* src, void* dst)
+{
+	uint8_t* codes = (uint8_t*)dst;
+	uint16_t* halfs = (uint16_t*)dst;
+
+	/* Padding of encoded vector is zeroed to make pages content deterministic */
+	memset(dst, 0, meta->data_size);
+	switch (meta->quantization)
+	{
+		case QUANT_INT8:
+			for (size_t i = 0; i < meta->dim; i++)
+			{
+				float code = rintf((src[i] - meta->sq_offsets[i]) / meta->sq_scale);
+				codes[i] = code <= 0 ? 0 : code >= 255 ? 255 : (uint8_t)code;
+			}
+			break;
+		case QUANT_FLOAT16:
+			for (size_t i = 0; i < meta->dim; i++)
+				halfs[i] = float_to_float16(src[i]);
+			break;
+		case QUANT_BFLOAT16:
+			for (size_t i = 0; i < meta->dim; i++)
+				halfs[i] = float_to_bfloat16(src[i]);
+			break;
+		case QUANT_BINARY:
+			for (size_t i = 0; i < meta->dim; i++)
+			{
+				if (src[i] > 0)
+					((uint64_t*)dst)[i / 64] |= (uint64_t)1 << (i % 64);
+			}
+			break;
+		case QUANT_PROJECTION:
+		{
+			coord_t* projected = (coord_t*)dst;
+			for (size_t i = 0; i < meta->projection_dim; i++)
+			{
+				float const* row = meta->projection + i * meta->dim;
+				float sum = 0;
+				for (size_t k = 0; k < meta->dim; k++)
+					sum += row[k] * src[k];
+				projected[i] = sum;
+			}
+			break;
+		}
+		case QUANT_PQ:
+		{
+			float residual = 0;
+			for (size_t j = 0; j < meta->pq_subvectors; j++)
+			{
+				dist_t dist;
+				codes[j] = pq_nearest_centroid(meta, j, src + PQ_START(meta, j), &dist);
+				residual += dist;
+			}
+			if (meta->dist_func != DIST_MANHATTAN)
+				residual = sqrtf(residual);
+			memcpy(codes + HNSW_PQ_RESIDUAL_OFFSET(meta->pq_subvectors), &residual, sizeof(residual));
+			break;
+		}
+		default:
+			memcpy(dst, src, meta->data_size);
+	}
+	/* Full precision vector used to rescore candidates follows the code (see HNSW_FULL_VECTOR) */
+	if (meta->quantization == QUANT_BINARY || meta->quantization == QUANT_PROJECTION)
+		memcpy((char*)dst + meta->data_size, src, meta->dim * sizeof(coord_t));
+}
+
+/*
+ * Maximal difference between distance calculated for quantized vectors and exact distance:
+ * quantization error of the query (code is its quantized value) plus maximal error of the stored vector.
+ * It is used to return lower bound of the distance for rerank. Only int8 quantization has such bound
+ * (except cosine distance), for other formats -1 is returned.
+ */
+dist_t hnsw_quantization_error(HnswMetadata* meta, coord_t const* query, void const* code)
+{
+	uint8_t const* codes = (uint8_t const*)code;
+	dist_t error = 0;
+
+	if (meta->quantization != QUANT_INT8 || meta->dist_func == DIST_COSINE)
+		return -1;
+
+	for (size_t i = 0; i < meta->dim; i++)
+	{
+		dist_t diff = fabs(query[i] - (meta->sq_offsets[i] + meta->sq_scale * codes[i]));
+		error += meta->dist_func == DIST_L2 ? diff * diff : diff;
+	}
+	return meta->dist_func == DIST_L2
+		? sqrtf(error) + meta->sq_scale / 2 * sqrtf((float)meta->dim)
+		: error + meta->sq_scale / 2 * meta->dim;
+}
+
 static dist_t (*dist_func_table[3])(coord_t const* ax, coord_t const* bx, size_t size);
 
 void hnsw_init_dist_func(void)
@@ -161,8 +1099,23 @@ void hnsw_init_dist_func(void)
 #ifdef __x86_64__
     dist_func_table[DIST_L2] = __builtin_cpu_supports("avx2")
 		? l2_dist_impl_avx2 : l2_dist_impl_sse;
+	int8_l2_sum = __builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512bw")
+		? int8_l2_sum_avx512
+		: __builtin_cpu_supports("avx2") ? int8_l2_sum_avx2 : int8_l2_sum_impl;
+	int8_l1_sum = __builtin_cpu_supports("avx2") ? int8_l1_sum_avx2 : int8_l1_sum_impl;
+	float16_l2_dist = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c") ? float16_l2_dist_avx2 : NULL;
+	bfloat16_l2_dist = __builtin_cpu_supports("avx2") ? bfloat16_l2_dist_avx2 : NULL;
+	bfloat16_cosine_dist = __builtin_cpu_supports("avx512bf16") ? bfloat16_cosine_dist_avx512 : NULL;
+	pq_lookup = __builtin_cpu_supports("avx2") ? pq_lookup_avx2 : pq_lookup_impl;
+	hamming_dist = __builtin_cpu_supports("avx512vpopcntdq")
+		? hamming_avx512
+		: __builtin_cpu_supports("popcnt") ? hamming_popcnt : hamming_impl;
 #else
 	dist_func_table[DIST_L2] = l2_dist_impl;
+	int8_l2_sum = int8_l2_sum_impl;
+	int8_l1_sum = int8_l1_sum_impl;
+	pq_lookup = pq_lookup_impl;
+	hamming_dist = hamming_impl;
 #endif
 	dist_func_table[DIST_COSINE] = cosine_dist_impl;
 	dist_func_table[DIST_MANHATTAN] = manhattan_dist_impl;
@@ -172,3 +1125,88 @@ dist_t hnsw_dist_func(dist_func_t dist_func, coord_t const* ax, coord_t const* b
 {
 	return dist_func_table[dist_func](ax, bx, dim);
 }
+
+#define IVF_ITERATIONS 10 /* number of k-means iterations */
+
+/*
+ * Train centroids of IVF lists by k-means clustering of the sample using distance function of the index.
+ * Initial centroids are sample vectors taken with equal steps. If table is empty, centroids are
+ * coordinate axes, so that cosine distance to them is defined.
+ */
+void hnsw_ivf_train(HnswMetadata* meta, coord_t const* sample, size_t n_vectors, coord_t* centroids, size_t n_centroids)
+{
+	size_t dim = meta->dim;
+	double* sums;
+	size_t* counts;
+
+	for (size_t c = 0; c < n_centroids; c++)
+	{
+		if (n_vectors != 0)
+			memcpy(centroids + c * dim, sample + c * n_vectors / n_centroids * dim, dim * sizeof(coord_t));
+		else
+		{
+			memset(centroids + c * dim, 0, dim * sizeof(coord_t));
+			centroids[c * dim + c % dim] = 1;
+		}
+	}
+	if (n_vectors <= n_centroids)
+		return;
+
+	sums = (double*)palloc_extended(n_centroids * dim * sizeof(double), MCXT_ALLOC_HUGE);
+	counts = (size_t*)palloc(n_centroids * sizeof(size_t));
+	for (int iter = 0; iter < IVF_ITERATIONS; iter++)
+	{
+		memset(sums, 0, n_centroids * dim * sizeof(double));
+		memset(counts, 0, n_centroids * sizeof(size_t));
+		for (size_t i = 0; i < n_vectors; i++)
+		{
+			coord_t const* x = sample + i * dim;
+			size_t best = 0;
+			dist_t min_dist = dist_func_table[meta->dist_func](x, centroids, dim);
+			for (size_t c = 1; c < n_centroids; c++)
+			{
+				dist_t dist = dist_func_table[meta->dist_func](x, centroids + c * dim, dim);
+				if (dist < min_dist)
+				{
+					min_dist = dist;
+					best = c;
+				}
+			}
+			counts[best] += 1;
+			for (size_t k = 0; k < dim; k++)
+				sums[best * dim + k] += x[k];
+		}
+		/* Centroid without vectors is left unchanged */
+		for (size_t c = 0; c < n_centroids; c++)
+		{
+			if (counts[c] != 0)
+			{
+				for (size_t k = 0; k < dim; k++)
+					centroids[c * dim + k] = (coord_t)(sums[c * dim + k] / counts[c]);
+			}
+		}
+	}
+	pfree(sums);
+	pfree(counts);
+}
+
+/*
+ * Distance between vectors in the index format: quantized vectors are compared without decoding.
+ * If PQ table is set, the first argument is the query and is not used.
+ */
+dist_t hnsw_vector_dist(HnswMetadata* meta, void const* ax, void const* bx)
+{
+	if (meta->quantization == QUANT_INT8)
+		return int8_dist(meta, (uint8_t const*)ax, (uint8_t const*)bx);
+	if (meta->quantization == QUANT_BINARY)
+		return (dist_t)hamming_dist((uint64_t const*)ax, (uint64_t const*)bx, HNSW_BINARY_CODE_SIZE(meta->dim) / sizeof(uint64_t));
+	if (meta->quantization == QUANT_PQ)
+		return meta->pq_table
+			? pq_table_dist(meta, (uint8_t const*)bx)
+			: pq_code_dist(meta, (uint8_t const*)ax, (uint8_t const*)bx);
+	if (meta->quantization == QUANT_PROJECTION)
+		return dist_func_table[meta->dist_func]((coord_t const*)ax, (coord_t const*)bx, meta->projection_dim);
+	if (meta->quantization != QUANT_NONE)
+		return half_dist(meta, (uint16_t const*)ax, (uint16_t const*)bx);
+	return dist_func_table[meta->dist_func]((coord_t const*)ax, (coord_t const*)bx, meta->prefix_dim != 0 ? meta->prefix_dim : meta->dim);
+}
@@ -19,70 +19,44 @@
 #include "access/relation.h"
 #include "access/reloptions.h"
 #include "access/tableam.h"
+#include "access/xloginsert.h"
 #include "catalog/index.h"
 #include "commands/vacuum.h"
+#if PG_VERSION_NUM >= 150000
+#include "common/pg_prng.h"
+#endif
+#include "executor/executor.h"
+#include "funcapi.h"
+#include "miscadmin.h"
 #include "nodes/execnodes.h"
+#include "nodes/nodeFuncs.h"
 #include "nodes/pathnodes.h"
+#include "optimizer/cost.h"
 #include "storage/bufmgr.h"
+#if PG_VERSION_NUM >= 170000
+#include "storage/read_stream.h"
+#endif
 #include "storage/smgr.h"
 #include "utils/guc.h"
+#include "utils/inval.h"
 #include "utils/selfuncs.h"
 #include "utils/spccache.h"
+#include "utils/timestamp.h"
 
 #include <math.h>
 #include <float.h>
 
-#include "embedding.h"
+#include "hnsw.h"
 
 PG_MODULE_MAGIC;
 
 #define HNSW_DISTANCE_PROC 1
-#define HNSW_STACK_SIZE 4
-#define FIRST_PAGE      0
-
-/* Label flags */
-#define DELETED_FLAG 1
 
 PGDLLEXPORT PG_FUNCTION_INFO_V1(l2_distance);
 PGDLLEXPORT PG_FUNCTION_INFO_V1(cosine_distance);
 PGDLLEXPORT PG_FUNCTION_INFO_V1(manhattan_distance);
-
-typedef union {
-	label_t label;
-	struct {
-		ItemPointerData tid;
-		uint16			flags;
-	} pg;
-} HnswLabel;
-
-/*
- * Postgres specific part of HNSW index.
- * We are not poersisting this data, but reconstruct metadata from relation options.
- * There is not protectionf from altering index option for existed index,
- * butinfoirmation stored in opaque part of HNSW page allows to check if critical
- * metadata fields are changed (dimensiopns and maxM).
- */
-typedef struct {
-	HnswMetadata	meta;
-	Relation    	rel;
-	bool            unlogged;  /* Do not need to wallog changes: either relation is unlogged, either index construction */
-	uint64_t     	n_inserted; /* Calculated since start of operation */
-	GenericXLogState* xlog_state; /* XLog state for wal logging updated pages */
-	Buffer          writebuf; /* Currently written page */
-	Buffer          lockbuf; /* First page is used to provide MURSIW access to HNSW index */
-	size_t			n_buffers; /* Number of simultaneously accessed buffers */
-	Buffer			buffers[HNSW_STACK_SIZE];
-} HnswIndex;
-
-/*
- * This information in each HNSW page allows to detectincorrect metadata modification (ALTER INDEX)
- * which affects index format
- */
-typedef struct
-{
-	uint16_t dims;
-	uint16_t maxM;
-} HnswPageOpaque;
+PGDLLEXPORT PG_FUNCTION_INFO_V1(hnsw_search_statistic);
+PGDLLEXPORT PG_FUNCTION_INFO_V1(hnsw_reset_search_statistic);
 
 /*
  * Options associated with HNSW index, only "dims" is mandatory
@@ -93,17 +67,58 @@ typedef struct {
 	int efConstruction;
 	int efSearch;
 	int M;
+	int layout;			/* offset of layout name string */
+	bool slotted;
+	bool compress_links;
+	bool link_codes;
+	int quantization;	/* offset of quantization name string */
+	int pq_subvectors;
+	int prefix_dims;
+	int projection;		/* offset of projection name string */
+	int projection_dims;
+	int lists;
+	double alpha;
 } HnswOptions;
 
 static relopt_kind hnsw_relopt_kind;
 
+static int hnsw_ef_search;
+static int hnsw_max_distance_computations;
+static int hnsw_search_deadline;
+static int hnsw_search_patience;
+static bool hnsw_rerank;
+static int hnsw_rerank_factor;
+static int hnsw_ef_limit_factor;
+static bool hnsw_exact_search_enabled;
+static int hnsw_exact_search_threshold;
+static int hnsw_nprobe;
+
+static ExecutorStart_hook_type prev_executor_start;
+
+HnswSearchStats hnsw_search_stats;
+
+/*
+ * Element of index scan results: distance is calculated by the index, it is approximate for quantized vectors
+ */
+typedef struct {
+	ItemPointerData tid;
+	dist_t          distance;
+} HnswScanResult;
+
 typedef struct {
 	HnswIndex* hnsw;
 	size_t curr;
 	size_t n_results;
 	bool   no_more_results;
+	size_t limit;		/* number of tuples requested by LIMIT clause (0 - unknown), see hnsw_get_scan_limit */
+	bool   exact;		/* linear scan of all elements is used instead of graph search */
+	idx_t  n_elems;		/* number of elements scanned by exact search */
 	ArrayType*	key;
-	ItemPointer results;
+	coord_t*	point;		/* scan key in index format */
+	void*		code;		/* buffer for quantized scan key */
+	float*		pq_table;	/* PQ distances table of scan key */
+	dist_t		query_error; /* maximal error of distances for rerank, negative if rerank is not used */
+	HnswScanResult* results;
 } HnswScanOpaqueData;
 
 typedef HnswScanOpaqueData* HnswScanOpaque;
@@ -113,6 +128,78 @@ typedef HnswScanOpaqueData* HnswScanOpaque;
 #define DEFAULT_M            100
 
 static bool hnsw_add_point(HnswIndex* hnsw, coord_t const* coord, label_t label);
+static bool hnsw_insert_point(HnswIndex* hnsw, coord_t const* coord, label_t label);
+static void hnsw_unpin_buffers(HnswIndex* hnsw);
+static void hnsw_check_meta(HnswMetadata* meta, Page page);
+static void hnsw_executor_start(QueryDesc *queryDesc, int eflags);
+static idx_t hnsw_count_elements(HnswIndex* hnsw);
+
+static HnswLayout
+hnsw_parse_layout(const char* name)
+{
+	if (name == NULL || strcmp(name, "inline") == 0)
+		return HNSW_LAYOUT_INLINE;
+	if (strcmp(name, "split") == 0)
+		return HNSW_LAYOUT_SPLIT;
+	ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("invalid value for \"layout\" option: \"%s\"", name),
+			 errdetail("Valid values are \"inline\" and \"split\".")));
+}
+
+static void
+hnsw_validate_layout(const char* value)
+{
+	(void)hnsw_parse_layout(value);
+}
+
+static quantization_t
+hnsw_parse_quantization(const char* name)
+{
+	if (name == NULL || strcmp(name, "none") == 0)
+		return QUANT_NONE;
+	if (strcmp(name, "int8") == 0)
+		return QUANT_INT8;
+	if (strcmp(name, "float16") == 0)
+		return QUANT_FLOAT16;
+	if (strcmp(name, "bfloat16") == 0)
+		return QUANT_BFLOAT16;
+	if (strcmp(name, "pq") == 0)
+		return QUANT_PQ;
+	if (strcmp(name, "binary") == 0)
+		return QUANT_BINARY;
+	ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("invalid value for \"quantization\" option: \"%s\"", name),
+			 errdetail("Valid values are \"none\", \"int8\", \"float16\", \"bfloat16\", \"pq\" and \"binary\".")));
+}
+
+static void
+hnsw_validate_quantization(const char* value)
+{
+	(void)hnsw_parse_quantization(value);
+}
+
+static HnswProjection
+hnsw_parse_projection(const char* name)
+{
+	if (name == NULL || strcmp(name, "none") == 0)
+		return HNSW_PROJECTION_NONE;
+	if (strcmp(name, "random") == 0)
+		return HNSW_PROJECTION_RANDOM;
+	if (strcmp(name, "pca") == 0)
+		return HNSW_PROJECTION_PCA;
+	ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("invalid value for \"projection\" option: \"%s\"", name),
+			 errdetail("Valid values are \"none\", \"random\" and \"pca\".")));
+}
+
+static void
+hnsw_validate_projection(const char* value)
+{
+	(void)hnsw_parse_projection(value);
+}
 
 PGDLLEXPORT void _PG_init(void);
 
@@ -147,7 +234,160 @@ _PG_init(void)
 					  , AccessExclusiveLock
 #endif
 					  );
+	add_bool_reloption(hnsw_relopt_kind, "slotted", "Store elements in fixed size cache-line aligned slots",
+					   false
+#if PG_VERSION_NUM >= 130000
+					   , AccessExclusiveLock
+#endif
+					   );
+	add_bool_reloption(hnsw_relopt_kind, "compress_links", "Store link lists as sorted varint encoded deltas",
+					   false
+#if PG_VERSION_NUM >= 130000
+					   , AccessExclusiveLock
+#endif
+					   );
+	add_bool_reloption(hnsw_relopt_kind, "link_codes", "Store SimHash codes of neighbors in link lists",
+					   false
+#if PG_VERSION_NUM >= 130000
+					   , AccessExclusiveLock
+#endif
+					   );
+	add_string_reloption(hnsw_relopt_kind, "layout", "Placement of vectors: 'inline' in elements or 'split' to separate vector pages",
+						 "inline", hnsw_validate_layout
+#if PG_VERSION_NUM >= 130000
+						 , AccessExclusiveLock
+#endif
+						 );
+	add_string_reloption(hnsw_relopt_kind, "quantization", "Format of stored vectors: 'none' for float coordinates, 'int8' for scalar quantization, 'float16' or 'bfloat16' for half precision, 'pq' for product quantization, 'binary' for sign bits",
+						 "none", hnsw_validate_quantization
+#if PG_VERSION_NUM >= 130000
+						 , AccessExclusiveLock
+#endif
+						 );
+	add_int_reloption(hnsw_relopt_kind, "pq_subvectors", "Number of subvectors encoded by product quantization (0 - one per 8 dimensions)",
+					  0, 0, INT_MAX
+#if PG_VERSION_NUM >= 130000
+					  , AccessExclusiveLock
+#endif
+					  );
+	add_int_reloption(hnsw_relopt_kind, "prefix_dims", "Number of leading dimensions used to build and search the graph (0 - all)",
+					  0, 0, INT_MAX
+#if PG_VERSION_NUM >= 130000
+					  , AccessExclusiveLock
+#endif
+					  );
+	add_string_reloption(hnsw_relopt_kind, "projection", "Projection of vectors used to build and search the graph: 'none', 'random' or 'pca'",
+						 "none", hnsw_validate_projection
+#if PG_VERSION_NUM >= 130000
+						 , AccessExclusiveLock
+#endif
+						 );
+	add_int_reloption(hnsw_relopt_kind, "projection_dims", "Number of dimensions of projected vectors (0 - quarter of dimensions)",
+					  0, 0, INT_MAX
+#if PG_VERSION_NUM >= 130000
+					  , AccessExclusiveLock
+#endif
+					  );
+	add_int_reloption(hnsw_relopt_kind, "lists", "Number of IVF posting lists: graph is built for their centroids (0 - graph of all vectors)",
+					  0, 0, INT_MAX
+#if PG_VERSION_NUM >= 130000
+					  , AccessExclusiveLock
+#endif
+					  );
+	add_real_reloption(hnsw_relopt_kind, "alpha", "Pruning parameter of neighbors: values larger than 1 keep more long links and make search start from medoid as in Vamana",
+					   1.0, 1.0, 10.0
+#if PG_VERSION_NUM >= 130000
+					   , AccessExclusiveLock
+#endif
+					   );
+	DefineCustomIntVariable("embedding.ef_search",
+							"Size of the dynamic candidate list used by HNSW index search.",
+							"If 0, efsearch option of the index is used.",
+							&hnsw_ef_search,
+							0, 0, INT_MAX,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
+	DefineCustomIntVariable("embedding.max_distance_computations",
+							"Maximal number of distances calculated by HNSW index search.",
+							"Search returns the best results found when the limit is reached. If 0, number of distance calculations is not limited.",
+							&hnsw_max_distance_computations,
+							0, 0, INT_MAX,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
+	DefineCustomIntVariable("embedding.search_deadline",
+							"Maximal duration of HNSW index scan in microseconds.",
+							"Search returns the best results found when the deadline expires. If 0, duration is not limited.",
+							&hnsw_search_deadline,
+							0, 0, INT_MAX,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
+	DefineCustomIntVariable("embedding.ef_limit_factor",
+							"Minimal size of the dynamic candidate list relative to LIMIT of the query.",
+							"Size of the list is increased to this number of tuples per requested tuple. If 0, LIMIT is not taken in account.",
+							&hnsw_ef_limit_factor,
+							2, 0, 1024,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
+	DefineCustomBoolVariable("embedding.exact_search",
+							 "Use linear scan of all index elements instead of graph search.",
+							 "Exact search returns true nearest neighbors sorted by single pass through the index, search limits are not applied to it.",
+							 &hnsw_exact_search_enabled,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+	DefineCustomIntVariable("embedding.exact_search_threshold",
+							"Maximal number of index elements for which exact search is used.",
+							"Linear scan of small index is faster than graph search. If 0, exact search is used only when enabled by embedding.exact_search.",
+							&hnsw_exact_search_threshold,
+							0, 0, INT_MAX,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
+	DefineCustomBoolVariable("embedding.rerank",
+							 "Return tuples from index with quantized vectors in order of exact distances.",
+							 "Index returns lower bound of the distance and executor reorders tuples by distance calculated for heap tuples.",
+							 &hnsw_rerank,
+							 true,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+	DefineCustomIntVariable("embedding.rerank_factor",
+							"Ratio of number of candidates rescored using full precision vectors to number of results for binary quantization.",
+							"Candidates are found by Hamming distance between sign bits of coordinates.",
+							&hnsw_rerank_factor,
+							4, 1, 1024,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
+	DefineCustomIntVariable("embedding.nprobe",
+							"Number of IVF posting lists scanned by index search.",
+							"Lists of centroids nearest to the query are scanned.",
+							&hnsw_nprobe,
+							8, 1, INT_MAX,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
+	DefineCustomIntVariable("embedding.search_patience",
+							"Number of consecutive expansions not improving results after which HNSW index search is stopped.",
+							"Expansion of candidate improves results if some of its neighbors is included in the dynamic candidate list. If 0, search is not stopped early.",
+							&hnsw_search_patience,
+							0, 0, INT_MAX,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
 	hnsw_init_dist_func();
+	hnsw_register_rmgr();
+	hnsw_cache_init();
+	hnsw_prewarm_init();
+	flat_init();
+
+	prev_executor_start = ExecutorStart_hook;
+	ExecutorStart_hook = hnsw_executor_start;
 }
 
 static void
@@ -183,12 +423,18 @@ hnsw_build_callback(Relation index,
 	u.pg.tid = *tid;
 	u.pg.flags = 0;
 
-	if (!hnsw_add_point(hnsw, (coord_t*)ARR_DATA_PTR(array), u.label))
+	if (hnsw->vector_sum)
+	{
+		coord_t const* coords = (coord_t*)ARR_DATA_PTR(array);
+		for (size_t i = 0; i < hnsw->meta.dim; i++)
+			hnsw->vector_sum[i] += coords[i];
+	}
+	if (!hnsw_insert_point(hnsw, (coord_t*)ARR_DATA_PTR(array), u.label))
 		elog(ERROR, "HNSW index insert failed");
 	pfree(array);
 }
 
-static dist_func_t
+dist_func_t
 hnsw_resolve_dist_func(Relation index)
 {
 	FmgrInfo* proc_info = index_getprocinfo(index, 1, HNSW_DISTANCE_PROC);
@@ -202,6 +448,192 @@ hnsw_resolve_dist_func(Relation index)
 		elog(ERROR, "Function is not supported by HNSW inodex");
 }
 
+/* Maximal number of vectors sampled to train product quantizer */
+#define HNSW_PQ_SAMPLE_SIZE (64 * HNSW_PQ_CENTROIDS)
+
+/* Maximal number of vectors sampled to calculate principal components */
+#define HNSW_PCA_SAMPLE_SIZE 4096
+
+/*
+ * State of quantizer training: range of each coordinate for int8 quantization
+ * and random sample of vectors for product quantization, PCA and IVF centroids
+ */
+typedef struct
+{
+	HnswIndex* hnsw;
+	float*     min;
+	float*     max;
+	size_t     n_vectors;
+	coord_t*   sample;
+	size_t     sample_size;
+} HnswTrainState;
+
+static void
+hnsw_train_callback(Relation index,
+#if PG_VERSION_NUM >= 130000
+					ItemPointer tid,
+#else
+					HeapTuple hup,
+#endif
+					Datum *values, bool *isnull, bool tupleIsAlive, void *state)
+{
+	HnswTrainState* train = (HnswTrainState*) state;
+	size_t dim = train->hnsw->meta.dim;
+	ArrayType* array;
+	coord_t* coords;
+	int n_items;
+
+	/* Skip nulls */
+	if (isnull[0])
+		return;
+
+	array = DatumGetArrayTypeP(values[0]);
+	n_items = ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array));
+	if (n_items != dim)
+	{
+		elog(ERROR, "Wrong number of dimensions: %d instead of %d expected",
+			 n_items, (int)dim);
+	}
+	coords = (coord_t*)ARR_DATA_PTR(array);
+	if (train->sample)
+	{
+		/* Reservoir sampling */
+		size_t pos = train->n_vectors;
+		if (pos >= train->sample_size)
+		{
+#if PG_VERSION_NUM >= 150000
+			pos = (size_t)pg_prng_uint64_range(&pg_global_prng_state, 0, train->n_vectors);
+#else
+			pos = (size_t)(random() % (train->n_vectors + 1));
+#endif
+		}
+		if (pos < train->sample_size)
+			memcpy(train->sample + pos * dim, coords, dim * sizeof(coord_t));
+	}
+	else
+	{
+		for (size_t i = 0; i < dim; i++)
+		{
+			if (train->n_vectors == 0 || coords[i] < train->min[i])
+				train->min[i] = coords[i];
+			if (train->n_vectors == 0 || coords[i] > train->max[i])
+				train->max[i] = coords[i];
+		}
+	}
+	train->n_vectors += 1;
+	if ((Pointer)array != DatumGetPointer(values[0]))
+		pfree(array);
+}
+
+/*
+ * Train product quantizer on the random sample of vectors. Size of the sample is limited by maintenance_work_mem.
+ */
+static void
+hnsw_train_pq(HnswIndex* hnsw, Relation indexRel, Relation heapRel)
+{
+	IndexInfo* indexInfo = BuildIndexInfo(indexRel);
+	HnswTrainState train;
+
+	train.hnsw = hnsw;
+	train.n_vectors = 0;
+	train.sample_size = Min(HNSW_PQ_SAMPLE_SIZE, (size_t)maintenance_work_mem * 1024 / (hnsw->meta.dim * sizeof(coord_t)));
+	train.sample_size = Max(train.sample_size, HNSW_PQ_CENTROIDS);
+	train.sample = (coord_t*)palloc_extended(train.sample_size * hnsw->meta.dim * sizeof(coord_t), MCXT_ALLOC_HUGE);
+	table_index_build_scan(heapRel, indexRel, indexInfo,
+						   true, true, hnsw_train_callback, (void *)&train, NULL);
+
+	hnsw->meta.pq_codebook = (float*)palloc_extended(HNSW_PQ_CENTROIDS * hnsw->meta.dim * sizeof(float), MCXT_ALLOC_HUGE);
+	hnsw_pq_train(&hnsw->meta, train.sample, Min(train.n_vectors, train.sample_size));
+	pfree(train.sample);
+}
+
+/*
+ * Calculate projection matrix: random projection doesn't depend on data, PCA is performed on the random sample
+ * of vectors limited by maintenance_work_mem.
+ */
+static void
+hnsw_train_projection(HnswIndex* hnsw, Relation indexRel, Relation heapRel)
+{
+	HnswTrainState train;
+
+	train.hnsw = hnsw;
+	train.n_vectors = 0;
+	train.sample = NULL;
+	if (hnsw->projection == HNSW_PROJECTION_PCA)
+	{
+		IndexInfo* indexInfo = BuildIndexInfo(indexRel);
+		train.sample_size = Min(HNSW_PCA_SAMPLE_SIZE, (size_t)maintenance_work_mem * 1024 / (hnsw->meta.dim * sizeof(coord_t)));
+		train.sample_size = Max(train.sample_size, 2);
+		train.sample = (coord_t*)palloc_extended(train.sample_size * hnsw->meta.dim * sizeof(coord_t), MCXT_ALLOC_HUGE);
+		table_index_build_scan(heapRel, indexRel, indexInfo,
+							   true, true, hnsw_train_callback, (void *)&train, NULL);
+	}
+	hnsw->meta.projection = (float*)palloc_extended(HNSW_CODEBOOK_SIZE(hnsw) * sizeof(float), MCXT_ALLOC_HUGE);
+	hnsw_projection_train(&hnsw->meta, train.sample, Min(train.n_vectors, train.sample_size));
+	if (train.sample)
+		pfree(train.sample);
+}
+
+/* Number of vectors sampled to train each IVF centroid */
+#define HNSW_IVF_SAMPLE_PER_LIST 32
+
+/*
+ * Train centroids of IVF lists by k-means clustering of the random sample of vectors limited by maintenance_work_mem
+ */
+static coord_t*
+hnsw_train_ivf(HnswIndex* hnsw, Relation indexRel, Relation heapRel)
+{
+	IndexInfo* indexInfo = BuildIndexInfo(indexRel);
+	HnswTrainState train;
+	coord_t* centroids;
+
+	train.hnsw = hnsw;
+	train.n_vectors = 0;
+	train.sample_size = Min(HNSW_IVF_SAMPLE_PER_LIST * hnsw->n_lists, (size_t)maintenance_work_mem * 1024 / (hnsw->meta.dim * sizeof(coord_t)));
+	train.sample_size = Max(train.sample_size, hnsw->n_lists);
+	train.sample = (coord_t*)palloc_extended(train.sample_size * hnsw->meta.dim * sizeof(coord_t), MCXT_ALLOC_HUGE);
+	table_index_build_scan(heapRel, indexRel, indexInfo,
+						   true, true, hnsw_train_callback, (void *)&train, NULL);
+
+	centroids = (coord_t*)palloc_extended(hnsw->n_lists * hnsw->meta.dim * sizeof(coord_t), MCXT_ALLOC_HUGE);
+	hnsw_ivf_train(&hnsw->meta, train.sample, Min(train.n_vectors, train.sample_size), centroids, hnsw->n_lists);
+	pfree(train.sample);
+	return centroids;
+}
+
+/*
+ * Train int8 quantizer: offset of each coordinate is its minimal value and scale is chosen to fit
+ * the widest range in 256 codes. If table is empty, range [-1, 1] is assumed.
+ */
+static void
+hnsw_train_quantizer(HnswIndex* hnsw, Relation indexRel, Relation heapRel)
+{
+	IndexInfo* indexInfo = BuildIndexInfo(indexRel);
+	HnswTrainState train;
+	float range = 0;
+
+	train.hnsw = hnsw;
+	train.min = (float*)palloc(hnsw->meta.dim * sizeof(float));
+	train.max = (float*)palloc(hnsw->meta.dim * sizeof(float));
+	train.n_vectors = 0;
+	train.sample = NULL;
+	table_index_build_scan(heapRel, indexRel, indexInfo,
+						   true, true, hnsw_train_callback, (void *)&train, NULL);
+
+	for (size_t i = 0; i < hnsw->meta.dim; i++)
+	{
+		if (train.n_vectors == 0)
+		{
+			train.min[i] = -1;
+			train.max[i] = 1;
+		}
+		range = Max(range, train.max[i] - train.min[i]);
+	}
+	hnsw->meta.sq_offsets = train.min;
+	hnsw->meta.sq_scale = range > 0 ? range / 255 : 1;
+	pfree(train.max);
+}
+
 static void
 hnsw_populate(HnswIndex* hnsw, Relation indexRel, Relation heapRel)
 {
@@ -211,10 +643,12 @@ hnsw_populate(HnswIndex* hnsw, Relation indexRel, Relation heapRel)
 						   true, true, hnsw_build_callback, (void *)hnsw, NULL);
 }
 
-static HnswIndex*
-hnsw_get_index(Relation indexRel)
+/*
+ * Calculate format of elements from index options
+ */
+static void
+hnsw_init_index(HnswIndex* hnsw, Relation indexRel)
 {
-	HnswIndex* hnsw = (HnswIndex*)palloc(sizeof(HnswIndex));
 	HnswOptions *opts = (HnswOptions *) indexRel->rd_options;
 	if (opts == NULL || opts->dims == 0) {
 		elog(ERROR, "HNSW index requires 'dims' to be specified");
@@ -222,83 +656,421 @@ hnsw_get_index(Relation indexRel)
 	hnsw->meta.dim = opts->dims;
 	hnsw->meta.M = opts->M;
 	hnsw->meta.maxM = hnsw->meta.M * 2;
-	hnsw->meta.data_size = hnsw->meta.dim * sizeof(coord_t);
-	hnsw->meta.offset_data = (hnsw->meta.maxM + 1) * sizeof(idx_t);
-	hnsw->meta.offset_label = hnsw->meta.offset_data + hnsw->meta.data_size;
-	hnsw->meta.size_data_per_element = hnsw->meta.offset_label + sizeof(label_t);
-	hnsw->meta.elems_per_page = (BLCKSZ - MAXALIGN(SizeOfPageHeaderData) - sizeof(HnswPageOpaque)) / (hnsw->meta.size_data_per_element + sizeof(ItemIdData));
-	if (hnsw->meta.elems_per_page == 0)
+	hnsw->meta.quantization = hnsw_parse_quantization(opts->quantization ? (char*)opts + opts->quantization : NULL);
+	hnsw->meta.sq_scale = 0;
+	hnsw->meta.sq_offsets = NULL;
+	hnsw->meta.pq_subvectors = 0;
+	hnsw->meta.pq_codebook = NULL;
+	hnsw->meta.pq_table = NULL;
+	hnsw->meta.pq_bounds = false;
+	hnsw->meta.rerank_factor = 0;
+	hnsw->meta.prefix_dim = opts->prefix_dims;
+	if (hnsw->meta.prefix_dim > hnsw->meta.dim)
+		elog(ERROR, "Number of prefix dimensions should not be larger than number of dimensions");
+	if (hnsw->meta.prefix_dim != 0 && hnsw->meta.quantization != QUANT_NONE)
+		elog(ERROR, "Prefix dimensions can not be used with quantization");
+	hnsw->projection = hnsw_parse_projection(opts->projection ? (char*)opts + opts->projection : NULL);
+	hnsw->meta.projection_dim = 0;
+	hnsw->meta.projection = NULL;
+	if (hnsw->projection != HNSW_PROJECTION_NONE)
+	{
+		if (hnsw->meta.quantization != QUANT_NONE || hnsw->meta.prefix_dim != 0)
+			elog(ERROR, "Projection can not be used with quantization or prefix dimensions");
+		/* Projected vectors are stored in the format of quantized vectors */
+		hnsw->meta.quantization = QUANT_PROJECTION;
+		hnsw->meta.projection_dim = opts->projection_dims != 0 ? opts->projection_dims : Max(hnsw->meta.dim / 4, 1);
+		if (hnsw->meta.projection_dim > hnsw->meta.dim)
+			elog(ERROR, "Number of projection dimensions should not be larger than number of dimensions");
+	}
+	if (hnsw->meta.quantization == QUANT_INT8)
+	{
+		/* Quantization parameters are stored in the metapage */
+		if (hnsw->meta.dim > HNSW_MAX_QUANTIZED_DIMS)
+			elog(ERROR, "int8 quantization supports at most %d dimensions", (int)HNSW_MAX_QUANTIZED_DIMS);
+		hnsw->meta.data_size = TYPEALIGN(sizeof(coord_t), hnsw->meta.dim);
+	}
+	else if (hnsw->meta.quantization == QUANT_PQ)
+	{
+		/* By default each subvector has 8 coordinates */
+		hnsw->meta.pq_subvectors = opts->pq_subvectors != 0 ? opts->pq_subvectors : Max(hnsw->meta.dim / 8, 1);
+		if (hnsw->meta.pq_subvectors > hnsw->meta.dim)
+			elog(ERROR, "Number of PQ subvectors should not be larger than number of dimensions");
+		hnsw->meta.data_size = HNSW_PQ_RESIDUAL_OFFSET(hnsw->meta.pq_subvectors) + sizeof(float);
+	}
+	else if (hnsw->meta.quantization == QUANT_BINARY)
+		hnsw->meta.data_size = HNSW_BINARY_CODE_SIZE(hnsw->meta.dim);
+	else if (hnsw->meta.quantization == QUANT_PROJECTION)
+		hnsw->meta.data_size = hnsw->meta.projection_dim * sizeof(coord_t);
+	else if (hnsw->meta.quantization != QUANT_NONE)
+		hnsw->meta.data_size = TYPEALIGN(sizeof(coord_t), hnsw->meta.dim * sizeof(uint16));
+	else
+		hnsw->meta.data_size = (hnsw->meta.prefix_dim != 0 ? hnsw->meta.prefix_dim : hnsw->meta.dim) * sizeof(coord_t);
+	hnsw->layout = hnsw_parse_layout(opts->layout ? (char*)opts + opts->layout : NULL);
+	hnsw->vector_size = hnsw->meta.data_size;
+	if (HNSW_RESCORED(&hnsw->meta))
+	{
+		/*
+		 * Codes used by graph traversal are stored in the elements, and vector pages contain full precision vectors
+		 * which are read only to rescore candidates. So layout of such index is always the same.
+		 */
+		hnsw->layout = HNSW_LAYOUT_INLINE;
+		hnsw->vector_size = hnsw->meta.dim * sizeof(coord_t);
+	}
+	hnsw->slotted = opts->slotted;
+	hnsw->compress_links = opts->compress_links;
+	hnsw->meta.link_codes = opts->link_codes;
+	hnsw->n_lists = opts->lists;
+	hnsw->vector_sum = NULL;
+	hnsw->meta.alpha = (float)opts->alpha;
+	if (hnsw->n_lists != 0 && HNSW_RESCORED(&hnsw->meta))
+		elog(ERROR, "IVF lists can not be used with binary quantization, projection or prefix dimensions");
+	if (hnsw->meta.link_codes && (hnsw->compress_links || hnsw->meta.quantization != QUANT_NONE || hnsw->meta.prefix_dim != 0))
+		elog(ERROR, "Link codes can not be used with compressed links, quantization, projection or prefix dimensions");
+	hnsw->links_size = hnsw->compress_links
+		? HNSW_COMPRESSED_LINKS_SIZE(hnsw->meta.maxM)
+		: hnsw->meta.link_codes
+		? HNSW_LINKS_WITH_CODES_SIZE(hnsw->meta.maxM) + sizeof(HnswLinkCode)
+		: (hnsw->meta.maxM + 1) * sizeof(idx_t);
+	if (hnsw->slotted)
+	{
+		/*
+		 * Elements are stored in fixed size slots without line pointers.
+		 * Slots are aligned on cache line and vector is placed at the beginning of the slot,
+		 * so vectors are aligned for SIMD loads.
+		 */
+		hnsw->meta.offset_data = 0;
+		hnsw->meta.offset_links = hnsw->layout == HNSW_LAYOUT_SPLIT ? 0 : hnsw->meta.data_size;
+		hnsw->meta.offset_label = hnsw->meta.offset_links + hnsw->links_size;
+		hnsw->meta.size_data_per_element = hnsw->meta.offset_label + sizeof(label_t);
+		hnsw->slot_size = hnsw->layout == HNSW_LAYOUT_SPLIT
+			? MAXALIGN(hnsw->meta.size_data_per_element)
+			: TYPEALIGN(HNSW_SLOT_ALIGN, hnsw->meta.size_data_per_element);
+		hnsw->meta.elems_per_page = (BLCKSZ - HNSW_SLOTS_OFFSET - MAXALIGN(sizeof(HnswPageOpaque))) / hnsw->slot_size;
+		hnsw->vectors_offset = HNSW_SLOTS_OFFSET;
+		hnsw->vector_stride = TYPEALIGN(HNSW_SLOT_ALIGN, hnsw->vector_size);
+	}
+	else
+	{
+		hnsw->meta.offset_links = 0;
+		hnsw->meta.offset_data = hnsw->links_size;
+		if (hnsw->layout == HNSW_LAYOUT_SPLIT)
+		{
+			/* Element contains only link list and label: vector is stored in vector page */
+			hnsw->meta.offset_label = hnsw->meta.offset_data;
+			hnsw->meta.size_data_per_element = hnsw->meta.offset_label + sizeof(label_t);
+			hnsw->meta.elems_per_page = (BLCKSZ - MAXALIGN(SizeOfPageHeaderData) - MAXALIGN(sizeof(HnswPageOpaque))) / (MAXALIGN(hnsw->meta.size_data_per_element) + sizeof(ItemIdData));
+		}
+		else
+		{
+			hnsw->meta.offset_label = hnsw->meta.offset_data + hnsw->meta.data_size;
+			hnsw->meta.size_data_per_element = hnsw->meta.offset_label + sizeof(label_t);
+			hnsw->meta.elems_per_page = (BLCKSZ - MAXALIGN(SizeOfPageHeaderData) - MAXALIGN(sizeof(HnswPageOpaque))) / (MAXALIGN(hnsw->meta.size_data_per_element) + sizeof(ItemIdData));
+		}
+		hnsw->slot_size = 0;
+		hnsw->vectors_offset = MAXALIGN(SizeOfPageHeaderData);
+		hnsw->vector_stride = hnsw->vector_size;
+	}
+	hnsw->vectors_per_page = 0;
+	if (hnsw->layout == HNSW_LAYOUT_SPLIT || HNSW_RESCORED(&hnsw->meta))
+	{
+		hnsw->vectors_per_page = (BLCKSZ - hnsw->vectors_offset) / hnsw->vector_stride;
+		if (hnsw->vectors_per_page == 0)
+			elog(ERROR, "Vector doesn't fit in Postgres page");
+	}
+	if (hnsw->meta.elems_per_page == 0 || hnsw->meta.maxM >= HNSW_MAX_LINKS)
 		elog(ERROR, "Element doesn't fit in Postgres page");
+	/* Element is larger than its label, so label page can hold labels of at least one element page */
+	hnsw->group_pages = HNSW_LABELS_PER_PAGE / hnsw->meta.elems_per_page;
+	hnsw->group_elems = hnsw->group_pages * hnsw->meta.elems_per_page;
+	hnsw->group_pages += 1;
+	if (hnsw->vectors_per_page != 0)
+		hnsw->group_pages += (hnsw->group_elems + hnsw->vectors_per_page - 1) / hnsw->vectors_per_page;
 	hnsw->meta.efConstruction = opts->efConstruction;
 	hnsw->meta.efSearch = opts->efSearch;
     hnsw->meta.dist_func = hnsw_resolve_dist_func(indexRel);
 	hnsw->meta.enterpoint_node = 0;
+	hnsw->meta.max_dist_calcs = 0;
+	hnsw->meta.deadline = 0;
+	hnsw->meta.patience = 0;
 	hnsw->rel = indexRel;
 	hnsw->n_buffers = 0;
-	hnsw->xlog_state = NULL;
 	hnsw->n_inserted = 0;
-	hnsw->unlogged = RelationNeedsWAL(indexRel);
+	hnsw->unlogged = !RelationNeedsWAL(indexRel);
 	hnsw->lockbuf = InvalidBuffer;
-	hnsw->writebuf = InvalidBuffer;
-	return hnsw;
+	hnsw->elements_start = FIRST_PAGE + 1 + HNSW_CODEBOOK_PAGES(hnsw);
+	hnsw->n_blocks = InvalidBlockNumber;
+	hnsw->prewarm_generation = 0;
+	hnsw->pending_item = NULL;
+	hnsw->pending_coord = NULL;
+	hnsw->pending_vector = NULL;
+	hnsw->n_pending_links = 0;
+	hnsw->pending_links = NULL;
+	hnsw->links_buf = NULL;
+	hnsw->vector_buf = NULL;
+	hnsw->mcxt = CurrentMemoryContext;
+	hnsw->n_pinned = 0;
+	hnsw->pin_clock = 0;
+	hnsw->batch = NULL;
+	hnsw->batch_blocks = NULL;
+	hnsw->batch_size = 0;
 }
 
 /*
- * Start or restart an index scan
+ * Load state of the graph from metapage. Returns false if index is not initialized yet.
  */
-static IndexScanDesc
-hnsw_beginscan(Relation index, int nkeys, int norderbys)
+static bool
+hnsw_load_meta(HnswIndex* hnsw)
 {
-	IndexScanDesc scan = RelationGetIndexScan(index, nkeys, norderbys);
-	HnswScanOpaque so = (HnswScanOpaque) palloc(sizeof(HnswScanOpaqueData));
-	so->hnsw = hnsw_get_index(index);
-	so->curr = 0;
-	so->n_results = 0;
-	so->results = NULL;
-	so->no_more_results = true;
-	so->key = NULL;
-	scan->opaque = so;
-	return scan;
+	Buffer buf;
+	Page page;
+
+	if (RelationGetNumberOfBlocks(hnsw->rel) == 0)
+		return false;
+
+	buf = ReadBuffer(hnsw->rel, FIRST_PAGE);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	hnsw_check_meta(&hnsw->meta, page);
+	if (((HnswPageOpaque*)PageGetSpecialPointer(page))->flags & HNSW_PAGE_META)
+	{
+		HnswMetaPageData* metad = HnswPageGetMeta(page);
+		if (metad->magic != HNSW_META_MAGIC || metad->version > HNSW_META_VERSION)
+			elog(ERROR, "Invalid metapage of HNSW index \"%s\"", RelationGetRelationName(hnsw->rel));
+		hnsw->meta.enterpoint_node = metad->entry_point;
+		hnsw->elements_start = FIRST_PAGE + 1 + HNSW_CODEBOOK_PAGES(hnsw);
+		if ((hnsw->meta.quantization == QUANT_PQ && metad->pq_subvectors != hnsw->meta.pq_subvectors)
+			|| (hnsw->meta.quantization == QUANT_PROJECTION && metad->pq_subvectors != hnsw->meta.projection_dim)
+			|| (hnsw->n_lists != 0 && metad->n_lists != hnsw->n_lists))
+			elog(ERROR, "Inconsistency with HNSW index metadata: only ef_construction and ef_search options of HNSW index may be altered");
+		if (hnsw->meta.quantization == QUANT_INT8)
+		{
+			/* Quantization flag of the page is checked by hnsw_check_meta, so metapage has version 2 */
+			hnsw->meta.sq_scale = metad->sq_scale;
+			hnsw->meta.sq_offsets = (float*)palloc(hnsw->meta.dim * sizeof(float));
+			memcpy(hnsw->meta.sq_offsets, HnswMetaGetOffsets(metad), hnsw->meta.dim * sizeof(float));
+		}
+	}
+	else
+	{
+		/*
+		 * Created by older version (inline layout, checked by hnsw_check_meta): it has no label pages,
+		 * and elements are appended while there is free space in the page, so elems_per_page is only
+		 * the upper bound of number of elements in the page.
+		 */
+		hnsw->elements_start = FIRST_PAGE;
+		hnsw->group_elems = 0;
+		hnsw->meta.elems_per_page = (BLCKSZ - MAXALIGN(SizeOfPageHeaderData) - HNSW_INLINE_OPAQUE_SIZE) / (hnsw->meta.size_data_per_element + sizeof(ItemIdData));
+	}
+	UnlockReleaseBuffer(buf);
+	return true;
 }
 
 /*
- * Start or restart an index scan
+ * Load codebook of product quantizer or projection matrix into the given memory context.
+ * Codebook pages are never changed after index build.
  */
 static void
-hnsw_rescan(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderbys, int norderbys)
+hnsw_load_codebook(HnswIndex* hnsw, MemoryContext mcxt)
 {
-	HnswScanOpaque so = (HnswScanOpaque) scan->opaque;
-	if (so->results)
+	size_t size = HNSW_CODEBOOK_SIZE(hnsw);
+	float* codebook = (float*)MemoryContextAllocExtended(mcxt, size * sizeof(float), MCXT_ALLOC_HUGE);
+
+	for (BlockNumber i = 0; i < HNSW_CODEBOOK_PAGES(hnsw); i++)
 	{
-		pfree(so->results);
-		so->results = NULL;
+		Buffer buf = ReadBuffer(hnsw->rel, FIRST_PAGE + 1 + i);
+		size_t offs = i * HNSW_CODEBOOK_PER_PAGE;
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		memcpy(codebook + offs, PageGetContents(BufferGetPage(buf)),
+			   Min(size - offs, HNSW_CODEBOOK_PER_PAGE) * sizeof(float));
+		UnlockReleaseBuffer(buf);
 	}
-	so->curr = 0;
-	if (orderbys && scan->numberOfOrderBys > 0)
-		memmove(scan->orderByData, orderbys, scan->numberOfOrderBys * sizeof(ScanKeyData));
+	if (hnsw->meta.quantization == QUANT_PQ)
+		hnsw->meta.pq_codebook = codebook;
+	else
+		hnsw->meta.projection = codebook;
 }
 
 /*
- * Fetch the next tuple in the given scan
+ * Copy offsets of int8 quantizer to the given memory context
  */
-static bool
-hnsw_gettuple(IndexScanDesc scan, ScanDirection dir)
+static float*
+hnsw_copy_offsets(HnswMetadata* meta, MemoryContext mcxt)
 {
-	HnswScanOpaque 	so = (HnswScanOpaque) scan->opaque;
-	size_t			n_results;
-	label_t*		results;
+	float* offsets = (float*)MemoryContextAlloc(mcxt, meta->dim * sizeof(float));
+	memcpy(offsets, meta->sq_offsets, meta->dim * sizeof(float));
+	return offsets;
+}
 
-	/*
-	 * Index can be used to scan backward, but Postgres doesn't support
-	 * backward scan on operators
-	 */
-	Assert(ScanDirectionIsForward(dir));
+/*
+ * Get descriptor of the index for the current operation.
+ * Descriptor is cached in relcache entry: it is invalidated by ALTER INDEX, REINDEX
+ * and when vacuum moves the entry point.
+ */
+static HnswIndex*
+hnsw_get_index(Relation indexRel)
+{
+	HnswIndex* hnsw = (HnswIndex*)palloc(sizeof(HnswIndex));
 
-	if (so->curr == 0)
+	if (indexRel->rd_amcache != NULL)
 	{
-		Datum		value;
-		int         n_items;
-
+		memcpy(hnsw, indexRel->rd_amcache, sizeof(HnswIndex));
+		/* Cached descriptor can be freed by relcache invalidation during operation, so quantizer is copied */
+		if (hnsw->meta.sq_offsets)
+			hnsw->meta.sq_offsets = hnsw_copy_offsets(&hnsw->meta, CurrentMemoryContext);
+		hnsw->rel = indexRel;
+		hnsw_prewarm_register(indexRel, &((HnswIndex*)indexRel->rd_amcache)->prewarm_generation);
+	}
+	else
+	{
+		hnsw_init_index(hnsw, indexRel);
+		/* Index being built has no metapage yet, so its descriptor is not cached */
+		if (hnsw_load_meta(hnsw))
+		{
+			HnswIndex* cached = (HnswIndex*)MemoryContextAlloc(indexRel->rd_indexcxt, sizeof(HnswIndex));
+			/*
+			 * Codebook is too large to be copied for each operation. Unlike rd_amcache, index memory context
+			 * is not reset by relcache invalidation while the index is open, so operations refer to it directly.
+			 */
+			if (HNSW_CODEBOOK_PAGES(hnsw) != 0)
+				hnsw_load_codebook(hnsw, indexRel->rd_indexcxt);
+			memcpy(cached, hnsw, sizeof(HnswIndex));
+			if (hnsw->meta.sq_offsets)
+				cached->meta.sq_offsets = hnsw_copy_offsets(&hnsw->meta, indexRel->rd_indexcxt);
+			indexRel->rd_amcache = cached;
+			hnsw_prewarm_register(indexRel, &cached->prewarm_generation);
+		}
+	}
+	hnsw->rel = indexRel;
+	hnsw->mcxt = CurrentMemoryContext;
+	return hnsw;
+}
+
+/*
+ * Size of dynamic candidate list: embedding.ef_search overrides efsearch option of the index
+ */
+static size_t
+hnsw_get_ef_search(Relation index)
+{
+	return hnsw_ef_search > 0 ? hnsw_ef_search : ((HnswOptions *) index->rd_options)->efSearch;
+}
+
+bool hnsw_search_expired(HnswMetadata* meta)
+{
+	return meta->deadline != 0 && GetCurrentTimestamp() >= meta->deadline;
+}
+
+/*
+ * IVF search: lists of embedding.nprobe centroids nearest to the scan key are located by graph search
+ * and scanned to find efSearch nearest vectors
+ */
+static bool
+hnsw_ivf_search(HnswIndex* hnsw, coord_t const* point, size_t* n_results, label_t** results, dist_t** dists)
+{
+	size_t ef_search = hnsw->meta.efSearch;
+	size_t n_lists;
+	label_t* lists;
+	dist_t* list_dists;
+	bool found;
+
+	hnsw->meta.efSearch = Max(ef_search, (size_t)hnsw_nprobe);
+	found = hnsw_search(&hnsw->meta, point, &n_lists, &lists, &list_dists);
+	hnsw->meta.efSearch = ef_search;
+	if (!found)
+		return false;
+
+	found = hnsw_ivf_scan(hnsw, point, lists, Min(n_lists, (size_t)hnsw_nprobe), ef_search, n_results, results, dists);
+	free(lists);
+	free(list_dists);
+	return found;
+}
+
+/*
+ * Search nearest neighbors of the scan key, using graph, posting lists or linear scan of all elements
+ */
+static void
+hnsw_scan_search(HnswScanOpaque so, size_t* n_results, label_t** results, dist_t** dists)
+{
+	bool found = so->exact
+		? hnsw_exact_search(&so->hnsw->meta, so->point, so->n_elems, n_results, results, dists)
+		: so->hnsw->n_lists != 0
+		? hnsw_ivf_search(so->hnsw, so->point, n_results, results, dists)
+		: hnsw_search(&so->hnsw->meta, so->point, n_results, results, dists);
+	if (!found)
+		elog(ERROR, "HNSW index search failed");
+	hnsw_unpin_buffers(so->hnsw);
+}
+
+/*
+ * Start or restart an index scan
+ */
+static IndexScanDesc
+hnsw_beginscan(Relation index, int nkeys, int norderbys)
+{
+	IndexScanDesc scan = RelationGetIndexScan(index, nkeys, norderbys);
+	HnswScanOpaque so = (HnswScanOpaque) palloc(sizeof(HnswScanOpaqueData));
+	so->hnsw = hnsw_get_index(index);
+	so->curr = 0;
+	so->n_results = 0;
+	so->results = NULL;
+	so->no_more_results = true;
+	so->limit = hnsw_get_scan_limit(index);
+	so->exact = false;
+	so->n_elems = 0;
+	so->key = NULL;
+	so->point = NULL;
+	so->code = NULL;
+	so->pq_table = NULL;
+	so->query_error = -1;
+	scan->opaque = so;
+	if (norderbys > 0)
+	{
+		/* Lower bounds of distances are returned for rerank */
+		scan->xs_orderbyvals = (Datum*)palloc0(sizeof(Datum) * norderbys);
+		scan->xs_orderbynulls = (bool*)palloc(sizeof(bool) * norderbys);
+		memset(scan->xs_orderbynulls, true, sizeof(bool) * norderbys);
+	}
+	return scan;
+}
+
+/*
+ * Start or restart an index scan
+ */
+static void
+hnsw_rescan(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderbys, int norderbys)
+{
+	HnswScanOpaque so = (HnswScanOpaque) scan->opaque;
+	if (so->results)
+	{
+		pfree(so->results);
+		so->results = NULL;
+	}
+	so->curr = 0;
+	if (orderbys && scan->numberOfOrderBys > 0)
+		memmove(scan->orderByData, orderbys, scan->numberOfOrderBys * sizeof(ScanKeyData));
+}
+
+/*
+ * Fetch the next tuple in the given scan
+ */
+static bool
+hnsw_gettuple(IndexScanDesc scan, ScanDirection dir)
+{
+	HnswScanOpaque 	so = (HnswScanOpaque) scan->opaque;
+	size_t			n_results;
+	label_t*		results;
+	dist_t*			dists;
+
+	/*
+	 * Index can be used to scan backward, but Postgres doesn't support
+	 * backward scan on operators
+	 */
+	Assert(ScanDirectionIsForward(dir));
+
+	if (so->curr == 0)
+	{
+		Datum		value;
+		int         n_items;
+
 		/* Safety check */
 		if (scan->orderByData == NULL)
 			elog(ERROR, "cannot scan HNSW index without order");
@@ -314,17 +1086,72 @@ hnsw_gettuple(IndexScanDesc scan, ScanDirection dir)
 			elog(ERROR, "Wrong number of dimensions: %d instead of %d expected",
 				 n_items, (int)so->hnsw->meta.dim);
 
-		if (!hnsw_search(&so->hnsw->meta, (coord_t*)ARR_DATA_PTR(so->key), &n_results, &results))
-			elog(ERROR, "HNSW index search failed");
+		so->point = (coord_t*)ARR_DATA_PTR(so->key);
+		so->query_error = -1;
+		if (so->hnsw->meta.link_codes)
+			hnsw_link_code(&so->hnsw->meta, so->point, &so->hnsw->meta.query_code);
+		if (so->hnsw->meta.quantization == QUANT_PQ)
+		{
+			/* Distances to PQ codes are calculated using table of distances from the scan key to centroids */
+			if (so->pq_table)
+				pfree(so->pq_table);
+			so->pq_table = hnsw_pq_table(&so->hnsw->meta, so->point);
+			so->hnsw->meta.pq_table = so->pq_table;
+			/* Lower bounds are calculated from residuals of encoded vectors */
+			so->hnsw->meta.pq_bounds = hnsw_rerank && so->hnsw->meta.dist_func != DIST_COSINE;
+			if (so->hnsw->meta.pq_bounds)
+				so->query_error = 0;
+		}
+		else if (so->hnsw->meta.quantization != QUANT_NONE)
+		{
+			/* Distances are calculated between quantized vectors */
+			if (so->code == NULL)
+				so->code = palloc(HNSW_QUERY_SIZE(&so->hnsw->meta));
+			hnsw_quantize(&so->hnsw->meta, so->point, so->code);
+			if (hnsw_rerank)
+				so->query_error = hnsw_quantization_error(&so->hnsw->meta, so->point, so->code);
+			so->point = (coord_t*)so->code;
+		}
+		/* Candidates found using binary codes, projections or prefix dimensions are rescored by index itself */
+		so->hnsw->meta.rerank_factor = hnsw_rerank ? hnsw_rerank_factor : 0;
+
+		/* Budget of distance calculations is applied to each search, deadline - to the whole scan */
+		so->hnsw->meta.efSearch = hnsw_get_ef_search(scan->indexRelation);
+		/* Fetch enough candidates to satisfy LIMIT without restarting the search */
+		if (so->limit != 0 && so->limit <= INT_MAX / hnsw_ef_limit_factor)
+			so->hnsw->meta.efSearch = Max(so->hnsw->meta.efSearch, so->limit * hnsw_ef_limit_factor);
+		so->hnsw->meta.max_dist_calcs = hnsw_max_distance_computations;
+		so->hnsw->meta.patience = hnsw_search_patience;
+		so->hnsw->meta.deadline = hnsw_search_deadline > 0
+			? GetCurrentTimestamp() + hnsw_search_deadline : 0;
+
+		/*
+		 * Small index is scanned sequentially: it is faster and results are exact (elements of IVF index are centroids).
+		 * Identifiers of elements of index created by older version may have holes, so it is always searched using graph.
+		 */
+		so->exact = false;
+		if (so->hnsw->n_lists == 0 && so->hnsw->elements_start != FIRST_PAGE
+			&& (hnsw_exact_search_enabled || hnsw_exact_search_threshold > 0))
+		{
+			so->n_elems = hnsw_count_elements(so->hnsw);
+			so->exact = hnsw_exact_search_enabled || so->n_elems <= (idx_t)hnsw_exact_search_threshold;
+		}
+		/* All elements are sorted by single pass of exact search, so the scan is never restarted */
+		if (so->exact)
+			so->hnsw->meta.efSearch = so->n_elems;
+
+		hnsw_scan_search(so, &n_results, &results, &dists);
 
-		so->results = (ItemPointer)palloc(n_results*sizeof(ItemPointerData));
+		so->results = (HnswScanResult*)palloc(n_results*sizeof(HnswScanResult));
 		so->n_results = n_results;
-		so->no_more_results = n_results < so->hnsw->meta.efSearch;
+		so->no_more_results = so->exact || n_results < so->hnsw->meta.efSearch;
 		for (size_t i = 0; i < n_results; i++)
 		{
-			memcpy(&so->results[i], &results[i], sizeof(so->results[i]));
+			memcpy(&so->results[i].tid, &results[i], sizeof(ItemPointerData));
+			so->results[i].distance = dists[i];
 		}
 		free(results);
+		free(dists);
 	}
 	if (so->curr >= so->n_results)
 	{
@@ -332,12 +1159,13 @@ hnsw_gettuple(IndexScanDesc scan, ScanDirection dir)
 			return false;
 
 		so->hnsw->meta.efSearch *= 2;
-		if (!hnsw_search(&so->hnsw->meta, (coord_t*)ARR_DATA_PTR(so->key), &n_results, &results))
-			elog(ERROR, "HNSW index search failed");
+		hnsw_scan_search(so, &n_results, &results, &dists);
 
 		if (n_results <= so->n_results)
 		{
 			/* No new results found */
+			free(results);
+			free(dists);
 			return false;
 		}
 		so->no_more_results = n_results < so->hnsw->meta.efSearch;
@@ -349,23 +1177,41 @@ hnsw_gettuple(IndexScanDesc scan, ScanDirection dir)
 		 * To ignore them we need hnsw_search to also return distance.
 		 * Without it the only choice is 2)
 		 */
-		so->results = (ItemPointer)repalloc(so->results, (n_results + so->n_results)*sizeof(ItemPointerData));
+		so->results = (HnswScanResult*)repalloc(so->results, (n_results + so->n_results)*sizeof(HnswScanResult));
 
-		/* Sort for binary search */
-		pg_qsort(so->results, so->n_results, sizeof(ItemPointerData), (int (*)(const void *, const void *))ItemPointerCompare);
+		/* Sort for binary search: TID is the first field of result */
+		pg_qsort(so->results, so->n_results, sizeof(HnswScanResult), (int (*)(const void *, const void *))ItemPointerCompare);
 
 		/* Exclude already returned records */
 		for (size_t i = 0; i < n_results; i++)
 		{
-			if (!bsearch(&results[i], so->results, so->n_results, sizeof(ItemPointerData), (int (*)(const void *, const void *))ItemPointerCompare))
+			if (!bsearch(&results[i], so->results, so->n_results, sizeof(HnswScanResult), (int (*)(const void *, const void *))ItemPointerCompare))
 			{
-				memcpy(&so->results[so->n_results++], &results[i], sizeof(ItemPointerData));
+				memcpy(&so->results[so->n_results].tid, &results[i], sizeof(ItemPointerData));
+				so->results[so->n_results++].distance = dists[i];
 			}
 		}
+		free(results);
+		free(dists);
 		Assert(so->curr < so->n_results);
 	}
-	scan->xs_heaptid = so->results[so->curr++];
-	scan->xs_recheckorderby = false;
+	scan->xs_heaptid = so->results[so->curr].tid;
+	if (so->query_error >= 0)
+	{
+		/*
+		 * Distance between quantized vectors differs from the exact one at most by query_error
+		 * (with product quantization search already returns lower bounds).
+		 * Index returns lower bound of the distance and executor reorders tuples by distances recalculated
+		 * for heap tuples. Small margin covers rounding errors of float arithmetic.
+		 */
+		dist_t bound = (so->results[so->curr].distance - so->query_error) * (1 - 1e-4);
+		scan->xs_orderbyvals[0] = Float4GetDatum(Max(bound, 0));
+		scan->xs_orderbynulls[0] = false;
+		scan->xs_recheckorderby = true;
+	}
+	else
+		scan->xs_recheckorderby = false;
+	so->curr += 1;
 	return true;
 }
 
@@ -378,6 +1224,10 @@ hnsw_endscan(IndexScanDesc scan)
 	HnswScanOpaque so = (HnswScanOpaque) scan->opaque;
 	if (so->key)
 		pfree(so->key);
+	if (so->code)
+		pfree(so->code);
+	if (so->pq_table)
+		pfree(so->pq_table);
 	if (so->results)
 		pfree(so->results);
 	if (so->hnsw)
@@ -386,9 +1236,181 @@ hnsw_endscan(IndexScanDesc scan)
 	scan->opaque = NULL;
 }
 
+/*
+ * LIMIT of the query is passed to the HNSW or flat index scan which is the direct child of Limit node.
+ * Scan descriptor is created only by the first fetch from the index scan node, so at executor start
+ * bounds are remembered for the index relations and taken by index scans when they are started.
+ * The same index may be scanned by several nodes of the query: then bound is used only if it is the same
+ * for all of them. Only constant limits are handled, otherwise the scan is sized by efsearch as before.
+ */
+typedef struct HnswScanBound
+{
+	EState*     estate;     /* query which scans the index */
+	Relation    index;
+	size_t      limit;      /* 0 - unknown */
+	struct HnswScanBound* next;
+} HnswScanBound;
+
+typedef struct
+{
+	EState*     estate;
+	PlanState*  parent;
+	bool        registered; /* callback removing bounds of the query is registered */
+	MemoryContextCallback callback;
+} HnswScanBoundContext;
+
+/* Bounds of all running queries, the most recently started first */
+static HnswScanBound* hnsw_scan_bounds;
+
+static void
+hnsw_forget_scan_bounds(void* arg)
+{
+	HnswScanBound** link = &hnsw_scan_bounds;
+	while (*link != NULL)
+	{
+		if ((*link)->estate == (EState*)arg)
+			*link = (*link)->next;
+		else
+			link = &(*link)->next;
+	}
+}
+
+static size_t
+hnsw_limit_count(LimitState* ls)
+{
+	Limit* plan = (Limit*)ls->ps.plan;
+	int64 limit;
+
+	if (plan->limitCount == NULL || !IsA(plan->limitCount, Const) || ((Const*)plan->limitCount)->constisnull)
+		return 0;
+	limit = DatumGetInt64(((Const*)plan->limitCount)->constvalue);
+	if (plan->limitOffset != NULL && IsA(plan->limitOffset, Const)
+		&& !((Const*)plan->limitOffset)->constisnull)
+		limit += DatumGetInt64(((Const*)plan->limitOffset)->constvalue);
+	else if (plan->limitOffset != NULL)
+		limit = 0; /* offset is not known */
+	return limit > 0 ? (size_t)limit : 0;
+}
+
+static bool
+hnsw_collect_scan_bounds(PlanState *ps, void *context)
+{
+	HnswScanBoundContext* ctx = (HnswScanBoundContext*)context;
+	PlanState* parent = ctx->parent;
+	bool result;
+
+	if (ps == NULL)
+		return false;
+
+	if (IsA(ps, IndexScanState))
+	{
+		Relation index = ((IndexScanState*)ps)->iss_RelationDesc;
+		if (index->rd_indam->amgettuple == hnsw_gettuple || flat_is_index(index))
+		{
+			size_t limit = parent != NULL && IsA(parent, LimitState) && outerPlanState(parent) == ps
+				? hnsw_limit_count((LimitState*)parent) : 0;
+			HnswScanBound* bound;
+
+			for (bound = hnsw_scan_bounds; bound != NULL && bound->estate == ctx->estate; bound = bound->next)
+			{
+				if (bound->index == index)
+					break;
+			}
+			if (bound != NULL && bound->estate == ctx->estate)
+			{
+				if (bound->limit != limit)
+					bound->limit = 0;
+			}
+			else
+			{
+				if (!ctx->registered)
+				{
+					ctx->callback.func = hnsw_forget_scan_bounds;
+					ctx->callback.arg = ctx->estate;
+					MemoryContextRegisterResetCallback(ctx->estate->es_query_cxt, &ctx->callback);
+					ctx->registered = true;
+				}
+				bound = (HnswScanBound*)MemoryContextAlloc(ctx->estate->es_query_cxt, sizeof(HnswScanBound));
+				bound->estate = ctx->estate;
+				bound->index = index;
+				bound->limit = limit;
+				bound->next = hnsw_scan_bounds;
+				hnsw_scan_bounds = bound;
+			}
+		}
+	}
+	ctx->parent = ps;
+	result = planstate_tree_walker(ps, hnsw_collect_scan_bounds, context);
+	ctx->parent = parent;
+	return result;
+}
+
+/*
+ * Number of tuples requested from the index scan by LIMIT clause (0 - unknown)
+ */
+size_t
+hnsw_get_scan_limit(Relation index)
+{
+	for (HnswScanBound* bound = hnsw_scan_bounds; bound != NULL; bound = bound->next)
+	{
+		if (bound->index == index)
+			return bound->limit;
+	}
+	return 0;
+}
+
+static void
+hnsw_executor_start(QueryDesc *queryDesc, int eflags)
+{
+	if (prev_executor_start)
+		prev_executor_start(queryDesc, eflags);
+	else
+		standard_ExecutorStart(queryDesc, eflags);
+
+	if (!(eflags & EXEC_FLAG_EXPLAIN_ONLY))
+	{
+		/* Callback is allocated in query context too: it is needed until the context is reset */
+		HnswScanBoundContext* ctx = (HnswScanBoundContext*)MemoryContextAllocZero(queryDesc->estate->es_query_cxt,
+																				   sizeof(HnswScanBoundContext));
+		ctx->estate = queryDesc->estate;
+		(void)hnsw_collect_scan_bounds(queryDesc->planstate, ctx);
+	}
+}
+
+/*
+ * Estimate number of index pages fetched by one search touching n_links link lists and n_vectors vectors.
+ * Pages which are likely to be cached by previous loops are accounted by index_pages_fetched.
+ */
+static double
+hnsw_pages_fetched(PlannerInfo *root, HnswIndex* hnsw, IndexOptInfo *index, double n_tuples,
+				   double n_links, double n_vectors, double loop_count)
+{
+	double pages = index_pages_fetched(n_links * loop_count, index->pages, index->pages, root);
+	if (hnsw->layout == HNSW_LAYOUT_SPLIT)
+	{
+		/* Vectors are stored in separate pages, link lists are much more compact */
+		double vector_pages = ceil(n_tuples / hnsw->vectors_per_page);
+		pages += index_pages_fetched(n_vectors * loop_count, (BlockNumber)vector_pages, vector_pages, root);
+	}
+	else
+	{
+		/* Vector is stored together with link list, so page is fetched for each calculated distance */
+		pages = index_pages_fetched((n_links + n_vectors) * loop_count, index->pages, index->pages, root);
+	}
+	return pages / loop_count;
+}
 
 /*
- * Estimate the cost of an index scan
+ * Estimate the cost of an index scan.
+ *
+ * Search visits about ef candidates at the base layer, plus one hop per upper layer (log_M(N) of them),
+ * and calculates distances to their unvisited neighbors. Cost of the search is cost of fetching pages
+ * with link lists and vectors plus cost of distance calculations, proportional to number of dimensions.
+ * The whole search should be completed before the first tuple is returned, so it is the startup cost.
+ *
+ * Index scan returns all tuples in order of distance (search is restarted with doubled ef when candidates are
+ * exhausted), so selectivity is 1 and total cost is estimated as twice cost of search through all elements.
+ * So with WHERE clause of selectivity S, Limit node charges about 1/S of tuples fetched from the index.
  */
 static void
 hnsw_costestimate(PlannerInfo *root, IndexPath *path, double loop_count,
@@ -397,8 +1419,6 @@ hnsw_costestimate(PlannerInfo *root, IndexPath *path, double loop_count,
 				 ,double *indexPages
 )
 {
-	GenericCosts costs;
-
 	/* Never use index without order */
 	if (path->indexorderbys == NULL)
 	{
@@ -413,24 +1433,87 @@ hnsw_costestimate(PlannerInfo *root, IndexPath *path, double loop_count,
 	{
 		IndexOptInfo *index = path->indexinfo;
 		Relation      rel = index_open(index->indexoid, NoLock);
-		HnswIndex*    hnsw = hnsw_get_index(rel);
+		HnswIndex     hnsw;
+		double		  ef = hnsw_get_ef_search(rel);
+		double        n_tuples = Max(index->tuples, 1);
+		double        n_levels;
+		double        n_hops;
+		double        n_dists;
+		double        dist_cost;
+		double        search_pages;
+		double        all_pages;
 		double		  spc_random_page_cost;
+		double		  spc_seq_page_cost;
+
+		/* Layout of the index is known only from its metapage */
+		if (rel->rd_amcache != NULL)
+			memcpy(&hnsw, rel->rd_amcache, sizeof(hnsw));
+		else
+		{
+			MemSet(&hnsw, 0, sizeof(hnsw));
+			hnsw_init_index(&hnsw, rel);
+			hnsw_load_meta(&hnsw);
+		}
 
 		get_tablespace_page_costs(index->reltablespace,
 								  &spc_random_page_cost,
-								  NULL);
+								  &spc_seq_page_cost);
 
-		MemSet(&costs, 0, sizeof(costs));
+		/* Search is sized by LIMIT, see hnsw_get_scan_limit */
+		if (root->limit_tuples > 0 && hnsw_ef_limit_factor > 0)
+			ef = Max(ef, root->limit_tuples * hnsw_ef_limit_factor);
 
-		genericcostestimate(root, path, loop_count, &costs);
+		n_levels = hnsw.meta.M > 1 ? log(n_tuples) / log((double)hnsw.meta.M) : 1;
+		n_hops = Min(ef + n_levels, n_tuples);
+		/* About half of neighbors of the visited node are not visited yet */
+		n_dists = Min(n_hops * hnsw.meta.M, n_tuples);
+		/* Quantized vectors are smaller and cheaper to compare */
+		dist_cost = cpu_operator_cost * hnsw.meta.data_size / sizeof(coord_t);
 
-		/* Number of pages inspected by search is limited by efSearch parameter */
-		*indexStartupCost = *indexTotalCost = hnsw->meta.efSearch * spc_random_page_cost;
-		*indexSelectivity = index->rel->rows ? hnsw->meta.efSearch / index->rel->rows : costs.indexSelectivity;
-		*indexCorrelation = costs.indexCorrelation;
-		*indexPages = hnsw->meta.efSearch;
+		if (hnsw.n_lists != 0)
+		{
+			/*
+			 * IVF search scans embedding.nprobe posting lists, search in the graph of centroids is cheap compared with it.
+			 * Pages of the list are chained, so they are fetched randomly. Restarted search scans the same lists again.
+			 */
+			double fraction = Min((double)hnsw_nprobe / hnsw.n_lists, 1.0);
+			double n_scanned = ceil(n_tuples * fraction);
+			double list_pages = ceil(index->pages * fraction);
+
+			*indexStartupCost = list_pages * spc_random_page_cost + n_scanned * dist_cost;
+			*indexTotalCost = *indexStartupCost * 2 + n_scanned * cpu_index_tuple_cost;
+			*indexSelectivity = 1.0;
+			*indexCorrelation = 0;
+			*indexPages = list_pages;
+			index_close(rel, NoLock);
+			return;
+		}
+		if (hnsw.elements_start != FIRST_PAGE && (hnsw_exact_search_enabled || n_tuples <= hnsw_exact_search_threshold))
+		{
+			/* Exact search reads all pages sequentially once and returns all tuples sorted by distance */
+			all_pages = index->pages;
+
+			*indexStartupCost = all_pages * spc_seq_page_cost + n_tuples * dist_cost;
+			*indexTotalCost = *indexStartupCost + n_tuples * cpu_index_tuple_cost;
+			*indexSelectivity = 1.0;
+			*indexCorrelation = 0;
+			*indexPages = all_pages;
+			index_close(rel, NoLock);
+			return;
+		}
+
+		search_pages = hnsw_pages_fetched(root, &hnsw, index, n_tuples, n_hops, n_dists, loop_count);
+		all_pages = hnsw_pages_fetched(root, &hnsw, index, n_tuples, n_tuples, n_tuples, loop_count);
+
+		*indexStartupCost = search_pages * spc_random_page_cost
+			+ n_dists * dist_cost
+			+ n_hops * cpu_index_tuple_cost;
+		*indexTotalCost = *indexStartupCost
+			+ 2 * (all_pages * spc_random_page_cost + n_tuples * (dist_cost + cpu_index_tuple_cost));
+		*indexSelectivity = 1.0;
+		*indexCorrelation = 0;
+		*indexPages = search_pages;
 
-		pfree(hnsw);
 		index_close(rel, NoLock);
 	}
 }
@@ -445,7 +1528,18 @@ hnsw_options(Datum reloptions, bool validate)
 		{"dims", RELOPT_TYPE_INT, offsetof(HnswOptions, dims)},
 		{"efconstruction", RELOPT_TYPE_INT, offsetof(HnswOptions, efConstruction)},
 		{"efsearch", RELOPT_TYPE_INT, offsetof(HnswOptions, efSearch)},
-		{"m", RELOPT_TYPE_INT, offsetof(HnswOptions, M)}
+		{"m", RELOPT_TYPE_INT, offsetof(HnswOptions, M)},
+		{"layout", RELOPT_TYPE_STRING, offsetof(HnswOptions, layout)},
+		{"slotted", RELOPT_TYPE_BOOL, offsetof(HnswOptions, slotted)},
+		{"compress_links", RELOPT_TYPE_BOOL, offsetof(HnswOptions, compress_links)},
+		{"link_codes", RELOPT_TYPE_BOOL, offsetof(HnswOptions, link_codes)},
+		{"quantization", RELOPT_TYPE_STRING, offsetof(HnswOptions, quantization)},
+		{"pq_subvectors", RELOPT_TYPE_INT, offsetof(HnswOptions, pq_subvectors)},
+		{"prefix_dims", RELOPT_TYPE_INT, offsetof(HnswOptions, prefix_dims)},
+		{"projection", RELOPT_TYPE_STRING, offsetof(HnswOptions, projection)},
+		{"projection_dims", RELOPT_TYPE_INT, offsetof(HnswOptions, projection_dims)},
+		{"lists", RELOPT_TYPE_INT, offsetof(HnswOptions, lists)},
+		{"alpha", RELOPT_TYPE_REAL, offsetof(HnswOptions, alpha)}
 	};
 
 #if PG_VERSION_NUM >= 130000
@@ -478,12 +1572,34 @@ hnsw_validate(Oid opclassoid)
 }
 
 
-/* We need to initialize firtst page to avoid race condition on insert */
+static uint16_t hnsw_page_flags(HnswIndex* hnsw)
+{
+	return (hnsw->slotted ? HNSW_PAGE_SLOTTED : 0)
+		| (hnsw->compress_links ? HNSW_PAGE_COMPRESSED_LINKS : 0)
+		| (hnsw->meta.link_codes ? HNSW_PAGE_LINK_CODES : 0)
+		| (hnsw->n_lists != 0 ? HNSW_PAGE_IVF : 0)
+		| HNSW_PAGE_QUANTIZATION(hnsw->meta.quantization);
+}
+
+void hnsw_init_page_opaque(HnswIndex* hnsw, HnswPageOpaque* opq)
+{
+	opq->dims = (uint16_t)hnsw->meta.dim;
+	opq->maxM = (uint16_t)hnsw->meta.maxM;
+	opq->layout = (uint16_t)hnsw->layout;
+	opq->flags = hnsw_page_flags(hnsw);
+}
+
+/*
+ * We need to initialize firtst page to avoid race condition on insert.
+ * First page is metapage, it is followed by the first label page and empty element page: so search in empty index
+ * doesn't need to check if element pages exist.
+ */
 static void hnsw_init_first_page(HnswIndex* hnsw, ForkNumber forknum)
 {
 	Buffer buf;
-	HnswPageOpaque* opq;
 	Page page;
+	HnswPageOpaque* opq;
+	HnswMetaPageData* metad;
 
 	buf = ReadBufferExtended(hnsw->rel, forknum, P_NEW, RBM_NORMAL, NULL);
 	Assert(BufferGetBlockNumber(buf) == FIRST_PAGE);
@@ -491,10 +1607,125 @@ static void hnsw_init_first_page(HnswIndex* hnsw, ForkNumber forknum)
 	page = BufferGetPage(buf);
 	PageInit(page, BufferGetPageSize(buf), sizeof(HnswPageOpaque));
 	opq = (HnswPageOpaque*)PageGetSpecialPointer(page);
-	opq->dims = (uint16_t)hnsw->meta.dim;
-	opq->maxM = (uint16_t)hnsw->meta.maxM;
+	hnsw_init_page_opaque(hnsw, opq);
+	opq->flags |= HNSW_PAGE_META;
+	metad = HnswPageGetMeta(page);
+	metad->magic = HNSW_META_MAGIC;
+	metad->version = HNSW_META_VERSION;
+	metad->max_level = 0;
+	metad->entry_point = 0;
+	metad->n_elements = 0;
+	metad->pq_subvectors = (uint32)(hnsw->meta.quantization == QUANT_PROJECTION
+									  ? hnsw->meta.projection_dim : hnsw->meta.pq_subvectors);
+	metad->sq_scale = hnsw->meta.sq_scale;
+	metad->n_lists = (uint32)hnsw->n_lists;
+	if (hnsw->meta.quantization == QUANT_INT8)
+	{
+		Assert(hnsw->meta.sq_offsets != NULL);
+		memcpy(metad->sq_offsets, hnsw->meta.sq_offsets, hnsw->meta.dim * sizeof(float4));
+		((PageHeader) page)->pd_lower = (char*)&metad->sq_offsets[hnsw->meta.dim] - (char*)page;
+	}
+	else
+		((PageHeader) page)->pd_lower = (char*)(metad + 1) - (char*)page;
+	MarkBufferDirty(buf);
+	UnlockReleaseBuffer(buf);
+
+	for (BlockNumber i = 0; i < HNSW_CODEBOOK_PAGES(hnsw); i++)
+	{
+		float const* codebook = hnsw->meta.quantization == QUANT_PQ ? hnsw->meta.pq_codebook : hnsw->meta.projection;
+		size_t size = HNSW_CODEBOOK_SIZE(hnsw);
+		size_t offs = i * HNSW_CODEBOOK_PER_PAGE;
+		size_t n = Min(size - offs, HNSW_CODEBOOK_PER_PAGE);
+
+		Assert(codebook != NULL);
+		buf = ReadBufferExtended(hnsw->rel, forknum, P_NEW, RBM_NORMAL, NULL);
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+		page = BufferGetPage(buf);
+		PageInit(page, BufferGetPageSize(buf), sizeof(HnswPageOpaque));
+		hnsw_init_page_opaque(hnsw, (HnswPageOpaque*)PageGetSpecialPointer(page));
+		memcpy(PageGetContents(page), codebook + offs, n * sizeof(float));
+		((PageHeader) page)->pd_lower = (char*)PageGetContents(page) + n * sizeof(float) - (char*)page;
+		MarkBufferDirty(buf);
+		UnlockReleaseBuffer(buf);
+	}
+
+	buf = ReadBufferExtended(hnsw->rel, forknum, P_NEW, RBM_NORMAL, NULL);
+	Assert(BufferGetBlockNumber(buf) == HnswLabelBlock(hnsw, 0));
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	hnsw_init_array_page(BufferGetPage(buf), HNSW_LABELS_OFFSET + hnsw->group_elems * sizeof(HnswLabel));
 	MarkBufferDirty(buf);
 	UnlockReleaseBuffer(buf);
+
+	buf = ReadBufferExtended(hnsw->rel, forknum, P_NEW, RBM_NORMAL, NULL);
+	Assert(BufferGetBlockNumber(buf) == HnswElementBlock(hnsw, 0));
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	page = BufferGetPage(buf);
+	PageInit(page, BufferGetPageSize(buf), sizeof(HnswPageOpaque));
+	hnsw_init_page_opaque(hnsw, (HnswPageOpaque*)PageGetSpecialPointer(page));
+	if (hnsw->slotted)
+		((PageHeader) page)->pd_lower = HNSW_SLOTS_OFFSET;
+	MarkBufferDirty(buf);
+	UnlockReleaseBuffer(buf);
+}
+
+/*
+ * WAL-log all pages of the fork after unlogged index build
+ */
+void hnsw_log_fork(Relation index, ForkNumber forknum)
+{
+	BlockNumber n_blocks;
+
+	if (!smgrexists(RelationGetSmgr(index), forknum))
+		return;
+
+	n_blocks = smgrnblocks(RelationGetSmgr(index), forknum);
+	if (n_blocks == 0)
+		return;
+
+	log_newpage_range(index, forknum, 0, n_blocks, true);
+	#ifdef NEON_SMGR
+	{
+		#if PG_VERSION_NUM >= 160000
+		RelFileLocator locator = index->rd_locator;
+		#else
+		RelFileNode locator = index->rd_node;
+		#endif
+		SetLastWrittenLSNForBlockRange(XactLastRecEnd, locator, forknum, 0, n_blocks);
+		SetLastWrittenLSNForRelation(XactLastRecEnd, locator, forknum);
+	}
+	#endif
+}
+
+/*
+ * Move entry point to the medoid: element nearest to the mean of indexed vectors.
+ * Search started from the center of the data set needs fewer hops to reach any area of the graph.
+ */
+static void hnsw_set_medoid(HnswIndex* hnsw)
+{
+	coord_t* mean = (coord_t*)palloc(hnsw->meta.dim * sizeof(coord_t));
+	coord_t const* point = mean;
+	char code[2 * BLCKSZ];
+	idx_t medoid;
+
+	for (size_t i = 0; i < hnsw->meta.dim; i++)
+		mean[i] = (coord_t)(hnsw->vector_sum[i] / hnsw->n_inserted);
+	if (hnsw->meta.quantization != QUANT_NONE)
+	{
+		hnsw_quantize(&hnsw->meta, mean, code);
+		point = (coord_t const*)code;
+	}
+	if (hnsw_find_nearest(&hnsw->meta, point, &medoid))
+	{
+		/* Index is being built, so metapage is WAL-logged together with other pages */
+		Buffer buf = ReadBuffer(hnsw->rel, FIRST_PAGE);
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+		HnswPageGetMeta(BufferGetPage(buf))->entry_point = medoid;
+		MarkBufferDirty(buf);
+		UnlockReleaseBuffer(buf);
+		hnsw->meta.enterpoint_node = medoid;
+	}
+	hnsw_unpin_buffers(hnsw);
+	pfree(mean);
 }
 
 /*
@@ -511,10 +1742,38 @@ hnsw_build(Relation heap, Relation index, IndexInfo *indexInfo)
 	smgr_start_unlogged_build(RelationGetSmgr(index));
 	#endif
 
+	if (hnsw->meta.quantization == QUANT_INT8)
+		hnsw_train_quantizer(hnsw, index, heap);
+	else if (hnsw->meta.quantization == QUANT_PQ)
+		hnsw_train_pq(hnsw, index, heap);
+	else if (hnsw->meta.quantization == QUANT_PROJECTION)
+		hnsw_train_projection(hnsw, index, heap);
+
 	hnsw_init_first_page(hnsw, MAIN_FORKNUM);
 
+	if (hnsw->n_lists != 0)
+	{
+		/* Centroids are inserted in the graph with numbers of their lists as labels */
+		coord_t* centroids = hnsw_train_ivf(hnsw, index, heap);
+		for (size_t i = 0; i < hnsw->n_lists; i++)
+		{
+			if (!hnsw_add_point(hnsw, centroids + i * hnsw->meta.dim, (label_t)i))
+				elog(ERROR, "HNSW index insert failed");
+		}
+		pfree(centroids);
+		hnsw_ivf_init_lists(hnsw);
+		hnsw->n_inserted = 0;
+	}
+
+	/* Vamana build: mean of indexed vectors is accumulated to locate medoid */
+	if (hnsw->meta.alpha > 1)
+		hnsw->vector_sum = (double*)palloc0(hnsw->meta.dim * sizeof(double));
+
 	hnsw_populate(hnsw, index, heap);
 
+	if (hnsw->vector_sum && hnsw->n_inserted != 0)
+		hnsw_set_medoid(hnsw);
+
 	#ifdef NEON_SMGR
 	smgr_finish_unlogged_build_phase_1(RelationGetSmgr(index));
 	#endif
@@ -524,23 +1783,7 @@ hnsw_build(Relation heap, Relation index, IndexInfo *indexInfo)
 	 * WAL-logging is required, write all pages to the WAL now.
 	 */
 	if (RelationNeedsWAL(index))
-	{
-		log_newpage_range(index, MAIN_FORKNUM,
-						  0, RelationGetNumberOfBlocks(index),
-						  true);
-		#ifdef NEON_SMGR
-		{
-			#if PG_VERSION_NUM >= 160000
-			RelFileLocator locator = index->rd_locator;
-			#else
-			RelFileNode locator = index->rd_node;
-			#endif
-			SetLastWrittenLSNForBlockRange(XactLastRecEnd, locator,
-										   MAIN_FORKNUM, 0, RelationGetNumberOfBlocks(index));
-			SetLastWrittenLSNForRelation(XactLastRecEnd, locator, MAIN_FORKNUM);
-		}
-		#endif
-	}
+		hnsw_log_fork(index, MAIN_FORKNUM);
 	#ifdef NEON_SMGR
 	smgr_end_unlogged_build(RelationGetSmgr(index));
 	#endif
@@ -585,17 +1828,39 @@ hnsw_insert(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid,
 	u.pg.tid = *heap_tid;
 	u.pg.flags = 0;
 
-	success = hnsw_add_point(hnsw, (coord_t*)ARR_DATA_PTR(array), u.label);
+	success = hnsw_insert_point(hnsw, (coord_t*)ARR_DATA_PTR(array), u.label);
 	pfree(array);
 	pfree(hnsw);
 	return success;
 }
 
+/*
+ * Number of elements in the page: with slotted format it is determined by pd_lower.
+ * Page appended to the relation is not initialized until the first element is stored in it.
+ */
+static OffsetNumber hnsw_page_n_elements(HnswIndex* hnsw, Page page)
+{
+	if (PageIsNew(page))
+		return 0;
+	if (hnsw->slotted)
+		return (((PageHeader) page)->pd_lower - HNSW_SLOTS_OFFSET) / hnsw->slot_size;
+	return PageGetMaxOffsetNumber(page);
+}
+
+static char* hnsw_page_get_element(HnswIndex* hnsw, Page page, OffsetNumber offset)
+{
+	if (hnsw->slotted)
+		return (char*)page + HNSW_SLOTS_OFFSET + (offset - FirstOffsetNumber) * hnsw->slot_size;
+	return (char*)PageGetItem(page, PageGetItemId(page, offset));
+}
+
 static void hnsw_check_meta(HnswMetadata* meta, Page page)
 {
 	HnswPageOpaque* opq = (HnswPageOpaque*)PageGetSpecialPointer(page);
 	if (opq->dims != (uint16_t)meta->dim ||
-		opq->maxM != (uint16_t)meta->maxM)
+		opq->maxM != (uint16_t)meta->maxM ||
+		opq->layout != (uint16_t)((HnswIndex*)meta)->layout ||
+		(opq->flags & ~(HNSW_PAGE_META | HNSW_PAGE_POSTING)) != hnsw_page_flags((HnswIndex*)meta))
 	{
 		elog(ERROR, "Inconsistency with HNSW index metadata: only ef_construction and ef_search options of HNSW index may be altered");
 	}
@@ -603,21 +1868,450 @@ static void hnsw_check_meta(HnswMetadata* meta, Page page)
 
 
 
+/*
+ * Extend the main fork to contain at least n_pages pages. Appended pages are left uninitialized: they are
+ * initialized by the WAL record storing the first element located in them, so if insertion is interrupted,
+ * the page is just initialized by the next insertion. Caller should hold exclusive lock on the first page.
+ */
+static void hnsw_extend(HnswIndex* hnsw, BlockNumber n_pages)
+{
+	BlockNumber n_blocks = RelationGetNumberOfBlocks(hnsw->rel);
+
+	for (; n_blocks < n_pages; n_blocks++)
+	{
+		Buffer buf = ReadBuffer(hnsw->rel, P_NEW);
+		Assert(BufferGetBlockNumber(buf) == n_blocks);
+		ReleaseBuffer(buf);
+	}
+}
+
+/*
+ * Get label of the element from label page.
+ * Indexes created by older versions have no label pages: take it from the element itself.
+ */
+void hnsw_get_label(HnswMetadata* meta, idx_t idx, label_t* label)
+{
+	HnswIndex* hnsw = (HnswIndex*)meta;
+	Buffer buf;
+
+	if (hnsw->group_elems == 0)
+	{
+		if (hnsw_begin_read(meta, idx, NULL, NULL, label))
+			hnsw_end_read(meta);
+		else
+			*label = 0;
+		return;
+	}
+	buf = ReadBuffer(hnsw->rel, HnswLabelBlock(hnsw, idx));
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	*label = HnswPageGetLabels(BufferGetPage(buf))[HnswLabelPos(hnsw, idx)].label;
+	UnlockReleaseBuffer(buf);
+}
+
+static int hnsw_compare_idx(const void* a, const void* b)
+{
+	idx_t ia = *(idx_t*)a;
+	idx_t ib = *(idx_t*)b;
+	return ia < ib ? -1 : ia == ib ? 0 : 1;
+}
+
+static size_t hnsw_varint_size(idx_t val)
+{
+	size_t size = 1;
+	while (val >= 0x80)
+	{
+		val >>= 7;
+		size += 1;
+	}
+	return size;
+}
+
+/*
+ * Size of compressed link list: number of links followed by sorted identifiers,
+ * encoded as varint deltas from the previous one
+ */
+static size_t hnsw_encoded_links_size(idx_t const* links)
+{
+	idx_t sorted[HNSW_MAX_LINKS];
+	size_t n = links[0];
+	size_t size = sizeof(uint16);
+	idx_t prev = 0;
+
+	memcpy(sorted, &links[1], n * sizeof(idx_t));
+	qsort(sorted, n, sizeof(idx_t), hnsw_compare_idx);
+	for (size_t i = 0; i < n; i++)
+	{
+		size += hnsw_varint_size(sorted[i] - prev);
+		prev = sorted[i];
+	}
+	return size;
+}
+
+/*
+ * Size of decoded link list: number of links followed by identifiers and codes of neighbors (link_codes)
+ */
+static size_t hnsw_links_copy_size(HnswIndex* hnsw)
+{
+	return hnsw->meta.link_codes
+		? HNSW_LINKS_WITH_CODES_SIZE(hnsw->meta.maxM)
+		: (hnsw->meta.maxM + 1) * sizeof(idx_t);
+}
+
+/*
+ * Store link list in the element format. Returns number of written bytes.
+ * Compressed link lists are sorted by hnsw_set_links.
+ */
+static size_t hnsw_encode_links(HnswIndex* hnsw, idx_t const* links, char* dst)
+{
+	uint16 n = (uint16)links[0];
+	char* p = dst;
+	idx_t prev = 0;
+
+	if (hnsw->meta.link_codes)
+	{
+		/* Code of the element itself which follows the codes of neighbors is not changed */
+		memcpy(dst, links, HNSW_LINKS_WITH_CODES_SIZE(hnsw->meta.maxM));
+		return HNSW_LINKS_WITH_CODES_SIZE(hnsw->meta.maxM);
+	}
+	if (!hnsw->compress_links)
+	{
+		memcpy(dst, links, (n + 1) * sizeof(idx_t));
+		return (n + 1) * sizeof(idx_t);
+	}
+	memcpy(p, &n, sizeof(n));
+	p += sizeof(n);
+	for (size_t i = 1; i <= n; i++)
+	{
+		idx_t delta = links[i] - prev;
+		Assert(i == 1 || links[i] > prev);
+		prev = links[i];
+		while (delta >= 0x80)
+		{
+			*p++ = (char)(delta | 0x80);
+			delta >>= 7;
+		}
+		*p++ = (char)delta;
+	}
+	Assert(p - dst <= hnsw->links_size);
+	return p - dst;
+}
+
+/*
+ * Decode compressed link list. Space reserved for link list in the element is never exceeded
+ * by hnsw_set_links, so going beyond it means that the element is corrupted.
+ */
+static void hnsw_decode_links(HnswIndex* hnsw, char const* src, idx_t* links)
+{
+	uint8 const* p = (uint8 const*)src + sizeof(uint16);
+	uint8 const* end = (uint8 const*)src + hnsw->links_size;
+	uint16 n;
+	idx_t prev = 0;
+
+	memcpy(&n, src, sizeof(n));
+	if (n > hnsw->meta.maxM)
+		elog(ERROR, "Corrupted HNSW link list: %d links", n);
+	links[0] = n;
+	for (size_t i = 1; i <= n; i++)
+	{
+		idx_t delta = 0;
+		int shift = 0;
+		while (p < end && (*p & 0x80) && shift < (int)(sizeof(idx_t) * 8))
+		{
+			delta |= (idx_t)(*p++ & 0x7F) << shift;
+			shift += 7;
+		}
+		if (p == end || (*p & 0x80))
+			elog(ERROR, "Corrupted HNSW link list");
+		delta |= (idx_t)*p++ << shift;
+		prev += delta;
+		links[i] = prev;
+	}
+}
+
+/*
+ * Changes of one page done by insertion of the element
+ */
+typedef struct
+{
+	BlockNumber blkno;
+	bool        is_new;     /* page is appended to the relation */
+	bool        append;     /* inserted element is appended to this page */
+	bool        set_label;  /* label of inserted element is stored in this page */
+	bool        set_vector; /* vector of inserted element is stored in this page (split layout) */
+	bool        set_meta;   /* element count is updated in this page (metapage) */
+	size_t      n_links;
+	HnswPendingLinks** links; /* updated link lists of elements located in this page */
+	Buffer      buf;
+	StringInfoData ops;
+} HnswPageUpdate;
+
+static int hnsw_compare_pending_links(const void* a, const void* b)
+{
+	idx_t ia = ((HnswPendingLinks*)a)->idx;
+	idx_t ib = ((HnswPendingLinks*)b)->idx;
+	return ia < ib ? -1 : ia == ib ? 0 : 1;
+}
+
+/*
+ * Lock pages, apply changes and WAL-log them with single record
+ */
+static void hnsw_write_pages(HnswIndex* hnsw, HnswPageUpdate* updates, size_t n_updates, OffsetNumber ins_offs, label_t label)
+{
+	GenericXLogState *state = NULL;
+	bool custom_wal = !hnsw->unlogged && hnsw_rmgr_registered;
+
+	for (size_t i = 0; i < n_updates; i++)
+	{
+		HnswPageUpdate* u = &updates[i];
+		Page page;
+
+		if (u->blkno == FIRST_PAGE)
+		{
+			u->buf = hnsw->lockbuf;
+		}
+		else
+		{
+			u->buf = ReadBuffer(hnsw->rel, u->blkno);
+			LockBuffer(u->buf, BUFFER_LOCK_EXCLUSIVE);
+			Assert(BufferGetBlockNumber(u->buf) == u->blkno);
+		}
+		page = BufferGetPage(u->buf);
+
+		initStringInfo(&u->ops);
+		if (u->is_new && u->set_label)
+			hnsw_xlog_add_op(&u->ops, HNSW_OP_INIT_ARRAY_PAGE,
+							 HNSW_LABELS_OFFSET + hnsw->group_elems * sizeof(HnswLabel), NULL, 0);
+		else if (u->is_new && u->set_vector)
+			hnsw_xlog_add_op(&u->ops, HNSW_OP_INIT_ARRAY_PAGE,
+							 hnsw->vectors_offset + hnsw->vectors_per_page * hnsw->vector_stride, NULL, 0);
+		else if (u->is_new)
+		{
+			HnswPageOpaque opq;
+			hnsw_init_page_opaque(hnsw, &opq);
+			hnsw_xlog_add_op(&u->ops, HNSW_OP_INIT_PAGE, 0, &opq, sizeof(opq));
+		}
+		if (u->append)
+		{
+			if (hnsw->slotted)
+				hnsw_xlog_add_op(&u->ops, HNSW_OP_APPEND_SLOT, HNSW_SLOTS_OFFSET + (ins_offs - FirstOffsetNumber) * hnsw->slot_size,
+								 hnsw->pending_item, hnsw->slot_size);
+			else
+				hnsw_xlog_add_op(&u->ops, HNSW_OP_APPEND_ELEMENT, ins_offs, hnsw->pending_item, hnsw->meta.size_data_per_element);
+		}
+		for (size_t j = 0; j < u->n_links; j++)
+		{
+			HnswPendingLinks* pending = u->links[j];
+			char* item = hnsw_page_get_element(hnsw, page, FirstOffsetNumber + pending->idx % hnsw->meta.elems_per_page);
+			char  links[BLCKSZ];
+			size_t links_len = hnsw_encode_links(hnsw, pending->links, links);
+			hnsw_xlog_add_op(&u->ops, HNSW_OP_SET_LINKS, item + hnsw->meta.offset_links - (char*)page,
+							 links, links_len);
+		}
+		if (u->set_label)
+			hnsw_xlog_add_op(&u->ops, HNSW_OP_SET_LABEL,
+							 HNSW_LABELS_OFFSET + HnswLabelPos(hnsw, hnsw->pending_idx) * sizeof(HnswLabel),
+							 &label, sizeof(label));
+		if (u->set_vector)
+			hnsw_xlog_add_op(&u->ops, HNSW_OP_SET_VECTOR,
+							 (char*)HnswPageGetVector(page, hnsw, hnsw->pending_idx) - (char*)page,
+							 hnsw->pending_vector, hnsw->vector_size);
+		if (u->set_meta)
+		{
+			HnswMetaPageData metad = *HnswPageGetMeta(page);
+			metad.n_elements = hnsw->pending_idx + 1;
+			hnsw_xlog_add_op(&u->ops, HNSW_OP_SET_META, (char*)HnswPageGetMeta(page) - (char*)page,
+							 &metad, sizeof(metad));
+		}
+	}
+
+	if (custom_wal)
+	{
+		xl_hnsw_insert xlrec;
+		XLogRecPtr recptr;
+
+		xlrec.idx = hnsw->pending_idx;
+		XLogEnsureRecordSpace(n_updates, n_updates + 1);
+
+		START_CRIT_SECTION();
+		for (size_t i = 0; i < n_updates; i++)
+		{
+			hnsw_xlog_apply_ops(BufferGetPage(updates[i].buf), updates[i].ops.data, updates[i].ops.len);
+			MarkBufferDirty(updates[i].buf);
+		}
+		XLogBeginInsert();
+		XLogRegisterData((char*)&xlrec, sizeof(xlrec));
+		for (size_t i = 0; i < n_updates; i++)
+		{
+			XLogRegisterBuffer(i, updates[i].buf, REGBUF_STANDARD | (updates[i].is_new ? REGBUF_WILL_INIT : 0));
+			XLogRegisterBufData(i, updates[i].ops.data, updates[i].ops.len);
+		}
+		recptr = XLogInsert(HNSW_RMGR_ID, XLOG_HNSW_INSERT);
+		for (size_t i = 0; i < n_updates; i++)
+			PageSetLSN(BufferGetPage(updates[i].buf), recptr);
+		END_CRIT_SECTION();
+	}
+	else
+	{
+		if (!hnsw->unlogged)
+			state = GenericXLogStart(hnsw->rel);
+		for (size_t i = 0; i < n_updates; i++)
+		{
+			Page page = state
+				? GenericXLogRegisterBuffer(state, updates[i].buf, updates[i].is_new ? GENERIC_XLOG_FULL_IMAGE : 0)
+				: BufferGetPage(updates[i].buf);
+			hnsw_xlog_apply_ops(page, updates[i].ops.data, updates[i].ops.len);
+			MarkBufferDirty(updates[i].buf);
+		}
+		if (state)
+			GenericXLogFinish(state);
+	}
+
+	for (size_t i = 0; i < n_updates; i++)
+	{
+		if (updates[i].buf != hnsw->lockbuf)
+			UnlockReleaseBuffer(updates[i].buf);
+		pfree(updates[i].ops.data);
+	}
+}
+
+/*
+ * Store inserted element and update link lists of its neighbors.
+ * All affected pages are locked and updated together, so concurrent searches never see links
+ * to the element which is not yet stored. With custom resource manager all changes are logged by single WAL
+ * record (or several records if there are more than XLR_MAX_BLOCK_ID pages), otherwise each
+ * generic WAL record covers up to MAX_GENERIC_XLOG_PAGES pages.
+ *
+ * When insert is split into several records, the first one always contains the element page and all pages
+ * the element depends on, and the following ones only replace link lists of neighbors. So if replay stops
+ * between records (crash or end of WAL at standby), the element is completely stored and referenced by its own
+ * link list, only some back links to it are missing. Such graph is still consistent: all links refer to existing
+ * elements, the element is just less reachable by searches.
+ */
+static void hnsw_flush_insert(HnswIndex* hnsw, BlockNumber ins_blkno, OffsetNumber ins_offs, bool extend, label_t label)
+{
+	idx_t cur_c = hnsw->pending_idx;
+	size_t n_updates = 0;
+	size_t max_pages = !hnsw->unlogged && !hnsw_rmgr_registered ? MAX_GENERIC_XLOG_PAGES : XLR_MAX_BLOCK_ID;
+	HnswPageUpdate* updates = (HnswPageUpdate*)palloc0((hnsw->n_pending_links + 4) * sizeof(HnswPageUpdate));
+	HnswPageUpdate* elem_update;
+	HnswPageUpdate* u;
+
+	/* New label, vector and element pages are appended in advance and initialized together with the element */
+	hnsw_extend(hnsw, HnswElementsEnd(hnsw, cur_c + 1));
+
+	/*
+	 * Metapage is already locked: it is updated in the first WAL record together with the element page,
+	 * so element count is consistent with element pages.
+	 */
+	if (hnsw->elements_start != FIRST_PAGE)
+	{
+		u = &updates[n_updates++];
+		u->blkno = FIRST_PAGE;
+		u->set_meta = true;
+	}
+
+	/*
+	 * Label, vector and element pages are updated first, so that neighbors never refer to missing element.
+	 * Vector page is locked before element pages: it is the order in which hnsw_begin_read locks them.
+	 */
+	if (hnsw->group_elems != 0)
+	{
+		u = &updates[n_updates++];
+		u->blkno = HnswLabelBlock(hnsw, cur_c);
+		u->is_new = HnswLabelPos(hnsw, cur_c) == 0 && cur_c != 0;
+		u->set_label = true;
+	}
+
+	if (hnsw->vectors_per_page != 0)
+	{
+		/*
+		 * New vector page is initialized together with the element, so initialized vector page
+		 * implies that its first element exists: it is used to check if index is empty (split layout).
+		 */
+		u = &updates[n_updates++];
+		u->blkno = HnswVectorBlock(hnsw, cur_c);
+		u->set_vector = true;
+		u->is_new = HnswLabelPos(hnsw, cur_c) % hnsw->vectors_per_page == 0;
+	}
+
+	elem_update = &updates[n_updates++];
+	elem_update->blkno = ins_blkno;
+	elem_update->is_new = extend;
+	elem_update->append = true;
+	/* Group link lists by pages */
+	qsort(hnsw->pending_links, hnsw->n_pending_links, sizeof(HnswPendingLinks), hnsw_compare_pending_links);
+	for (size_t i = 0; i < hnsw->n_pending_links; i++)
+	{
+		HnswPendingLinks* pending = &hnsw->pending_links[i];
+		BlockNumber blkno = HnswElementBlock(hnsw, pending->idx);
+
+		if (pending->idx == cur_c)
+		{
+			/* Link list of the new element is stored together with the element */
+			hnsw_encode_links(hnsw, pending->links, hnsw->pending_item + hnsw->meta.offset_links);
+			continue;
+		}
+		if (blkno == ins_blkno)
+			u = elem_update;
+		else if (updates[n_updates-1].blkno != blkno)
+		{
+			u = &updates[n_updates++];
+			u->blkno = blkno;
+		}
+		else
+			u = &updates[n_updates-1];
+
+		if (u->links == NULL)
+			u->links = (HnswPendingLinks**)palloc(hnsw->n_pending_links * sizeof(HnswPendingLinks*));
+		u->links[u->n_links++] = pending;
+	}
+
+	/* Element and all pages it depends on are updated atomically, see the comment above */
+	Assert(elem_update - updates < max_pages);
+
+	for (size_t i = 0; i < n_updates; i += max_pages)
+		hnsw_write_pages(hnsw, &updates[i], Min(max_pages, n_updates - i), ins_offs, label);
+
+	for (size_t i = 0; i < n_updates; i++)
+	{
+		if (updates[i].links)
+			pfree(updates[i].links);
+	}
+	pfree(updates);
+}
+
 static bool hnsw_add_point(HnswIndex* hnsw, coord_t const* coord, label_t label)
 {
 	BlockNumber rel_size;
-	GenericXLogState *state = NULL;
-	OffsetNumber ins_offs = 0;
-	bool extend = false;
-	idx_t cur_c;
+	BlockNumber ins_blkno;
+	OffsetNumber ins_offs;
+	bool extend;
 	Buffer buf;
 	Page page;
-	HnswPageOpaque* opq;
 	bool result;
 	char item[BLCKSZ];
+	char code[2 * BLCKSZ]; /* code can be followed by full precision vector */
+	coord_t const* vector = coord; /* full precision vector is stored in vector page if graph is traversed using codes */
+
+	/* Element is stored and connected to its neighbors in index format */
+	if (hnsw->meta.quantization != QUANT_NONE)
+	{
+		hnsw_quantize(&hnsw->meta, coord, code);
+		coord = (coord_t const*)code;
+	}
+	if (!HNSW_RESCORED(&hnsw->meta))
+		vector = coord;
 
-	memset(item, 0, hnsw->meta.offset_data);
-	memcpy(item + hnsw->meta.offset_data, coord, hnsw->meta.offset_label - hnsw->meta.offset_data);
+	memset(item, 0, hnsw->slotted ? hnsw->slot_size : hnsw->meta.size_data_per_element);
+	if (hnsw->layout == HNSW_LAYOUT_INLINE)
+		memcpy(item + hnsw->meta.offset_data, coord, hnsw->meta.data_size);
+	if (hnsw->meta.link_codes)
+	{
+		/* Code of the element is copied to link lists of its neighbors by hnsw_set_links */
+		HnswLinkCode self;
+		hnsw_link_code(&hnsw->meta, coord, &self);
+		memcpy(item + hnsw->meta.offset_links + HNSW_LINKS_WITH_CODES_SIZE(hnsw->meta.maxM), &self, sizeof(self));
+	}
 	memcpy(item + hnsw->meta.offset_label, &label, sizeof(label_t));
 
 
@@ -627,226 +2321,701 @@ static bool hnsw_add_point(HnswIndex* hnsw, coord_t const* coord, label_t label)
 	Assert(hnsw->lockbuf == InvalidBuffer);
 	hnsw->lockbuf = ReadBuffer(hnsw->rel, FIRST_PAGE);
 	LockBuffer(hnsw->lockbuf, BUFFER_LOCK_EXCLUSIVE);
-	/* Obtain size under lock */
-	rel_size = RelationGetNumberOfBlocks(hnsw->rel);
+	hnsw_check_meta(&hnsw->meta, BufferGetPage(hnsw->lockbuf));
 
-	while (true)
+	if (hnsw->group_elems != 0)
 	{
-		if (extend)
+		/* Position of the element is determined by its identifier: the next one after elements counted in metapage */
+		hnsw->pending_idx = (idx_t)HnswPageGetMeta(BufferGetPage(hnsw->lockbuf))->n_elements;
+		ins_blkno = HnswElementBlock(hnsw, hnsw->pending_idx);
+		ins_offs = FirstOffsetNumber + hnsw->pending_idx % hnsw->meta.elems_per_page;
+		extend = ins_offs == FirstOffsetNumber && hnsw->pending_idx != 0;
+	}
+	else
+	{
+		/* Obtain size under lock */
+		rel_size = RelationGetNumberOfBlocks(hnsw->rel);
+
+		/*
+		 * Element is appended to the last page or to the new page if there is no space in it.
+		 * Pages are not changed until neighbors of the element are located: element is inserted by hnsw_flush_insert.
+		 */
+		ins_blkno = rel_size - 1;
+		if (ins_blkno != FIRST_PAGE)
 		{
-			buf = ReadBuffer(hnsw->rel, P_NEW);
-			LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+			buf = ReadBuffer(hnsw->rel, ins_blkno);
+			LockBuffer(buf, BUFFER_LOCK_SHARE);
 		}
 		else
-		{
-			if (rel_size-1 != FIRST_PAGE)
-			{
-				buf = ReadBuffer(hnsw->rel, rel_size - 1);
-				LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
-			}
-			else
-				buf = hnsw->lockbuf;
-		}
-
-		if (!hnsw->unlogged)
-			state = GenericXLogStart(hnsw->rel);
+			buf = hnsw->lockbuf;
 
-		page = hnsw->unlogged ? BufferGetPage(buf) : GenericXLogRegisterBuffer(state, buf, extend ? GENERIC_XLOG_FULL_IMAGE : 0);
+		page = BufferGetPage(buf);
+		extend = PageGetFreeSpace(page) < MAXALIGN(hnsw->meta.size_data_per_element);
 		if (extend)
 		{
-			Assert(BufferGetBlockNumber(buf) == rel_size);
-			PageInit(page, BufferGetPageSize(buf), sizeof(HnswPageOpaque));
-			opq = (HnswPageOpaque*)PageGetSpecialPointer(page);
-			opq->dims = (uint16_t)hnsw->meta.dim;
-			opq->maxM = (uint16_t)hnsw->meta.maxM;
-			rel_size += 1;
+			ins_blkno += 1;
+			ins_offs = FirstOffsetNumber;
 		}
 		else
+			ins_offs = OffsetNumberNext(hnsw_page_n_elements(hnsw, page));
+
+		if (buf != hnsw->lockbuf)
+			UnlockReleaseBuffer(buf);
+
+		hnsw->pending_idx = (ins_blkno - hnsw->elements_start)*hnsw->meta.elems_per_page + ins_offs - FirstOffsetNumber;
+	}
+	hnsw->pending_item = item;
+	hnsw->pending_coord = coord;
+	hnsw->pending_vector = vector;
+
+	result = hnsw_bind_point(&hnsw->meta, coord, hnsw->pending_idx);
+	if (result)
+	{
+		hnsw_unpin_buffers(hnsw);
+		hnsw_flush_insert(hnsw, ins_blkno, ins_offs, extend, label);
+		hnsw_cache_invalidate(hnsw);
+		hnsw->n_inserted += 1;
+	}
+	hnsw->pending_item = NULL;
+	hnsw->pending_coord = NULL;
+	hnsw->pending_vector = NULL;
+	hnsw->n_pending_links = 0;
+
+	UnlockReleaseBuffer(hnsw->lockbuf);
+	hnsw->lockbuf = InvalidBuffer;
+
+	return result;
+}
+
+/*
+ * Insert vector in the index: in IVF mode it is appended to the list of the nearest centroid,
+ * otherwise it is added to the graph.
+ */
+static bool hnsw_insert_point(HnswIndex* hnsw, coord_t const* coord, label_t label)
+{
+	size_t ef_search = hnsw->meta.efSearch;
+	size_t n_results;
+	label_t* lists;
+	dist_t* dists;
+	char code[BLCKSZ];
+	idx_t list;
+	bool found;
+
+	if (hnsw->n_lists == 0)
+		return hnsw_add_point(hnsw, coord, label);
+
+	if (hnsw->meta.quantization != QUANT_NONE)
+	{
+		hnsw_quantize(&hnsw->meta, coord, code);
+		coord = (coord_t const*)code;
+	}
+
+	/* Centroids are not changed after index build, so the nearest of them is located without lock */
+	hnsw->meta.efSearch = hnsw->meta.efConstruction;
+	found = hnsw_search(&hnsw->meta, coord, &n_results, &lists, &dists);
+	hnsw->meta.efSearch = ef_search;
+	hnsw_unpin_buffers(hnsw);
+	if (!found)
+		return false;
+
+	found = n_results != 0;
+	list = found ? (idx_t)lists[0] : 0;
+	free(lists);
+	free(dists);
+	if (found)
+	{
+		/* Posting list is locked by append itself, so inserts into different lists are not serialized */
+		Buffer buf = ReadBuffer(hnsw->rel, FIRST_PAGE);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		hnsw_check_meta(&hnsw->meta, BufferGetPage(buf));
+		UnlockReleaseBuffer(buf);
+		hnsw_ivf_append(hnsw, list, coord, label);
+		hnsw->n_inserted += 1;
+	}
+	return found;
+}
+
+
+/*
+ * Get share locked buffer. Buffers accessed during search or insertion remain pinned
+ * in small per-index cache until hnsw_unpin_buffers, so repeated accesses to the same block
+ * cost just a content lock. Pinned buffer can not be replaced, so there is no need to revalidate it.
+ */
+static HnswPinnedBuffer* hnsw_find_pinned(HnswIndex* hnsw, ForkNumber forknum, BlockNumber blkno)
+{
+	for (size_t i = 0; i < hnsw->n_pinned; i++)
+	{
+		HnswPinnedBuffer* entry = &hnsw->pinned[i];
+		if (entry->blkno == blkno && entry->forknum == forknum)
+			return entry;
+	}
+	return NULL;
+}
+
+static HnswPinnedBuffer* hnsw_alloc_pinned(HnswIndex* hnsw)
+{
+	HnswPinnedBuffer* entry;
+
+	if (hnsw->n_pinned < HNSW_PIN_CACHE_SIZE)
+	{
+		entry = &hnsw->pinned[hnsw->n_pinned++];
+	}
+	else
+	{
+		/* Replace some buffer which is not locked now: at most HNSW_STACK_SIZE*2 buffers are locked */
+		do
 		{
-			if (hnsw->lockbuf == buf)
-				hnsw_check_meta(&hnsw->meta, page);
-		}
+			entry = &hnsw->pinned[hnsw->pin_clock++ % HNSW_PIN_CACHE_SIZE];
+		} while (entry->n_locks != 0);
+		ReleaseBuffer(entry->buf);
+	}
+	return entry;
+}
 
-		ins_offs = PageAddItem(page, (Item)item, hnsw->meta.size_data_per_element, InvalidOffsetNumber, false, false);
-		if (ins_offs == InvalidOffsetNumber)
+/*
+ * Remember buffer pinned by read stream in the pin cache and lock it
+ */
+static Buffer hnsw_adopt_buffer(HnswIndex* hnsw, ForkNumber forknum, BlockNumber blkno, Buffer buf)
+{
+	HnswPinnedBuffer* entry = hnsw_alloc_pinned(hnsw);
+	entry->buf = buf;
+	entry->forknum = forknum;
+	entry->blkno = blkno;
+	entry->n_locks = 1;
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	return buf;
+}
+
+static Buffer hnsw_read_buffer(HnswIndex* hnsw, ForkNumber forknum, BlockNumber blkno)
+{
+	HnswPinnedBuffer* entry = hnsw_find_pinned(hnsw, MAIN_FORKNUM, blkno);
+
+	if (entry != NULL)
+	{
+		entry->n_locks += 1;
+		LockBuffer(entry->buf, BUFFER_LOCK_SHARE);
+		return entry->buf;
+	}
+	entry = hnsw_alloc_pinned(hnsw);
+	entry->buf = ReadBufferExtended(hnsw->rel, forknum, blkno, RBM_NORMAL, NULL);
+	entry->forknum = forknum;
+	entry->blkno = blkno;
+	entry->n_locks = 1;
+	LockBuffer(entry->buf, BUFFER_LOCK_SHARE);
+	return entry->buf;
+}
+
+static void hnsw_release_buffer(HnswIndex* hnsw, Buffer buf)
+{
+	for (size_t i = 0; i < hnsw->n_pinned; i++)
+	{
+		if (hnsw->pinned[i].buf == buf)
 		{
-			if (extend)
-				elog(ERROR, "Failed to append item to the page");
-			if (state)
-				GenericXLogAbort(state);
-			if (buf != hnsw->lockbuf)
-				UnlockReleaseBuffer(buf);
-			extend = true;
+			Assert(hnsw->pinned[i].n_locks > 0);
+			hnsw->pinned[i].n_locks -= 1;
+			LockBuffer(buf, BUFFER_LOCK_UNLOCK);
+			return;
 		}
-		else
-			break;
 	}
-	MarkBufferDirty(buf);
-	if (state)
-		GenericXLogFinish(state);
+	elog(ERROR, "HNSW buffer %d is not pinned", buf);
+}
 
-	if (buf != hnsw->lockbuf)
-		UnlockReleaseBuffer(buf);
+/*
+ * Release all pinned buffers: it should be done at the end of search or insertion
+ */
+static void hnsw_unpin_buffers(HnswIndex* hnsw)
+{
+	Assert(hnsw->n_buffers == 0);
+	for (size_t i = 0; i < hnsw->n_pinned; i++)
+		ReleaseBuffer(hnsw->pinned[i].buf);
+	hnsw->n_pinned = 0;
+}
+
+/*
+ * Read vector from vector page (split layout).
+ * Vector page is locked before element page, see hnsw_flush_insert.
+ * Vector page is initialized together with its first element, so it is safe to check only vector page
+ * when existence of the element is not known (entry point of empty index).
+ */
+static bool hnsw_read_vector(HnswIndex* hnsw, idx_t idx, Buffer* vbuf, coord_t** coords)
+{
+	BlockNumber blkno = HnswVectorBlock(hnsw, idx);
+
+	if (hnsw->n_blocks == InvalidBlockNumber || blkno >= hnsw->n_blocks)
+	{
+		hnsw->n_blocks = RelationGetNumberOfBlocks(hnsw->rel);
+		if (blkno >= hnsw->n_blocks)
+			return false;
+	}
+	*vbuf = hnsw_read_buffer(hnsw, MAIN_FORKNUM, blkno);
+	if (PageIsNew(BufferGetPage(*vbuf)))
+	{
+		/* Page was appended by inserter which has not yet initialized it */
+		hnsw_release_buffer(hnsw, *vbuf);
+		return false;
+	}
+	*coords = HnswPageGetVector(BufferGetPage(*vbuf), hnsw, idx);
+	return true;
+}
 
-	hnsw->n_inserted += 1;
+/*
+ * Copy full precision vector of the element from vector page to rescore it (HNSW_RESCORED)
+ */
+bool hnsw_read_full_vector(HnswMetadata* meta, idx_t idx, coord_t* dst)
+{
+	HnswIndex* hnsw = (HnswIndex*)meta;
+	Buffer vbuf;
+	coord_t* vector;
 
-	cur_c = (rel_size-1)*hnsw->meta.elems_per_page + ins_offs - FirstOffsetNumber;
+	Assert(HNSW_RESCORED(meta));
+	if (!hnsw_read_vector(hnsw, idx, &vbuf, &vector))
+		return false;
+	memcpy(dst, vector, meta->dim * sizeof(coord_t));
+	hnsw_release_buffer(hnsw, vbuf);
+	return true;
+}
 
-	result = hnsw_bind_point(&hnsw->meta, coord, cur_c);
+/*
+ * Buffer for decoded link list of the element in stack frame
+ */
+static idx_t* hnsw_frame_links(HnswIndex* hnsw, size_t frame)
+{
+	size_t size = MAXALIGN(hnsw_links_copy_size(hnsw));
+	if (hnsw->links_buf == NULL)
+		hnsw->links_buf = (idx_t*)MemoryContextAlloc(hnsw->mcxt, HNSW_STACK_SIZE * size);
+	return (idx_t*)((char*)hnsw->links_buf + frame * size);
+}
 
-	UnlockReleaseBuffer(hnsw->lockbuf);
-	hnsw->lockbuf = InvalidBuffer;
+/*
+ * Buffer for vector copied from shared cache. Frame HNSW_STACK_SIZE is used by hnsw_dist_batch.
+ */
+static coord_t* hnsw_frame_vector(HnswIndex* hnsw, size_t frame)
+{
+	if (hnsw->vector_buf == NULL)
+		hnsw->vector_buf = (coord_t*)MemoryContextAlloc(hnsw->mcxt, (HNSW_STACK_SIZE + 1) * MAXALIGN(hnsw->meta.data_size));
+	return (coord_t*)((char*)hnsw->vector_buf + frame * MAXALIGN(hnsw->meta.data_size));
+}
 
-	return result;
+/*
+ * Searches can use link list or vector of the element from shared cache.
+ * Inserter needs to see current state of the pages, so it doesn't use the cache.
+ */
+static bool hnsw_use_cache(HnswIndex* hnsw, idx_t** indexes, coord_t** coords, label_t* label)
+{
+	return hnsw->lockbuf == InvalidBuffer && label == NULL && (indexes == NULL) != (coords == NULL) && hnsw_cache_enabled();
 }
 
-
 bool hnsw_begin_read(HnswMetadata* meta, idx_t idx, idx_t** indexes, coord_t** coords, label_t* label)
 {
 	HnswIndex* hnsw = (HnswIndex*)meta;
-	BlockNumber blkno = idx/meta->elems_per_page;
+	BlockNumber blkno = HnswElementBlock(hnsw, idx);
 	Page page;
-	Item item;
-	ItemId item_id;
+	char* item = NULL;
 	OffsetNumber offset;
-	Buffer buf;
+	Buffer buf = InvalidBuffer;
+	Buffer vbuf = InvalidBuffer;
+	coord_t* vector = NULL;
+	bool use_cache = hnsw_use_cache(hnsw, indexes, coords, label);
+	uint64 cache_version = 0;
 
 	if (hnsw->n_buffers >= HNSW_STACK_SIZE)
 		elog(ERROR, "HNSW stack overflow");
 
-	/* First page is already locked for exclusive update of index */
-	if (blkno == FIRST_PAGE && hnsw->lockbuf != InvalidBuffer)
+	if (use_cache)
 	{
-		buf = hnsw->lockbuf;
+		bool found = indexes
+			? hnsw_cache_lookup(hnsw, idx, HNSW_CACHE_LINKS, *indexes = hnsw_frame_links(hnsw, hnsw->n_buffers), hnsw_links_copy_size(hnsw))
+			: hnsw_cache_lookup(hnsw, idx, HNSW_CACHE_VECTOR, *coords = hnsw_frame_vector(hnsw, hnsw->n_buffers), meta->data_size);
+		if (found)
+		{
+			hnsw->buffers[hnsw->n_buffers] = InvalidBuffer;
+			hnsw->vector_buffers[hnsw->n_buffers] = InvalidBuffer;
+			hnsw->n_buffers += 1;
+			return true;
+		}
+		cache_version = hnsw_cache_version(hnsw);
 	}
-	else if (hnsw->writebuf != InvalidBuffer && BufferGetBlockNumber(hnsw->writebuf) == blkno)
+
+	if (hnsw->pending_item && idx == hnsw->pending_idx)
 	{
-		buf = hnsw->writebuf;
+		/* Element being inserted is not yet stored in the page */
+		item = hnsw->pending_item;
+		vector = (coord_t*)hnsw->pending_coord;
 	}
 	else
 	{
-		buf = ReadBuffer(hnsw->rel, blkno);
-		LockBuffer(buf, BUFFER_LOCK_SHARE);
-	}
-	page = BufferGetPage(buf);
+		if (hnsw->layout == HNSW_LAYOUT_SPLIT && coords)
+		{
+			if (!hnsw_read_vector(hnsw, idx, &vbuf, &vector))
+				return false;
+		}
+		/*
+		 * Neighbors referenced by link lists always exist, so with split layout element page
+		 * needs to be inspected only if something else except vector is requested
+		 */
+		if (vbuf == InvalidBuffer || indexes || label)
+		{
+			/* First page is already locked for exclusive update of index */
+			if (blkno == FIRST_PAGE && hnsw->lockbuf != InvalidBuffer)
+				buf = hnsw->lockbuf;
+			else
+				buf = hnsw_read_buffer(hnsw, MAIN_FORKNUM, blkno);
+			page = BufferGetPage(buf);
 
-	if (blkno == FIRST_PAGE)
-		hnsw_check_meta(meta, page);
+			if (blkno == FIRST_PAGE)
+				hnsw_check_meta(meta, page);
 
-	offset = FirstOffsetNumber + idx % meta->elems_per_page;
-    if (offset > PageGetMaxOffsetNumber(page))
-	{
-		if (buf != hnsw->lockbuf && buf != hnsw->writebuf)
-			UnlockReleaseBuffer(buf);
-		return false;
+			offset = FirstOffsetNumber + idx % meta->elems_per_page;
+			if (offset > hnsw_page_n_elements(hnsw, page))
+			{
+				if (buf != hnsw->lockbuf)
+					hnsw_release_buffer(hnsw, buf);
+				if (vbuf != InvalidBuffer)
+					hnsw_release_buffer(hnsw, vbuf);
+				return false;
+			}
+			item = hnsw_page_get_element(hnsw, page, offset);
+			if (hnsw->layout == HNSW_LAYOUT_INLINE)
+				vector = (coord_t*)(item + meta->offset_data);
+		}
 	}
-	item_id = PageGetItemId(page, offset);
-	item = PageGetItem(page, item_id);
-
-	hnsw->buffers[hnsw->n_buffers++] = buf;
+	hnsw->buffers[hnsw->n_buffers] = buf;
+	hnsw->vector_buffers[hnsw->n_buffers] = vbuf;
+	hnsw->n_buffers += 1;
 
 	if (indexes)
-		*indexes = (idx_t*)item;
+	{
+		if (hnsw->compress_links)
+		{
+			*indexes = hnsw_frame_links(hnsw, hnsw->n_buffers - 1);
+			hnsw_decode_links(hnsw, item + meta->offset_links, *indexes);
+		}
+		else
+			*indexes = (idx_t*)(item + meta->offset_links);
+		/* Link list may be updated by current insertion */
+		for (size_t i = 0; i < hnsw->n_pending_links; i++)
+		{
+			if (hnsw->pending_links[i].idx == idx)
+			{
+				*indexes = hnsw->pending_links[i].links;
+				break;
+			}
+		}
+	}
 
 	if (coords)
-		*coords = (coord_t*)((char*)item + meta->offset_data);
+		*coords = vector;
 
 	if (label)
-		memcpy(label, (char*)item + meta->offset_label, sizeof(*label));
+		memcpy(label, item + meta->offset_label, sizeof(*label));
+
+	if (use_cache)
+	{
+		if (indexes)
+			hnsw_cache_store(hnsw, idx, HNSW_CACHE_LINKS, cache_version, *indexes,
+							 meta->link_codes ? hnsw_links_copy_size(hnsw) : ((*indexes)[0] + 1) * sizeof(idx_t));
+		else
+			hnsw_cache_store(hnsw, idx, HNSW_CACHE_VECTOR, cache_version, vector, meta->data_size);
+	}
 	return true;
 }
 
 void hnsw_end_read(HnswMetadata* meta)
 {
 	HnswIndex* hnsw = (HnswIndex*)meta;
+	Buffer buf;
+	Buffer vbuf;
+
 	if (hnsw->n_buffers == 0)
 		elog(ERROR, "HNSW stack is empty");
 	hnsw->n_buffers -= 1;
-	if (hnsw->buffers[hnsw->n_buffers] != hnsw->lockbuf && hnsw->buffers[hnsw->n_buffers] != hnsw->writebuf)
-		UnlockReleaseBuffer(hnsw->buffers[hnsw->n_buffers]);
+	buf = hnsw->buffers[hnsw->n_buffers];
+	vbuf = hnsw->vector_buffers[hnsw->n_buffers];
+	if (buf != InvalidBuffer && buf != hnsw->lockbuf)
+		hnsw_release_buffer(hnsw, buf);
+	if (vbuf != InvalidBuffer)
+		hnsw_release_buffer(hnsw, vbuf);
 }
 
-void hnsw_begin_write(HnswMetadata* meta, idx_t idx, idx_t** indexes, coord_t** coords, label_t* label)
+/*
+ * Bring vector into CPU cache before distance to it is calculated
+ */
+static inline void hnsw_prefetch_vector(coord_t const* vector, size_t size)
 {
-	HnswIndex* hnsw = (HnswIndex*)meta;
-	BlockNumber blkno = idx/meta->elems_per_page;
-	Page page;
-	ItemId item_id;
-	Item item;
-	Buffer buf;
+#if defined(__GNUC__)
+	for (size_t offs = 0; offs < size; offs += PG_CACHE_LINE_SIZE)
+		__builtin_prefetch((char const*)vector + offs);
+#endif
+}
 
-	Assert(hnsw->lockbuf != InvalidBuffer); /* index should be exclsuively locked */
+static coord_t* hnsw_batch_vector(HnswIndex* hnsw, Page page, idx_t idx)
+{
+	HnswMetadata* meta = &hnsw->meta;
+	OffsetNumber offset;
 
-	if (hnsw->xlog_state || hnsw->writebuf != InvalidBuffer)
-		elog(ERROR, "More than two concurrent write operations");
+	if (hnsw->layout == HNSW_LAYOUT_SPLIT)
+		return HnswPageGetVector(page, hnsw, idx);
 
-	if (hnsw->n_buffers >= HNSW_STACK_SIZE)
-		elog(ERROR, "HNSW stack overflow");
+	offset = FirstOffsetNumber + idx % meta->elems_per_page;
+	if (offset > hnsw_page_n_elements(hnsw, page))
+		elog(ERROR, "HNSW element %u not found", idx);
+	return (coord_t*)(hnsw_page_get_element(hnsw, page, offset) + meta->offset_data);
+}
+
+#if PG_VERSION_NUM >= 170000
+typedef struct
+{
+	BlockNumber* blocks;
+	size_t       n_blocks;
+	size_t       pos;
+} HnswStreamState;
+
+static BlockNumber hnsw_stream_next_block(ReadStream* stream, void* callback_private_data, void* per_buffer_data)
+{
+	HnswStreamState* state = (HnswStreamState*)callback_private_data;
+	return state->pos < state->n_blocks ? state->blocks[state->pos++] : InvalidBlockNumber;
+}
+#endif
+
+static int hnsw_compare_batch_items(const void* a, const void* b)
+{
+	HnswBatchItem const* ia = (HnswBatchItem const*)a;
+	HnswBatchItem const* ib = (HnswBatchItem const*)b;
+	return ia->blkno < ib->blkno ? -1 : ia->blkno > ib->blkno ? 1
+		: ia->pos < ib->pos ? -1 : ia->pos > ib->pos ? 1 : 0;
+}
 
-	/* First page is already locked for exclusive update of index */
-	if (blkno == FIRST_PAGE)
+/*
+ * Calculate distances from the point to the elements, which should exist.
+ * Elements are grouped by blocks, so each block is locked only once.
+ */
+void hnsw_dist_batch(HnswMetadata* meta, coord_t const* point, idx_t const* ids, size_t n_ids, dist_t* dists)
+{
+	HnswIndex* hnsw = (HnswIndex*)meta;
+	bool split = hnsw->layout == HNSW_LAYOUT_SPLIT;
+	size_t n_items = 0;
+	size_t i, j;
+	bool use_cache = hnsw->lockbuf == InvalidBuffer && hnsw_cache_enabled();
+#if PG_VERSION_NUM >= 170000
+	ReadStream* stream = NULL;
+	HnswStreamState stream_state;
+	size_t n_streamed = 0;
+#endif
+
+	if (n_ids > hnsw->batch_size)
 	{
-		buf = hnsw->lockbuf;
+		if (hnsw->batch)
+		{
+			pfree(hnsw->batch);
+			pfree(hnsw->batch_blocks);
+		}
+		hnsw->batch_size = Max(n_ids, meta->maxM + 1);
+		hnsw->batch = (HnswBatchItem*)MemoryContextAlloc(hnsw->mcxt, hnsw->batch_size * sizeof(HnswBatchItem));
+		hnsw->batch_blocks = (BlockNumber*)MemoryContextAlloc(hnsw->mcxt, hnsw->batch_size * sizeof(BlockNumber));
 	}
-	else
+	for (i = 0; i < n_ids; i++)
 	{
-		buf = ReadBuffer(hnsw->rel, blkno);
-		hnsw->writebuf = buf;
-		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+		if (hnsw->pending_item && ids[i] == hnsw->pending_idx)
+		{
+			dists[i] = hnsw_vector_dist(meta, point, hnsw->pending_coord);
+			continue;
+		}
+		if (use_cache)
+		{
+			coord_t* vector = hnsw_frame_vector(hnsw, HNSW_STACK_SIZE);
+			if (hnsw_cache_lookup(hnsw, ids[i], HNSW_CACHE_VECTOR, vector, meta->data_size))
+			{
+				dists[i] = hnsw_vector_dist(meta, point, vector);
+				continue;
+			}
+		}
+		hnsw->batch[n_items].blkno = split ? HnswVectorBlock(hnsw, ids[i]) : HnswElementBlock(hnsw, ids[i]);
+		hnsw->batch[n_items].pos = i;
+		n_items += 1;
 	}
-	if (hnsw->unlogged)
+	qsort(hnsw->batch, n_items, sizeof(HnswBatchItem), hnsw_compare_batch_items);
+
+#if PG_VERSION_NUM >= 170000
+	/*
+	 * Blocks which are not pinned yet are read using read stream: it issues I/O for the following
+	 * blocks while distances to elements of the current block are calculated.
+	 */
+	stream_state.blocks = hnsw->batch_blocks;
+	stream_state.n_blocks = 0;
+	stream_state.pos = 0;
+	for (i = 0; i < n_items; i++)
 	{
-		hnsw->xlog_state = NULL;
-		page = BufferGetPage(buf);
+		BlockNumber blkno = hnsw->batch[i].blkno;
+		if ((i == 0 || blkno != hnsw->batch[i-1].blkno)
+			&& !(!split && blkno == FIRST_PAGE && hnsw->lockbuf != InvalidBuffer)
+			&& hnsw_find_pinned(hnsw, MAIN_FORKNUM, blkno) == NULL)
+		{
+			stream_state.blocks[stream_state.n_blocks++] = blkno;
+		}
 	}
-	else
+	if (stream_state.n_blocks > 1)
+		stream = read_stream_begin_relation(READ_STREAM_DEFAULT, NULL, hnsw->rel, MAIN_FORKNUM,
+											hnsw_stream_next_block, &stream_state, 0);
+#endif
+
+	for (i = 0; i < n_items; i = j)
 	{
-		hnsw->xlog_state = GenericXLogStart(hnsw->rel);
-		page = GenericXLogRegisterBuffer(hnsw->xlog_state, buf, 0);
-	}
+		BlockNumber blkno = hnsw->batch[i].blkno;
+		Buffer buf;
+		Page page;
+		coord_t* vector;
+
+		if (!split && blkno == FIRST_PAGE && hnsw->lockbuf != InvalidBuffer)
+			buf = hnsw->lockbuf;
+#if PG_VERSION_NUM >= 170000
+		else if (stream != NULL && n_streamed < stream_state.n_blocks && stream_state.blocks[n_streamed] == blkno)
+		{
+			n_streamed += 1;
+			buf = hnsw_adopt_buffer(hnsw, MAIN_FORKNUM, blkno, read_stream_next_buffer(stream, NULL));
+		}
+#endif
+		else
+			buf = hnsw_read_buffer(hnsw, MAIN_FORKNUM, blkno);
+		page = BufferGetPage(buf);
 
-	item_id = PageGetItemId(page, FirstOffsetNumber + idx % meta->elems_per_page);
-	item = PageGetItem(page, item_id);
+		if (!split && blkno == FIRST_PAGE)
+			hnsw_check_meta(meta, page);
 
-	hnsw->buffers[hnsw->n_buffers++] = buf;
+		/* Vector of the next element is prefetched into CPU cache while distance to the current one is calculated */
+		vector = hnsw_batch_vector(hnsw, page, ids[hnsw->batch[i].pos]);
+		for (j = i; j < n_items && hnsw->batch[j].blkno == blkno; j++)
+		{
+			idx_t idx = ids[hnsw->batch[j].pos];
+			coord_t* next = NULL;
 
-	if (indexes)
-		*indexes = (idx_t*)item;
+			if (j + 1 < n_items && hnsw->batch[j + 1].blkno == blkno)
+			{
+				next = hnsw_batch_vector(hnsw, page, ids[hnsw->batch[j + 1].pos]);
+				hnsw_prefetch_vector(next, meta->data_size);
+			}
+			dists[hnsw->batch[j].pos] = hnsw_vector_dist(meta, point, vector);
+			if (use_cache)
+				hnsw_cache_store(hnsw, idx, HNSW_CACHE_VECTOR, 0, vector, meta->data_size);
+			vector = next;
+		}
+		if (buf != hnsw->lockbuf)
+			hnsw_release_buffer(hnsw, buf);
+	}
+#if PG_VERSION_NUM >= 170000
+	if (stream != NULL)
+		read_stream_end(stream);
+#endif
+}
 
-	if (coords)
-		*coords = (coord_t*)((char*)item + meta->offset_data);
+/*
+ * Get code of the element stored after its link list
+ */
+static void hnsw_get_link_code(HnswIndex* hnsw, idx_t idx, HnswLinkCode* code)
+{
+	BlockNumber blkno = HnswElementBlock(hnsw, idx);
+	Buffer buf = InvalidBuffer;
+	char const* item;
 
-	if (label)
-		memcpy(label, (char*)item + meta->offset_label, sizeof(*label));
+	if (hnsw->pending_item && idx == hnsw->pending_idx)
+		item = hnsw->pending_item;
+	else
+	{
+		buf = blkno == FIRST_PAGE && hnsw->lockbuf != InvalidBuffer
+			? hnsw->lockbuf : hnsw_read_buffer(hnsw, MAIN_FORKNUM, blkno);
+		item = hnsw_page_get_element(hnsw, BufferGetPage(buf), FirstOffsetNumber + idx % hnsw->meta.elems_per_page);
+	}
+	memcpy(code, item + hnsw->meta.offset_links + HNSW_LINKS_WITH_CODES_SIZE(hnsw->meta.maxM), sizeof(*code));
+	if (buf != InvalidBuffer && buf != hnsw->lockbuf)
+		hnsw_release_buffer(hnsw, buf);
 }
 
-void hnsw_end_write(HnswMetadata* meta)
+/*
+ * Link list is not updated immediately: all changes are applied at the end of insertion by hnsw_flush_insert
+ */
+void hnsw_set_links(HnswMetadata* meta, idx_t idx, idx_t const* links, size_t n_links)
 {
 	HnswIndex* hnsw = (HnswIndex*)meta;
+	HnswPendingLinks* pending = NULL;
 
-	if (hnsw->n_buffers == 0)
-		elog(ERROR, "HNSW stack is empty");
+	Assert(hnsw->lockbuf != InvalidBuffer); /* index should be exclsuively locked */
 
-	hnsw->n_buffers -= 1;
-	MarkBufferDirty(hnsw->buffers[hnsw->n_buffers]);
-	if (hnsw->xlog_state)
+	if (n_links > meta->maxM)
+		elog(ERROR, "Too many neighbors: %d", (int)n_links);
+
+	if (hnsw->pending_links == NULL)
+	{
+		hnsw->pending_links = (HnswPendingLinks*)palloc((meta->maxM + 1) * sizeof(HnswPendingLinks));
+		for (size_t i = 0; i <= meta->maxM; i++)
+			hnsw->pending_links[i].links = (idx_t*)palloc0(hnsw_links_copy_size(hnsw));
+	}
+	for (size_t i = 0; i < hnsw->n_pending_links; i++)
+	{
+		if (hnsw->pending_links[i].idx == idx)
+		{
+			pending = &hnsw->pending_links[i];
+			break;
+		}
+	}
+	if (pending == NULL)
+	{
+		if (hnsw->n_pending_links > meta->maxM)
+			elog(ERROR, "Too many updated link lists");
+		pending = &hnsw->pending_links[hnsw->n_pending_links++];
+		pending->idx = idx;
+	}
+	pending->links[0] = n_links;
+	memcpy(&pending->links[1], links, n_links * sizeof(idx_t));
+
+	if (meta->link_codes)
 	{
-		GenericXLogFinish(hnsw->xlog_state);
-		hnsw->xlog_state = NULL;
+		HnswLinkCode* codes = (HnswLinkCode*)((char*)pending->links + HNSW_LINK_CODES_OFFSET(meta->maxM));
+		for (size_t i = 0; i < n_links; i++)
+			hnsw_get_link_code(hnsw, links[i], &codes[i]);
 	}
-	if (hnsw->buffers[hnsw->n_buffers] != hnsw->lockbuf)
+
+	if (hnsw->compress_links)
 	{
-		Assert(hnsw->buffers[hnsw->n_buffers] == hnsw->writebuf);
-		hnsw->writebuf = InvalidBuffer;
-		UnlockReleaseBuffer(hnsw->buffers[hnsw->n_buffers]);
+		/* Caller checks that the list fits using hnsw_links_fit: truncating it here would silently drop links */
+		if (hnsw_encoded_links_size(pending->links) > hnsw->links_size)
+			elog(ERROR, "Compressed link list of %d neighbors doesn't fit in the element", (int)n_links);
+		qsort(&pending->links[1], pending->links[0], sizeof(idx_t), hnsw_compare_idx);
 	}
 }
 
+bool hnsw_links_fit(HnswMetadata* meta, idx_t const* links, size_t n_links)
+{
+	HnswIndex* hnsw = (HnswIndex*)meta;
+	idx_t buf[HNSW_MAX_LINKS + 1];
+
+	if (n_links > meta->maxM)
+		return false;
+	if (!hnsw->compress_links)
+		return true;
+	buf[0] = n_links;
+	memcpy(&buf[1], links, n_links * sizeof(idx_t));
+	return hnsw_encoded_links_size(buf) <= hnsw->links_size;
+}
+
+/*
+ * Prefetch page with link list of the element which is going to be expanded by search.
+ * With inline layout this page was read to calculate distance to the element, but it may have been
+ * evicted since then or the distance may have been calculated using vector from the shared cache,
+ * so it is prefetched for both layouts: for page present in shared buffers it is just a lookup.
+ */
+void hnsw_prefetch_links(HnswMetadata* meta, idx_t idx)
+{
+	HnswIndex* hnsw = (HnswIndex*)meta;
+	PrefetchBuffer(hnsw->rel, MAIN_FORKNUM, HnswElementBlock(hnsw, idx));
+}
+
 void hnsw_prefetch(HnswMetadata* meta, idx_t idx)
 {
 	HnswIndex* hnsw = (HnswIndex*)meta;
-	BlockNumber blkno = idx/meta->elems_per_page;
-	PrefetchBuffer(hnsw->rel, MAIN_FORKNUM, blkno);
+	/* Neighbors are prefetched to calculate distance to them, so with split layout vector page is needed */
+	if (hnsw->layout == HNSW_LAYOUT_SPLIT)
+		PrefetchBuffer(hnsw->rel, MAIN_FORKNUM, HnswVectorBlock(hnsw, idx));
+	else
+		PrefetchBuffer(hnsw->rel, MAIN_FORKNUM, HnswElementBlock(hnsw, idx));
 }
 
 
@@ -878,46 +3047,64 @@ hnsw_vacuumcleanup(IndexVacuumInfo *info, IndexBulkDeleteResult *stats)
 }
 
 /*
- * Bulk delete tuples from the index
+ * Number of elements in the index: it is maintained in the metapage.
+ * All element pages of index created by older version except the last one are considered to be full.
  */
-static IndexBulkDeleteResult *
-hnsw_bulkdelete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
-				IndexBulkDeleteCallback callback, void *callback_state)
+static idx_t
+hnsw_count_elements(HnswIndex* hnsw)
+{
+	BlockNumber rel_size;
+	Buffer buf;
+	idx_t n_elems;
+
+	/* Elements of IVF index are centroids of its lists, which are followed by posting pages */
+	if (hnsw->n_lists != 0)
+		return (idx_t)hnsw->n_lists;
+
+	if (hnsw->elements_start != FIRST_PAGE)
+	{
+		buf = ReadBuffer(hnsw->rel, FIRST_PAGE);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		n_elems = (idx_t)HnswPageGetMeta(BufferGetPage(buf))->n_elements;
+		UnlockReleaseBuffer(buf);
+		return n_elems;
+	}
+	rel_size = RelationGetNumberOfBlocks(hnsw->rel);
+	if (rel_size <= hnsw->elements_start)
+		return 0;
+	buf = ReadBuffer(hnsw->rel, rel_size - 1);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	n_elems = (rel_size - 1 - hnsw->elements_start) * hnsw->meta.elems_per_page + hnsw_page_n_elements(hnsw, BufferGetPage(buf));
+	UnlockReleaseBuffer(buf);
+	return n_elems;
+}
+
+/*
+ * Mark elements of index created by older version as deleted: it has no label pages,
+ * so labels stored in elements are updated.
+ */
+static void
+hnsw_bulkdelete_elements(HnswIndex* hnsw, IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
+						 IndexBulkDeleteCallback callback, void *callback_state)
 {
-	OffsetNumber maxoffno;
-	OffsetNumber offno;
 	Relation	index = info->index;
-	Buffer		buf;
-	Page		page;
-	int 		n_deleted;
-	GenericXLogState *state;
 	BlockNumber rel_size = RelationGetNumberOfBlocks(index);
-	BufferAccessStrategy bas = GetAccessStrategy(BAS_BULKREAD);
-	HnswIndex* hnsw = hnsw_get_index(index);
-
-	if (stats == NULL)
-		stats = (IndexBulkDeleteResult *) palloc0(sizeof(IndexBulkDeleteResult));
 
 	for (BlockNumber blkno = FIRST_PAGE; blkno < rel_size; blkno++)
 	{
-		buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, bas);
+		Buffer		buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, info->strategy);
+		GenericXLogState *state;
+		Page		page;
+		OffsetNumber maxoffno;
+		int			n_deleted = 0;
 
-		/*
-		 * ambulkdelete cannot delete entries from pages that are
-		 * pinned by other backends
-		 *
-		 * https://www.postgresql.org/docs/current/index-locking.html
-		 */
-		LockBufferForCleanup(buf);
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
 		state = GenericXLogStart(index);
 		page = GenericXLogRegisterBuffer(state, buf, 0);
-
-		maxoffno = PageGetMaxOffsetNumber(page);
-		n_deleted = 0;
-
-		for (offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		maxoffno = hnsw_page_n_elements(hnsw, page);
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
 		{
-			HnswLabel* label = (HnswLabel*)((char*)PageGetItem(page, PageGetItemId(page, offno)) + hnsw->meta.offset_label);
+			HnswLabel* label = (HnswLabel*)(hnsw_page_get_element(hnsw, page, offno) + hnsw->meta.offset_label);
 			if (!(label->pg.flags & DELETED_FLAG))
 			{
 				if (callback(&label->pg.tid, callback_state))
@@ -937,9 +3124,150 @@ hnsw_bulkdelete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
 		}
 		else
 			GenericXLogAbort(state);
-
 		UnlockReleaseBuffer(buf);
 	}
+}
+
+/*
+ * Replace deleted entry point with its first alive neighbor, so that search is still started
+ * from the same area of the graph, or with the given alive element if all neighbors are deleted.
+ */
+static void
+hnsw_move_entry_point(HnswIndex* hnsw, idx_t alive)
+{
+	idx_t  entry_point = alive;
+	idx_t* links;
+	Buffer buf;
+	Page   page;
+	GenericXLogState *state;
+
+	if (hnsw_begin_read(&hnsw->meta, hnsw->meta.enterpoint_node, &links, NULL, NULL))
+	{
+		size_t n_links = links[0];
+		idx_t* neighbors = (idx_t*)palloc(n_links * sizeof(idx_t));
+
+		memcpy(neighbors, links + 1, n_links * sizeof(idx_t));
+		hnsw_end_read(&hnsw->meta);
+		for (size_t i = 0; i < n_links; i++)
+		{
+			label_t label;
+			hnsw_get_label(&hnsw->meta, neighbors[i], &label);
+			if (!hnsw_is_deleted(label))
+			{
+				entry_point = neighbors[i];
+				break;
+			}
+		}
+		pfree(neighbors);
+	}
+	hnsw_unpin_buffers(hnsw);
+
+	buf = ReadBuffer(hnsw->rel, FIRST_PAGE);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	state = GenericXLogStart(hnsw->rel);
+	page = GenericXLogRegisterBuffer(state, buf, 0);
+	HnswPageGetMeta(page)->entry_point = entry_point;
+	MarkBufferDirty(buf);
+	GenericXLogFinish(state);
+	UnlockReleaseBuffer(buf);
+
+	/* Make other backends reload cached descriptor of the index */
+	CacheInvalidateRelcache(hnsw->rel);
+}
+
+/*
+ * Bulk delete tuples from the index.
+ *
+ * Only label pages are inspected and updated, so it is scan of compact arrays
+ * which doesn't need cleanup lock on the element pages: element is just marked as deleted,
+ * it is still used for graph traversal. Callback is invoked without holding any buffer lock.
+ */
+static IndexBulkDeleteResult *
+hnsw_bulkdelete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
+				IndexBulkDeleteCallback callback, void *callback_state)
+{
+	Relation	index = info->index;
+	Buffer		buf;
+	Page		page;
+	int 		n_updated;
+	GenericXLogState *state;
+	HnswIndex* hnsw = hnsw_get_index(index);
+	idx_t       n_elems;
+	HnswLabel   labels[HNSW_LABELS_PER_PAGE];
+	bool        updated[HNSW_LABELS_PER_PAGE];
+	bool        entry_deleted = false;
+	idx_t       alive;
+
+	if (stats == NULL)
+		stats = (IndexBulkDeleteResult *) palloc0(sizeof(IndexBulkDeleteResult));
+
+	/* Labels of IVF index elements are numbers of lists: only entries of posting lists reference heap tuples */
+	if (hnsw->n_lists != 0)
+	{
+		hnsw_ivf_bulkdelete(hnsw, info, stats, callback, callback_state);
+		pfree(hnsw);
+		return stats;
+	}
+	if (hnsw->group_elems == 0)
+	{
+		hnsw_bulkdelete_elements(hnsw, info, stats, callback, callback_state);
+		pfree(hnsw);
+		return stats;
+	}
+
+	n_elems = hnsw_count_elements(hnsw);
+	alive = n_elems; /* some alive element */
+	for (idx_t first = 0; first < n_elems; first += hnsw->group_elems)
+	{
+		size_t n_labels = Min(hnsw->group_elems, n_elems - first);
+
+		buf = ReadBufferExtended(index, MAIN_FORKNUM, HnswLabelBlock(hnsw, first), RBM_NORMAL, info->strategy);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		memcpy(labels, HnswPageGetLabels(BufferGetPage(buf)), n_labels * sizeof(HnswLabel));
+		LockBuffer(buf, BUFFER_LOCK_UNLOCK);
+
+		n_updated = 0;
+		for (size_t i = 0; i < n_labels; i++)
+		{
+			updated[i] = false;
+			if (!(labels[i].pg.flags & DELETED_FLAG))
+			{
+				if (callback(&labels[i].pg.tid, callback_state))
+				{
+					labels[i].pg.flags |= DELETED_FLAG;
+					stats->tuples_removed++;
+					updated[i] = true;
+				}
+				else
+					stats->num_index_tuples++;
+			}
+			if (labels[i].pg.flags & DELETED_FLAG)
+				entry_deleted |= first + i == hnsw->meta.enterpoint_node;
+			else if (alive == n_elems)
+				alive = first + i;
+			n_updated += updated[i];
+		}
+		hnsw_unpin_buffers(hnsw);
+		if (n_updated > 0)
+		{
+			LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+			state = GenericXLogStart(index);
+			page = GenericXLogRegisterBuffer(state, buf, 0);
+			for (size_t i = 0; i < n_labels; i++)
+			{
+				if (updated[i])
+					HnswPageGetLabels(page)[i] = labels[i];
+			}
+			MarkBufferDirty(buf);
+			GenericXLogFinish(state);
+			LockBuffer(buf, BUFFER_LOCK_UNLOCK);
+		}
+		ReleaseBuffer(buf);
+	}
+
+	if (entry_deleted && alive != n_elems)
+		hnsw_move_entry_point(hnsw, alive);
+
 	pfree(hnsw);
 
 	return stats;
@@ -1060,3 +3388,32 @@ manhattan_distance(PG_FUNCTION_ARGS)
 	ArrayType  *b = PG_GETARG_ARRAYTYPE_P(1);
 	PG_RETURN_FLOAT4(calc_distance(DIST_MANHATTAN, a, b));
 }
+
+/*
+ * Statistic of HNSW index searches performed by the current backend
+ */
+Datum
+hnsw_search_statistic(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[5];
+	bool		nulls[5] = {false};
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	values[0] = Int64GetDatum(hnsw_search_stats.searches);
+	values[1] = Int64GetDatum(hnsw_search_stats.expansions);
+	values[2] = Int64GetDatum(hnsw_search_stats.distance_computations);
+	values[3] = Int64GetDatum(hnsw_search_stats.patience_stops);
+	values[4] = Int64GetDatum(hnsw_search_stats.budget_stops);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls)));
+}
+
+Datum
+hnsw_reset_search_statistic(PG_FUNCTION_ARGS)
+{
+	memset(&hnsw_search_stats, 0, sizeof(hnsw_search_stats));
+	PG_RETURN_VOID();
+}
@@ -25,11 +25,57 @@ typedef enum {
 	DIST_MANHATTAN
 } dist_func_t;
 
+typedef enum {
+	QUANT_NONE,
+	QUANT_INT8,
+	QUANT_FLOAT16,
+	QUANT_BFLOAT16,
+	QUANT_PQ,
+	QUANT_BINARY,
+	QUANT_PROJECTION /* set by "projection" option rather than "quantization" */
+} quantization_t;
+
+/* Product quantization: each subvector is encoded by one byte, so each subspace has 256 centroids */
+#define HNSW_PQ_CENTROIDS 256
+
+/* PQ code of the vector is followed by float norm of its residual (difference between the vector and its code) */
+#define HNSW_PQ_RESIDUAL_OFFSET(n_subvectors) (((n_subvectors) + sizeof(float) - 1) & ~(sizeof(float) - 1))
+
+/*
+ * Binary quantization, projection and prefix dimensions: graph is built and traversed using compact codes
+ * (sign bits of coordinates padded to 64-bit words, vector projected to projection_dim dimensions or copy
+ * of prefix_dim leading coordinates), and candidates are rescored using full precision vectors.
+ * Elements contain only codes, full precision vectors are stored out of line in vector pages.
+ * Encoded query is followed by its full precision vector.
+ */
+#define HNSW_RESCORED(meta) \
+	((meta)->quantization == QUANT_BINARY || (meta)->quantization == QUANT_PROJECTION || (meta)->prefix_dim != 0)
+#define HNSW_BINARY_CODE_SIZE(dim) (((dim) + 63) / 64 * sizeof(uint64_t))
+#define HNSW_QUERY_SIZE(meta) ((meta)->data_size + (HNSW_RESCORED(meta) && (meta)->prefix_dim == 0 ? (meta)->dim * sizeof(coord_t) : 0))
+#define HNSW_FULL_VECTOR(meta, query) \
+	((meta)->prefix_dim != 0 ? (coord_t const*)(query) : (coord_t const*)((char const*)(query) + (meta)->data_size))
+
+/*
+ * Code of the neighbor stored in link list next to its identifier: SimHash of its vector and its norm.
+ * It gives estimation of the distance from the query to the neighbor without reading its page.
+ */
+typedef struct
+{
+	uint64_t	simhash;
+	float		norm;
+} HnswLinkCode;
+
+#define HNSW_LINK_CODES_OFFSET(maxM) ((((maxM) + 1) * sizeof(idx_t) + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1))
+#define HNSW_LINK_CODES(meta, links) ((HnswLinkCode const*)((char const*)(links) + HNSW_LINK_CODES_OFFSET((meta)->maxM)))
+/* Size of link list followed by codes of neighbors: in the element it is followed by code of the element itself */
+#define HNSW_LINKS_WITH_CODES_SIZE(maxM) (HNSW_LINK_CODES_OFFSET(maxM) + (maxM) * sizeof(HnswLinkCode))
+
 typedef struct
 {
 	size_t		dim;
 	size_t		data_size;
 	size_t		offset_data;
+	size_t		offset_links;
 	size_t		offset_label;
 	size_t		size_data_per_element;
 	size_t		elems_per_page;
@@ -39,18 +85,69 @@ typedef struct
 	size_t		efSearch;
 	idx_t		enterpoint_node;
 	dist_func_t dist_func;
+	size_t		max_dist_calcs; /* search is stopped after this number of distance calculations (0 - unlimited) */
+	int64_t		deadline;       /* search is stopped at this time (0 - unlimited), see hnsw_search_expired */
+	size_t		patience;       /* search is stopped after this number of expansions not improving results (0 - never) */
+	quantization_t quantization; /* format of stored vectors, data_size is size of encoded vector */
+	float		sq_scale;       /* int8 quantization: coordinate = sq_offsets[i] + code * sq_scale */
+	float*		sq_offsets;
+	size_t		pq_subvectors;  /* product quantization: number of subvectors */
+	float*		pq_codebook;    /* centroids of subspaces, see hnsw_pq_centroid */
+	float*		pq_table;       /* distances between subvectors of the query and centroids: if set, distance from the query
+								 * (first argument of hnsw_vector_dist) is calculated by table lookups */
+	bool		pq_bounds;      /* search returns lower bounds of exact distances instead of PQ distances */
+	size_t		rerank_factor;  /* binary quantization, projection or prefix distances: number of candidates rescored using full
+								 * precision vectors is rerank_factor times larger than number of results (0 - no rescoring) */
+	size_t		prefix_dim;     /* number of leading coordinates used to calculate distances (0 - all) */
+	size_t		projection_dim; /* projection: number of dimensions of projected vectors */
+	float*		projection;     /* projection matrix: projection_dim rows of dim coordinates */
+	float		alpha;          /* pruning of neighbors: candidate is dropped if it is alpha times closer to selected neighbor
+								 * than to the element (1 - HNSW heuristic, larger values keep more long links as in Vamana) */
+	bool		link_codes;     /* link lists contain codes of neighbors */
+	HnswLinkCode query_code;    /* code of the query used by search to skip neighbors (link_codes) */
 } HnswMetadata;
 
+/*
+ * Cumulative statistic of index searches performed by this backend
+ */
+typedef struct
+{
+	uint64_t	searches;
+	uint64_t	expansions;             /* number of visited candidates */
+	uint64_t	distance_computations;
+	uint64_t	patience_stops;         /* searches stopped because results were not improved */
+	uint64_t	budget_stops;           /* searches stopped by distance computations limit or deadline */
+} HnswSearchStats;
+
+extern HnswSearchStats hnsw_search_stats;
+
 extern bool hnsw_is_deleted(label_t label);
+extern bool hnsw_search_expired(HnswMetadata* meta);
+extern void hnsw_get_label(HnswMetadata* meta, idx_t idx, label_t* label);
 
-extern bool hnsw_search(HnswMetadata* meta, const coord_t *point, size_t* n_results, label_t** results);
+extern bool hnsw_search(HnswMetadata* meta, const coord_t *point, size_t* n_results, label_t** results, dist_t** dists);
+extern bool hnsw_exact_search(HnswMetadata* meta, const coord_t *point, idx_t n_elems, size_t* n_results, label_t** results, dist_t** dists);
 extern bool hnsw_bind_point(HnswMetadata* meta, const coord_t *point, idx_t idx);
+extern bool hnsw_find_nearest(HnswMetadata* meta, const coord_t *point, idx_t* idx);
 extern bool hnsw_begin_read(HnswMetadata* meta, idx_t idx, idx_t** indexes, coord_t** coords, label_t* label);
 extern void hnsw_end_read(HnswMetadata* meta);
-extern void hnsw_begin_write(HnswMetadata* meta, idx_t idx, idx_t** indexes, coord_t** coords, label_t* label);
-extern void hnsw_end_write(HnswMetadata* meta);
+extern void hnsw_set_links(HnswMetadata* meta, idx_t idx, idx_t const* links, size_t n_links);
+extern bool hnsw_links_fit(HnswMetadata* meta, idx_t const* links, size_t n_links);
 
+extern void hnsw_dist_batch(HnswMetadata* meta, coord_t const* point, idx_t const* ids, size_t n_ids, dist_t* dists);
+extern bool hnsw_read_full_vector(HnswMetadata* meta, idx_t idx, coord_t* dst);
 extern void hnsw_prefetch(HnswMetadata* meta, idx_t idx);
+extern void hnsw_prefetch_links(HnswMetadata* meta, idx_t idx);
 
 extern dist_t hnsw_dist_func(dist_func_t dist, coord_t const* ax, coord_t const* bx, size_t dim);
+extern dist_t hnsw_vector_dist(HnswMetadata* meta, void const* ax, void const* bx);
+extern void   hnsw_quantize(HnswMetadata* meta, coord_t const* src, void* dst);
+extern dist_t hnsw_quantization_error(HnswMetadata* meta, coord_t const* query, void const* code);
+extern dist_t hnsw_distance_lower_bound(HnswMetadata* meta, dist_t dist, void const* code);
+extern void   hnsw_pq_train(HnswMetadata* meta, coord_t const* sample, size_t n_vectors);
+extern float* hnsw_pq_table(HnswMetadata* meta, coord_t const* query);
+extern void   hnsw_projection_train(HnswMetadata* meta, coord_t const* sample, size_t n_vectors);
+extern void   hnsw_ivf_train(HnswMetadata* meta, coord_t const* sample, size_t n_vectors, coord_t* centroids, size_t n_centroids);
+extern void   hnsw_link_code(HnswMetadata* meta, coord_t const* vector, HnswLinkCode* code);
+extern dist_t hnsw_link_code_bound(HnswMetadata* meta, HnswLinkCode const* code);
 extern void   hnsw_init_dist_func(void);
@@ -0,0 +1,1046 @@
+// Copyright 2023 Neon Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*
+ * Flat index: access method for exact nearest neighbor search.
+ *
+ * Vectors are stored densely in data pages following the metapage: page contains array of labels
+ * growing from the page header and array of vectors starting at cache line boundary, so vectors are aligned
+ * and distances are calculated by the same SIMD functions as for HNSW index. Number of vectors in the page
+ * is determined by pd_lower, and pd_upper points to the start of vectors, so only the unused part of label
+ * array is omitted from WAL.
+ *
+ * Vacuum marks labels as deleted and records pages containing them in free space map. Insertion stores vector
+ * in the slot of deleted entry if there is one, otherwise appends it to the last page, so both are O(1) per tuple.
+ * Inserts lock only the page they modify, so they don't block each other unless they target the same page.
+ * Search reads all data pages sequentially with read-ahead and keeps K best results in bounded heap.
+ * K is taken from LIMIT of the query. If more tuples are requested, the scan is repeated with doubled K
+ * and only results following the last returned one in (distance, TID) order are collected, so results are
+ * never repeated. Results are exact unless vectors are stored in half precision: then they are ordered by
+ * distances to the rounded vectors and are approximate.
+ */
+#include "postgres.h"
+
+#include "access/amapi.h"
+#include "access/generic_xlog.h"
+#include "access/reloptions.h"
+#include "access/tableam.h"
+#include "commands/vacuum.h"
+#include "miscadmin.h"
+#include "optimizer/cost.h"
+#include "storage/bufmgr.h"
+#include "storage/freespace.h"
+#include "storage/lmgr.h"
+#if PG_VERSION_NUM >= 170000
+#include "storage/read_stream.h"
+#endif
+#include "utils/array.h"
+#include "utils/spccache.h"
+
+#include <math.h>
+#include <float.h>
+
+#include "hnsw.h"
+
+#define FLAT_META_PAGE        0
+#define FLAT_FIRST_DATA_PAGE  1
+
+#define FLAT_META_MAGIC   0x464C4154 /* "FLAT" */
+#define FLAT_META_VERSION 1
+
+#define FLAT_LABELS_OFFSET    MAXALIGN(SizeOfPageHeaderData)
+#define FLAT_VECTOR_ALIGN     64
+
+#define FLAT_INITIAL_RESULTS  64      /* K of the first scan if LIMIT is not known */
+#define FLAT_MAX_INITIAL_RESULTS 65536 /* larger LIMIT is reached by repeated scans */
+#define FLAT_PREFETCH_DISTANCE 32     /* read-ahead of data pages if read stream is not available */
+
+/*
+ * Options of flat index: only "dims" is mandatory
+ */
+typedef struct {
+	int32 vl_len_;		/* varlena header (do not touch directly!) */
+	int dims;
+	int quantization;	/* offset of quantization name string */
+} FlatOptions;
+
+typedef struct {
+	uint32 magic;
+	uint32 version;
+	uint32 dims;
+	uint32 quantization;
+} FlatMetaPageData;
+
+#define FlatPageGetMeta(page) ((FlatMetaPageData*)PageGetContents(page))
+
+/*
+ * Format of data pages reconstructed from index options
+ */
+typedef struct {
+	HnswMetadata meta;      /* only fields used by distance functions and quantization are set */
+	Relation     rel;
+	bool         unlogged;  /* index construction: pages are WAL-logged at the end of build */
+	size_t       vectors_per_page;
+	size_t       vectors_offset;
+	size_t       n_inserted;
+} FlatIndex;
+
+#define FlatPageGetCount(page) ((((PageHeader)(page))->pd_lower - FLAT_LABELS_OFFSET) / sizeof(HnswLabel))
+#define FlatPageGetLabels(page) ((HnswLabel*)((char*)(page) + FLAT_LABELS_OFFSET))
+#define FlatPageGetVector(flat, page, i) ((char*)(page) + (flat)->vectors_offset + (i) * (flat)->meta.data_size)
+
+typedef struct {
+	ItemPointerData tid;
+	dist_t          distance;
+} FlatScanResult;
+
+typedef struct {
+	FlatIndex   flat;
+	ArrayType*  key;
+	coord_t*    point;		/* scan key in index format */
+	void*       code;		/* buffer for quantized scan key */
+	bool        started;
+	size_t      limit;		/* number of tuples requested by LIMIT clause (0 - unknown), see hnsw_get_scan_limit */
+	size_t      k;			/* number of results collected by one pass over the index */
+	bool        exhausted;	/* last pass collected all remaining tuples */
+	bool        has_last;
+	FlatScanResult last;	/* last returned result: next pass collects only results following it */
+	size_t      curr;
+	size_t      n_results;
+	FlatScanResult* results;
+	BufferAccessStrategy strategy;
+} FlatScanOpaqueData;
+
+typedef FlatScanOpaqueData* FlatScanOpaque;
+
+static relopt_kind flat_relopt_kind;
+
+static bool flat_gettuple(IndexScanDesc scan, ScanDirection dir);
+
+static quantization_t
+flat_parse_quantization(const char* name)
+{
+	if (name == NULL || strcmp(name, "none") == 0)
+		return QUANT_NONE;
+	if (strcmp(name, "float16") == 0)
+		return QUANT_FLOAT16;
+	if (strcmp(name, "bfloat16") == 0)
+		return QUANT_BFLOAT16;
+	ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("invalid value for \"quantization\" option: \"%s\"", name),
+			 errdetail("Valid values are \"none\", \"float16\" and \"bfloat16\".")));
+}
+
+static void
+flat_validate_quantization(const char* value)
+{
+	(void)flat_parse_quantization(value);
+}
+
+/*
+ * Define options of flat index: called by _PG_init
+ */
+void flat_init(void)
+{
+	flat_relopt_kind = add_reloption_kind();
+	add_int_reloption(flat_relopt_kind, "dims", "Number of dimensions",
+					  0, 0, INT_MAX
+#if PG_VERSION_NUM >= 130000
+					  , AccessExclusiveLock
+#endif
+					  );
+	add_string_reloption(flat_relopt_kind, "quantization", "Format of stored vectors: 'none' for float coordinates, 'float16' or 'bfloat16' for half precision",
+						 "none", flat_validate_quantization
+#if PG_VERSION_NUM >= 130000
+						 , AccessExclusiveLock
+#endif
+						 );
+}
+
+/*
+ * Calculate format of data pages from index options
+ */
+static void
+flat_init_index(FlatIndex* flat, Relation index)
+{
+	FlatOptions *opts = (FlatOptions *) index->rd_options;
+
+	if (opts == NULL || opts->dims == 0)
+		elog(ERROR, "Flat index requires 'dims' to be specified");
+
+	MemSet(flat, 0, sizeof(FlatIndex));
+	flat->rel = index;
+	flat->unlogged = false;
+	flat->meta.dim = opts->dims;
+	flat->meta.quantization = flat_parse_quantization(opts->quantization ? (char*)opts + opts->quantization : NULL);
+	flat->meta.data_size = flat->meta.quantization != QUANT_NONE
+		? TYPEALIGN(sizeof(coord_t), flat->meta.dim * sizeof(uint16))
+		: flat->meta.dim * sizeof(coord_t);
+	flat->vectors_per_page = (BLCKSZ - FLAT_LABELS_OFFSET - (FLAT_VECTOR_ALIGN - 1)) / (sizeof(HnswLabel) + flat->meta.data_size);
+	if (flat->vectors_per_page == 0)
+		elog(ERROR, "Vector of %d dimensions doesn't fit in flat index page", (int)flat->meta.dim);
+	flat->vectors_offset = TYPEALIGN(FLAT_VECTOR_ALIGN, FLAT_LABELS_OFFSET + flat->vectors_per_page * sizeof(HnswLabel));
+	Assert(flat->vectors_offset + flat->vectors_per_page * flat->meta.data_size <= BLCKSZ);
+}
+
+static void
+flat_init_full_index(FlatIndex* flat, Relation index)
+{
+	flat_init_index(flat, index);
+	flat->meta.dist_func = hnsw_resolve_dist_func(index);
+}
+
+static void
+flat_check_meta(FlatIndex* flat, Page page)
+{
+	FlatMetaPageData* metad = FlatPageGetMeta(page);
+	if (metad->magic != FLAT_META_MAGIC)
+		elog(ERROR, "Flat index metapage is corrupted");
+	if (metad->dims != (uint32)flat->meta.dim || metad->quantization != (uint32)flat->meta.quantization)
+		elog(ERROR, "Inconsistency with flat index metadata: options of flat index can not be altered");
+}
+
+static void
+flat_init_meta(FlatIndex* flat, ForkNumber forknum)
+{
+	Buffer buf = ReadBufferExtended(flat->rel, forknum, P_NEW, RBM_NORMAL, NULL);
+	Page page;
+	FlatMetaPageData* metad;
+
+	Assert(BufferGetBlockNumber(buf) == FLAT_META_PAGE);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	page = BufferGetPage(buf);
+	PageInit(page, BufferGetPageSize(buf), 0);
+	metad = FlatPageGetMeta(page);
+	metad->magic = FLAT_META_MAGIC;
+	metad->version = FLAT_META_VERSION;
+	metad->dims = (uint32)flat->meta.dim;
+	metad->quantization = (uint32)flat->meta.quantization;
+	((PageHeader) page)->pd_lower = (char*)(metad + 1) - (char*)page;
+	MarkBufferDirty(buf);
+	UnlockReleaseBuffer(buf);
+}
+
+static void
+flat_init_page(FlatIndex* flat, Page page)
+{
+	PageInit(page, BLCKSZ, 0);
+	((PageHeader) page)->pd_lower = FLAT_LABELS_OFFSET;
+	((PageHeader) page)->pd_upper = flat->vectors_offset;
+}
+
+/*
+ * Free space map stores free space of the page rounded down to multiple of BLCKSZ/256, and request is rounded up.
+ * Pages are recorded with the total size of their deleted slots, which is at least BLCKSZ/256,
+ * and looked up by the minimal nonzero amount of space, so a page with any deleted slot is found.
+ */
+#define FLAT_FSM_STEP (BLCKSZ / 256)
+#define FlatSlotSize(flat) Max(sizeof(HnswLabel) + (flat)->meta.data_size, FLAT_FSM_STEP)
+
+/*
+ * Store vector in the slot of entry deleted by vacuum. Pages with deleted entries are recorded in free space map
+ * by flat_bulkdelete; map is just a hint, so the page is rechecked and its entry is updated after the lookup.
+ * Returns false if there are no free slots.
+ */
+static bool
+flat_reuse_slot(FlatIndex* flat, void const* vector, ItemPointer tid)
+{
+	BlockNumber blkno;
+
+	while ((blkno = GetPageWithFreeSpace(flat->rel, FLAT_FSM_STEP)) != InvalidBlockNumber)
+	{
+		Buffer buf;
+		Page page;
+		HnswLabel const* labels;
+		size_t n, slot, n_free = 0;
+
+		if (blkno < FLAT_FIRST_DATA_PAGE)
+		{
+			RecordPageWithFreeSpace(flat->rel, blkno, 0);
+			continue;
+		}
+		buf = ReadBuffer(flat->rel, blkno);
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+		page = BufferGetPage(buf);
+		n = PageIsNew(page) ? 0 : FlatPageGetCount(page);
+		labels = FlatPageGetLabels(page);
+		slot = n;
+		for (size_t i = 0; i < n; i++)
+		{
+			if (labels[i].pg.flags & DELETED_FLAG)
+			{
+				if (slot == n)
+					slot = i;
+				else
+					n_free += 1;
+			}
+		}
+		if (slot < n)
+		{
+			GenericXLogState* state = GenericXLogStart(flat->rel);
+			page = GenericXLogRegisterBuffer(state, buf, 0);
+			FlatPageGetLabels(page)[slot].pg.tid = *tid;
+			FlatPageGetLabels(page)[slot].pg.flags = 0;
+			memcpy(FlatPageGetVector(flat, page, slot), vector, flat->meta.data_size);
+			MarkBufferDirty(buf);
+			GenericXLogFinish(state);
+		}
+		UnlockReleaseBuffer(buf);
+		RecordPageWithFreeSpace(flat->rel, blkno, n_free * FlatSlotSize(flat));
+		if (slot < n)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Add vector to the index: reuse slot of deleted entry or append vector to the last data page.
+ * The last page is remembered as target block of the relation, so inserts don't have to find size of the relation.
+ * Concurrent inserts are serialized only by lock of the page they modify, and the relation is extended
+ * under relation extension lock.
+ */
+static void
+flat_append(FlatIndex* flat, coord_t const* coords, ItemPointer tid)
+{
+	char code[BLCKSZ];
+	void const* vector = coords;
+	GenericXLogState* state = NULL;
+	BlockNumber blkno;
+	BlockNumber n_blocks;
+	Buffer metabuf;
+	Buffer buf = InvalidBuffer;
+	Page page;
+	bool is_new;
+	size_t n;
+
+	if (flat->meta.quantization != QUANT_NONE)
+	{
+		hnsw_quantize(&flat->meta, coords, code);
+		vector = code;
+	}
+
+	metabuf = ReadBuffer(flat->rel, FLAT_META_PAGE);
+	LockBuffer(metabuf, BUFFER_LOCK_SHARE);
+	flat_check_meta(flat, BufferGetPage(metabuf));
+	UnlockReleaseBuffer(metabuf);
+
+	/* There are no deleted entries during index build */
+	if (!flat->unlogged && flat_reuse_slot(flat, vector, tid))
+	{
+		flat->n_inserted += 1;
+		return;
+	}
+
+	blkno = RelationGetTargetBlock(flat->rel);
+	if (blkno == InvalidBlockNumber)
+	{
+		n_blocks = RelationGetNumberOfBlocks(flat->rel);
+		if (n_blocks > FLAT_FIRST_DATA_PAGE)
+			blkno = n_blocks - 1;
+	}
+	if (blkno != InvalidBlockNumber)
+	{
+		buf = ReadBuffer(flat->rel, blkno);
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+		page = BufferGetPage(buf);
+		if (!PageIsNew(page) && FlatPageGetCount(page) >= flat->vectors_per_page)
+		{
+			UnlockReleaseBuffer(buf);
+			buf = InvalidBuffer;
+		}
+	}
+	if (!BufferIsValid(buf))
+	{
+		LockRelationForExtension(flat->rel, ExclusiveLock);
+		/* Concurrent insert may have already added a page while we were waiting for the lock */
+		n_blocks = RelationGetNumberOfBlocks(flat->rel);
+		if (n_blocks > FLAT_FIRST_DATA_PAGE && n_blocks - 1 != blkno)
+		{
+			buf = ReadBuffer(flat->rel, n_blocks - 1);
+			LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+			page = BufferGetPage(buf);
+			if (!PageIsNew(page) && FlatPageGetCount(page) >= flat->vectors_per_page)
+			{
+				UnlockReleaseBuffer(buf);
+				buf = InvalidBuffer;
+			}
+		}
+		if (!BufferIsValid(buf))
+		{
+			buf = ReadBuffer(flat->rel, P_NEW);
+			LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+		}
+		UnlockRelationForExtension(flat->rel, ExclusiveLock);
+		RelationSetTargetBlock(flat->rel, BufferGetBlockNumber(buf));
+	}
+
+	/* Page may remain uninitialized if insert which extended the relation has failed */
+	is_new = PageIsNew(BufferGetPage(buf));
+	if (!flat->unlogged)
+	{
+		state = GenericXLogStart(flat->rel);
+		page = GenericXLogRegisterBuffer(state, buf, is_new ? GENERIC_XLOG_FULL_IMAGE : 0);
+	}
+	else
+		page = BufferGetPage(buf);
+	if (is_new)
+		flat_init_page(flat, page);
+
+	n = FlatPageGetCount(page);
+	FlatPageGetLabels(page)[n].pg.tid = *tid;
+	FlatPageGetLabels(page)[n].pg.flags = 0;
+	memcpy(FlatPageGetVector(flat, page, n), vector, flat->meta.data_size);
+	((PageHeader) page)->pd_lower += sizeof(HnswLabel);
+
+	MarkBufferDirty(buf);
+	if (state)
+		GenericXLogFinish(state);
+	UnlockReleaseBuffer(buf);
+	flat->n_inserted += 1;
+}
+
+static coord_t*
+flat_get_vector(FlatIndex* flat, Datum value, ArrayType** array)
+{
+	int n_items;
+
+	*array = DatumGetArrayTypePCopy(value);
+	n_items = ArrayGetNItems(ARR_NDIM(*array), ARR_DIMS(*array));
+	if (n_items != flat->meta.dim)
+		elog(ERROR, "Wrong number of dimensions: %d instead of %d expected",
+			 n_items, (int)flat->meta.dim);
+	return (coord_t*)ARR_DATA_PTR(*array);
+}
+
+static void
+flat_build_callback(Relation index,
+#if PG_VERSION_NUM >= 130000
+					ItemPointer tid,
+#else
+					HeapTuple hup,
+#endif
+					Datum *values, bool *isnull, bool tupleIsAlive, void *state)
+{
+	FlatIndex* flat = (FlatIndex*) state;
+	ArrayType* array;
+	coord_t* coords;
+
+#if PG_VERSION_NUM < 130000
+	ItemPointer tid = &hup->t_self;
+#endif
+
+	/* Skip nulls */
+	if (isnull[0])
+		return;
+
+	coords = flat_get_vector(flat, values[0], &array);
+	flat_append(flat, coords, tid);
+	pfree(array);
+}
+
+/*
+ * Build the index for a logged table
+ */
+static IndexBuildResult *
+flat_build(Relation heap, Relation index, IndexInfo *indexInfo)
+{
+	FlatIndex flat;
+	IndexBuildResult* result = (IndexBuildResult *) palloc(sizeof(IndexBuildResult));
+
+	flat_init_full_index(&flat, index);
+	flat.unlogged = true;
+	#ifdef NEON_SMGR
+	smgr_start_unlogged_build(RelationGetSmgr(index));
+	#endif
+
+	flat_init_meta(&flat, MAIN_FORKNUM);
+
+	Assert(indexInfo->ii_NumIndexAttrs == 1);
+	table_index_build_scan(heap, index, indexInfo,
+						   true, true, flat_build_callback, (void *)&flat, NULL);
+
+	#ifdef NEON_SMGR
+	smgr_finish_unlogged_build_phase_1(RelationGetSmgr(index));
+	#endif
+
+	if (RelationNeedsWAL(index))
+		hnsw_log_fork(index, MAIN_FORKNUM);
+	#ifdef NEON_SMGR
+	smgr_end_unlogged_build(RelationGetSmgr(index));
+	#endif
+
+	result->heap_tuples = result->index_tuples = flat.n_inserted;
+	return result;
+}
+
+/*
+ * Build the index for an unlogged table
+ */
+static void
+flat_buildempty(Relation index)
+{
+	FlatIndex flat;
+	flat_init_index(&flat, index);
+	flat_init_meta(&flat, INIT_FORKNUM);
+	/* Init fork is copied to the main fork at recovery, so it is always WAL-logged */
+	hnsw_log_fork(index, INIT_FORKNUM);
+}
+
+/*
+ * Insert a tuple into the index
+ */
+static bool
+flat_insert(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid,
+			Relation heap, IndexUniqueCheck checkUnique,
+#if PG_VERSION_NUM >= 140000
+			bool indexUnchanged,
+#endif
+			IndexInfo *indexInfo)
+{
+	FlatIndex flat;
+	ArrayType* array;
+	coord_t* coords;
+
+	/* Skip nulls */
+	if (isnull[0])
+		return false;
+
+	flat_init_full_index(&flat, index);
+	coords = flat_get_vector(&flat, values[0], &array);
+	flat_append(&flat, coords, heap_tid);
+	pfree(array);
+	return true;
+}
+
+/*
+ * Bulk delete tuples from the index: labels are marked as deleted, vectors are not moved.
+ * Pages with deleted entries are recorded in free space map, so their slots are reused by inserts.
+ * Callback is invoked without holding any buffer lock.
+ */
+static IndexBulkDeleteResult *
+flat_bulkdelete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
+				IndexBulkDeleteCallback callback, void *callback_state)
+{
+	Relation	index = info->index;
+	FlatIndex	flat;
+	BlockNumber n_blocks = RelationGetNumberOfBlocks(index);
+	HnswLabel*	labels;
+	bool*		updated;
+
+	if (stats == NULL)
+		stats = (IndexBulkDeleteResult *) palloc0(sizeof(IndexBulkDeleteResult));
+
+	flat_init_index(&flat, index);
+	labels = (HnswLabel*)palloc(flat.vectors_per_page * sizeof(HnswLabel));
+	updated = (bool*)palloc(flat.vectors_per_page * sizeof(bool));
+
+	for (BlockNumber blkno = FLAT_FIRST_DATA_PAGE; blkno < n_blocks; blkno++)
+	{
+		Buffer buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, info->strategy);
+		Page page = BufferGetPage(buf);
+		size_t n_labels;
+		size_t n_free = 0;
+		int n_updated = 0;
+
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		n_labels = PageIsNew(page) ? 0 : FlatPageGetCount(page);
+		memcpy(labels, FlatPageGetLabels(BufferGetPage(buf)), n_labels * sizeof(HnswLabel));
+		LockBuffer(buf, BUFFER_LOCK_UNLOCK);
+
+		for (size_t i = 0; i < n_labels; i++)
+		{
+			updated[i] = false;
+			if (labels[i].pg.flags & DELETED_FLAG)
+			{
+				n_free++;
+				continue;
+			}
+			if (callback(&labels[i].pg.tid, callback_state))
+			{
+				updated[i] = true;
+				stats->tuples_removed++;
+				n_updated++;
+				n_free++;
+			}
+			else
+				stats->num_index_tuples++;
+		}
+		if (n_updated > 0)
+		{
+			GenericXLogState *state;
+
+			LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+			state = GenericXLogStart(index);
+			page = GenericXLogRegisterBuffer(state, buf, 0);
+			for (size_t i = 0; i < n_labels; i++)
+			{
+				if (updated[i])
+					FlatPageGetLabels(page)[i].pg.flags |= DELETED_FLAG;
+			}
+			MarkBufferDirty(buf);
+			GenericXLogFinish(state);
+			LockBuffer(buf, BUFFER_LOCK_UNLOCK);
+		}
+		ReleaseBuffer(buf);
+		RecordPageWithFreeSpace(index, blkno, n_free * FlatSlotSize(&flat));
+	}
+	pfree(labels);
+	pfree(updated);
+	/* Make recorded pages visible to searches of free space map */
+	FreeSpaceMapVacuum(index);
+	return stats;
+}
+
+/*
+ * Clean up after a VACUUM operation
+ */
+static IndexBulkDeleteResult *
+flat_vacuumcleanup(IndexVacuumInfo *info, IndexBulkDeleteResult *stats)
+{
+	if (stats == NULL)
+		return NULL;
+
+	stats->num_pages = RelationGetNumberOfBlocks(info->index);
+
+	return stats;
+}
+
+/*
+ * Total order of results: ties of distances are resolved by TID, so repeated scan can continue after the last result
+ */
+static int
+flat_compare_results(const void* a, const void* b)
+{
+	FlatScanResult const* ra = (FlatScanResult const*)a;
+	FlatScanResult const* rb = (FlatScanResult const*)b;
+	if (ra->distance != rb->distance)
+		return ra->distance < rb->distance ? -1 : 1;
+	return ItemPointerCompare((ItemPointer)&ra->tid, (ItemPointer)&rb->tid);
+}
+
+/*
+ * Add result to max-heap of at most k best results
+ */
+static void
+flat_heap_push(FlatScanResult* heap, size_t* n, size_t k, FlatScanResult const* r)
+{
+	size_t i;
+
+	if (*n < k)
+	{
+		/* Sift up */
+		i = (*n)++;
+		while (i > 0 && flat_compare_results(&heap[(i - 1) / 2], r) < 0)
+		{
+			heap[i] = heap[(i - 1) / 2];
+			i = (i - 1) / 2;
+		}
+		heap[i] = *r;
+	}
+	else if (flat_compare_results(r, &heap[0]) < 0)
+	{
+		/* Replace the worst result and sift down */
+		i = 0;
+		while (true)
+		{
+			size_t child = i * 2 + 1;
+			if (child >= k)
+				break;
+			if (child + 1 < k && flat_compare_results(&heap[child], &heap[child + 1]) < 0)
+				child += 1;
+			if (flat_compare_results(r, &heap[child]) >= 0)
+				break;
+			heap[i] = heap[child];
+			i = child;
+		}
+		heap[i] = *r;
+	}
+}
+
+#if PG_VERSION_NUM >= 170000
+typedef struct
+{
+	BlockNumber next;
+	BlockNumber end;
+} FlatStreamState;
+
+static BlockNumber flat_stream_next_block(ReadStream* stream, void* callback_private_data, void* per_buffer_data)
+{
+	FlatStreamState* state = (FlatStreamState*)callback_private_data;
+	return state->next < state->end ? state->next++ : InvalidBlockNumber;
+}
+#endif
+
+/*
+ * One pass over all data pages collecting k nearest results following the last returned one
+ */
+static void
+flat_scan(FlatScanOpaque so)
+{
+	FlatIndex*  flat = &so->flat;
+	Relation    rel = flat->rel;
+	BlockNumber n_blocks = RelationGetNumberOfBlocks(rel);
+	size_t      max_vectors = n_blocks > FLAT_FIRST_DATA_PAGE ? (n_blocks - FLAT_FIRST_DATA_PAGE) * flat->vectors_per_page : 0;
+	size_t      k = Min(so->k, max_vectors);
+	size_t      n_results = 0;
+	size_t      n_candidates = 0;
+	FlatScanResult* heap;
+#if PG_VERSION_NUM >= 170000
+	FlatStreamState stream_state;
+	ReadStream* stream;
+
+	stream_state.next = FLAT_FIRST_DATA_PAGE;
+	stream_state.end = n_blocks;
+	stream = read_stream_begin_relation(READ_STREAM_FULL, so->strategy, rel, MAIN_FORKNUM,
+										flat_stream_next_block, &stream_state, 0);
+#endif
+
+	if (so->results)
+		pfree(so->results);
+	heap = (FlatScanResult*)palloc_extended(Max(k, 1) * sizeof(FlatScanResult), MCXT_ALLOC_HUGE);
+
+	for (BlockNumber blkno = FLAT_FIRST_DATA_PAGE; blkno < n_blocks; blkno++)
+	{
+		Buffer buf;
+		Page page;
+		HnswLabel const* labels;
+		size_t n;
+
+		CHECK_FOR_INTERRUPTS();
+#if PG_VERSION_NUM >= 170000
+		buf = read_stream_next_buffer(stream, NULL);
+		Assert(BufferGetBlockNumber(buf) == blkno);
+#else
+		if (blkno + FLAT_PREFETCH_DISTANCE < n_blocks)
+			PrefetchBuffer(rel, MAIN_FORKNUM, blkno + FLAT_PREFETCH_DISTANCE);
+		buf = ReadBufferExtended(rel, MAIN_FORKNUM, blkno, RBM_NORMAL, so->strategy);
+#endif
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		labels = FlatPageGetLabels(page);
+		n = PageIsNew(page) ? 0 : FlatPageGetCount(page);
+		for (size_t i = 0; i < n; i++)
+		{
+			FlatScanResult r;
+
+			if (labels[i].pg.flags & DELETED_FLAG)
+				continue;
+
+			r.tid = labels[i].pg.tid;
+			r.distance = hnsw_vector_dist(&flat->meta, so->point, FlatPageGetVector(flat, page, i));
+			if (so->has_last && flat_compare_results(&r, &so->last) <= 0)
+				continue;
+
+			n_candidates += 1;
+			flat_heap_push(heap, &n_results, k, &r);
+		}
+		UnlockReleaseBuffer(buf);
+	}
+#if PG_VERSION_NUM >= 170000
+	Assert(read_stream_next_buffer(stream, NULL) == InvalidBuffer);
+	read_stream_end(stream);
+#endif
+
+	pg_qsort(heap, n_results, sizeof(FlatScanResult), flat_compare_results);
+	so->results = heap;
+	so->n_results = n_results;
+	so->curr = 0;
+	so->exhausted = n_candidates <= k;
+}
+
+/*
+ * Start or restart an index scan
+ */
+static IndexScanDesc
+flat_beginscan(Relation index, int nkeys, int norderbys)
+{
+	IndexScanDesc scan = RelationGetIndexScan(index, nkeys, norderbys);
+	FlatScanOpaque so = (FlatScanOpaque) palloc0(sizeof(FlatScanOpaqueData));
+
+	flat_init_full_index(&so->flat, index);
+	so->limit = hnsw_get_scan_limit(index);
+	/* Index can be much larger than shared buffers: pass it through ring buffer, like sequential scan of a table */
+	so->strategy = GetAccessStrategy(BAS_BULKREAD);
+	scan->opaque = so;
+	return scan;
+}
+
+/*
+ * Start or restart an index scan
+ */
+static void
+flat_rescan(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderbys, int norderbys)
+{
+	FlatScanOpaque so = (FlatScanOpaque) scan->opaque;
+	if (so->results)
+	{
+		pfree(so->results);
+		so->results = NULL;
+	}
+	so->started = false;
+	so->curr = 0;
+	so->n_results = 0;
+	if (orderbys && scan->numberOfOrderBys > 0)
+		memmove(scan->orderByData, orderbys, scan->numberOfOrderBys * sizeof(ScanKeyData));
+}
+
+/*
+ * Fetch the next tuple in the given scan
+ */
+static bool
+flat_gettuple(IndexScanDesc scan, ScanDirection dir)
+{
+	FlatScanOpaque so = (FlatScanOpaque) scan->opaque;
+
+	/* Postgres doesn't support backward scan on operators */
+	Assert(ScanDirectionIsForward(dir));
+
+	if (!so->started)
+	{
+		Buffer metabuf;
+
+		/* Safety check */
+		if (scan->orderByData == NULL)
+			elog(ERROR, "cannot scan flat index without order");
+
+		/* No items will match if null */
+		if (scan->orderByData->sk_flags & SK_ISNULL)
+			return false;
+
+		metabuf = ReadBuffer(scan->indexRelation, FLAT_META_PAGE);
+		LockBuffer(metabuf, BUFFER_LOCK_SHARE);
+		flat_check_meta(&so->flat, BufferGetPage(metabuf));
+		UnlockReleaseBuffer(metabuf);
+
+		if (so->key)
+			pfree(so->key);
+		so->point = flat_get_vector(&so->flat, scan->orderByData->sk_argument, &so->key);
+		if (so->flat.meta.quantization != QUANT_NONE)
+		{
+			/* Distances are calculated between quantized vectors */
+			if (so->code == NULL)
+				so->code = palloc(so->flat.meta.data_size);
+			hnsw_quantize(&so->flat.meta, so->point, so->code);
+			so->point = (coord_t*)so->code;
+		}
+		so->k = so->limit != 0 ? Min(so->limit, FLAT_MAX_INITIAL_RESULTS) : FLAT_INITIAL_RESULTS;
+		so->has_last = false;
+		so->started = true;
+		flat_scan(so);
+	}
+	else if (so->curr >= so->n_results)
+	{
+		if (so->exhausted)
+			return false;
+		so->k *= 2;
+		flat_scan(so);
+	}
+	if (so->curr >= so->n_results)
+		return false;
+
+	so->last = so->results[so->curr++];
+	so->has_last = true;
+	scan->xs_heaptid = so->last.tid;
+	/* Distances to half precision vectors are not lower bounds of exact distances, so they can't be rechecked */
+	scan->xs_recheckorderby = false;
+	return true;
+}
+
+/*
+ * End a scan and release resources
+ */
+static void
+flat_endscan(IndexScanDesc scan)
+{
+	FlatScanOpaque so = (FlatScanOpaque) scan->opaque;
+	if (so->key)
+		pfree(so->key);
+	if (so->code)
+		pfree(so->code);
+	if (so->results)
+		pfree(so->results);
+	FreeAccessStrategy(so->strategy);
+	pfree(so);
+	scan->opaque = NULL;
+}
+
+/*
+ * Check if index is flat index: LIMIT hook records bounds only for scans of our access methods
+ */
+bool flat_is_index(Relation index)
+{
+	return index->rd_indam->amgettuple == flat_gettuple;
+}
+
+/*
+ * Each pass reads all pages sequentially and calculates distances to all vectors.
+ * Number of passes needed to return all tuples depends on K of the first pass.
+ */
+static void
+flat_costestimate(PlannerInfo *root, IndexPath *path, double loop_count,
+				  Cost *indexStartupCost, Cost *indexTotalCost,
+				  Selectivity *indexSelectivity, double *indexCorrelation
+				  ,double *indexPages
+)
+{
+	/* Never use index without order */
+	if (path->indexorderbys == NULL)
+	{
+		*indexStartupCost = DBL_MAX;
+		*indexTotalCost = DBL_MAX;
+		*indexSelectivity = 0;
+		*indexCorrelation = 0;
+		*indexPages = 0;
+		return;
+	}
+	else
+	{
+		IndexOptInfo *index = path->indexinfo;
+		Relation      rel = index_open(index->indexoid, NoLock);
+		FlatIndex     flat;
+		double        n_tuples = Max(index->tuples, 1);
+		double        k = FLAT_INITIAL_RESULTS;
+		double        n_rounds;
+		double        dist_cost;
+		double		  spc_random_page_cost;
+		double		  spc_seq_page_cost;
+
+		flat_init_index(&flat, rel);
+		index_close(rel, NoLock);
+
+		get_tablespace_page_costs(index->reltablespace,
+								  &spc_random_page_cost,
+								  &spc_seq_page_cost);
+
+		/* Scan is sized by LIMIT, see hnsw_get_scan_limit */
+		if (root->limit_tuples > 0)
+			k = Min(root->limit_tuples, FLAT_MAX_INITIAL_RESULTS);
+		n_rounds = n_tuples > k ? ceil(log(n_tuples / k) / log(2.0)) : 0;
+		/* Half precision vectors are smaller and cheaper to compare */
+		dist_cost = cpu_operator_cost * flat.meta.data_size / sizeof(coord_t);
+
+		*indexStartupCost = index->pages * spc_seq_page_cost + n_tuples * dist_cost;
+		*indexTotalCost = *indexStartupCost * (1 + n_rounds) + n_tuples * cpu_index_tuple_cost;
+		*indexSelectivity = 1.0;
+		*indexCorrelation = 0;
+		*indexPages = index->pages;
+	}
+}
+
+/*
+ * Parse and validate the reloptions
+ */
+static bytea *
+flat_options(Datum reloptions, bool validate)
+{
+	static const relopt_parse_elt tab[] = {
+		{"dims", RELOPT_TYPE_INT, offsetof(FlatOptions, dims)},
+		{"quantization", RELOPT_TYPE_STRING, offsetof(FlatOptions, quantization)}
+	};
+
+#if PG_VERSION_NUM >= 130000
+	return (bytea *) build_reloptions(reloptions, validate,
+									  flat_relopt_kind,
+									  sizeof(FlatOptions),
+									  tab, lengthof(tab));
+#else
+	relopt_value *options;
+	FlatOptions *rdopts;
+	int			numoptions;
+
+	options = parseRelOptions(reloptions, validate, flat_relopt_kind, &numoptions);
+
+	rdopts = allocateReloptStruct(sizeof(FlatOptions), options, numoptions);
+
+	fillRelOptions((void *) rdopts, sizeof(FlatOptions), options, numoptions, validate, tab, lengthof(tab));
+
+	return (bytea *) rdopts;
+#endif
+}
+
+/*
+ * Validate catalog entries for the specified operator class
+ */
+static bool
+flat_validate(Oid opclassoid)
+{
+	return true;
+}
+
+/*
+ * Define index handler
+ *
+ * See https://www.postgresql.org/docs/current/index-api.html
+ */
+PGDLLEXPORT PG_FUNCTION_INFO_V1(flat_handler);
+Datum
+flat_handler(PG_FUNCTION_ARGS)
+{
+	IndexAmRoutine *amroutine = makeNode(IndexAmRoutine);
+
+	amroutine->amstrategies = 0;
+	amroutine->amsupport = 1;
+#if PG_VERSION_NUM >= 130000
+	amroutine->amoptsprocnum = 0;
+#endif
+	amroutine->amcanorder = false;
+	amroutine->amcanorderbyop = true;
+	amroutine->amcanbackward = false;	/* can change direction mid-scan */
+	amroutine->amcanunique = false;
+	amroutine->amcanmulticol = false;
+	amroutine->amoptionalkey = true;
+	amroutine->amsearcharray = false;
+	amroutine->amsearchnulls = false;
+	amroutine->amstorage = false;
+	amroutine->amclusterable = false;
+	amroutine->ampredlocks = false;
+	amroutine->amcanparallel = false;
+	amroutine->amcaninclude = false;
+#if PG_VERSION_NUM >= 130000
+	amroutine->amusemaintenanceworkmem = false; /* not used during VACUUM */
+	amroutine->amparallelvacuumoptions = VACUUM_OPTION_PARALLEL_BULKDEL;
+#endif
+	amroutine->amkeytype = InvalidOid;
+
+	/* Interface functions */
+	amroutine->ambuild = flat_build;
+	amroutine->ambuildempty = flat_buildempty;
+	amroutine->aminsert = flat_insert;
+	amroutine->ambulkdelete = flat_bulkdelete;
+	amroutine->amvacuumcleanup = flat_vacuumcleanup;
+	amroutine->amcanreturn = NULL;
+	amroutine->amcostestimate = flat_costestimate;
+	amroutine->amoptions = flat_options;
+	amroutine->amproperty = NULL;
+	amroutine->ambuildphasename = NULL;
+	amroutine->amvalidate = flat_validate;
+#if PG_VERSION_NUM >= 140000
+	amroutine->amadjustmembers = NULL;
+#endif
+	amroutine->ambeginscan = flat_beginscan;
+	amroutine->amrescan = flat_rescan;
+	amroutine->amgettuple = flat_gettuple;
+	amroutine->amgetbitmap = NULL;
+	amroutine->amendscan = flat_endscan;
+	amroutine->ammarkpos = NULL;
+	amroutine->amrestrpos = NULL;
+
+	/* Interface functions to support parallel index scans */
+	amroutine->amestimateparallelscan = NULL;
+	amroutine->aminitparallelscan = NULL;
+	amroutine->amparallelrescan = NULL;
+
+	PG_RETURN_POINTER(amroutine);
+}
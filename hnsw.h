@@ -0,0 +1,391 @@
+// Copyright 2023 Neon Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*
+ * Postgres specific definitions of HNSW index shared by its modules
+ */
+#pragma once
+
+#include "access/genam.h"
+#include "lib/stringinfo.h"
+#include "storage/bufmgr.h"
+#include "storage/bufpage.h"
+#include "utils/rel.h"
+
+#include "embedding.h"
+
+#define HNSW_STACK_SIZE 4
+#define HNSW_PIN_CACHE_SIZE 32
+#define FIRST_PAGE      0
+
+/* Label flags */
+#define DELETED_FLAG 1
+
+/*
+ * Labels of elements are also stored in dense arrays indexed by element identifier, kept in label pages
+ * of the main fork (see HnswGroupStart). DELETED_FLAG in these arrays serves as bitmap of deleted elements,
+ * and because they map element to heap TID, vacuum can scan only label pages instead of element pages
+ * to locate elements referencing dead tuples.
+ */
+#define HNSW_LABELS_OFFSET   MAXALIGN(SizeOfPageHeaderData)
+#define HNSW_LABELS_PER_PAGE ((BLCKSZ - HNSW_LABELS_OFFSET) / sizeof(label_t))
+
+typedef union {
+	label_t label;
+	struct {
+		ItemPointerData tid;
+		uint16			flags;
+	} pg;
+} HnswLabel;
+
+#define HnswPageGetLabels(page) ((HnswLabel*)((char*)(page) + HNSW_LABELS_OFFSET))
+
+/*
+ * With split layout vectors are not stored in the elements: element contains only link list and label,
+ * and vectors are stored in dense arrays in vector pages, interleaved with element pages (see HnswVectorBlock).
+ * Graph traversal then reads compact adjacency pages and vector pages contain many more vectors.
+ * Index traversed using compact codes (HNSW_RESCORED) stores codes in the elements and full precision vectors
+ * in vector pages, so pages read by traversal are not filled with vectors needed only for rescoring.
+ */
+#define HnswPageGetVector(page, hnsw, idx) \
+	((coord_t*)((char*)(page) + (hnsw)->vectors_offset + (idx) % (hnsw)->vectors_per_page * (hnsw)->vector_stride))
+
+/*
+ * Slotted page format: instead of items addressed by line pointers elements are stored in array of fixed size
+ * slots, starting at cache line boundary. Number of elements in the page is determined by pd_lower.
+ * Slot size and vector stride in vector pages are rounded to HNSW_SLOT_ALIGN, so vectors are aligned.
+ */
+#define HNSW_SLOT_ALIGN      64
+#define HNSW_SLOTS_OFFSET    TYPEALIGN(HNSW_SLOT_ALIGN, SizeOfPageHeaderData)
+
+typedef enum
+{
+	HNSW_LAYOUT_INLINE, /* vector is stored in the element together with link list */
+	HNSW_LAYOUT_SPLIT   /* vectors are stored in separate vector pages */
+} HnswLayout;
+
+typedef enum
+{
+	HNSW_PROJECTION_NONE,
+	HNSW_PROJECTION_RANDOM, /* seeded random orthogonal projection */
+	HNSW_PROJECTION_PCA     /* principal components of the sample of indexed vectors */
+} HnswProjection;
+
+/*
+ * Link list of the element which will be updated at the end of insertion.
+ * links[0] is number of neighbors, like in link list stored in the element.
+ */
+typedef struct {
+	idx_t   idx;
+	idx_t*  links;
+} HnswPendingLinks;
+
+/*
+ * Buffer kept pinned during search
+ */
+typedef struct {
+	ForkNumber  forknum;
+	BlockNumber blkno;
+	Buffer      buf;
+	int         n_locks; /* number of times buffer is locked now */
+} HnswPinnedBuffer;
+
+/*
+ * Element which distance is calculated by hnsw_dist_batch
+ */
+typedef struct {
+	BlockNumber blkno;
+	uint32      pos;
+} HnswBatchItem;
+
+/*
+ * Postgres specific part of HNSW index.
+ * Format of elements is reconstructed from relation options, and the state of the graph is loaded
+ * from the metapage. Descriptor is cached in rd_amcache and copied for each operation.
+ * There is not protectionf from altering index option for existed index,
+ * butinfoirmation stored in opaque part of HNSW page allows to check if critical
+ * metadata fields are changed (dimensiopns and maxM).
+ */
+typedef struct {
+	HnswMetadata	meta;
+	Relation    	rel;
+	bool            unlogged;  /* Do not need to wallog changes: either relation is unlogged, either index construction */
+	uint64_t     	n_inserted; /* Calculated since start of operation */
+	Buffer          lockbuf; /* First page is used to provide MURSIW access to HNSW index */
+	BlockNumber     elements_start; /* First element page: follows metapage and PQ codebook, 0 for indexes created by older versions */
+	size_t          n_lists;     /* Number of IVF posting lists: elements of the graph are their centroids (0 - plain HNSW) */
+	double*         vector_sum;  /* Sum of vectors inserted by index build, used to locate medoid (Vamana build) */
+	size_t			n_buffers; /* Number of simultaneously accessed elements */
+	Buffer			buffers[HNSW_STACK_SIZE]; /* Element page buffers */
+	Buffer			vector_buffers[HNSW_STACK_SIZE]; /* Vector page buffers (split layout) */
+	HnswLayout      layout;
+	HnswProjection  projection;  /* How projection matrix is calculated at index build */
+	bool            slotted;     /* Slotted page format */
+	bool            compress_links; /* Link lists are compressed */
+	size_t          links_size;  /* Space reserved for link list in the element */
+	idx_t*          links_buf;   /* Decoded or cached link lists for each element in stack */
+	coord_t*        vector_buf;  /* Cached vectors for each element in stack */
+	MemoryContext   mcxt;        /* Context of this structure: search can be called in shorter living context */
+	size_t          slot_size;   /* Size of element slot (slotted format) */
+	size_t          vectors_offset; /* Offset of vectors array in vector page (split layout) */
+	size_t          vector_size;    /* Size of vector in vector page: encoded vector or full precision vector (HNSW_RESCORED) */
+	size_t          vector_stride;  /* Distance between vectors in vector page */
+	size_t          vectors_per_page; /* Number of vectors in vector page (0 - index has no vector pages) */
+	size_t          group_elems; /* Number of elements in group of pages sharing label page (0 - index has no label pages) */
+	BlockNumber     group_pages; /* Number of pages in the group */
+	BlockNumber     n_blocks;    /* Known number of blocks in the index (InvalidBlockNumber if not yet known) */
+	uint32          prewarm_generation; /* Generation of autoprewarm registry in which index was registered */
+	idx_t           pending_idx;  /* Element being inserted: it is written to the page only at the end of insertion */
+	char*           pending_item;
+	coord_t const*  pending_coord;
+	coord_t const*  pending_vector; /* Vector stored in vector page */
+	size_t          n_pending_links;
+	HnswPendingLinks* pending_links; /* Updated link lists of neighbors of inserted element */
+	size_t          n_pinned;    /* Number of used entries in pin cache */
+	size_t          pin_clock;   /* Next candidate for replacement in pin cache */
+	HnswPinnedBuffer pinned[HNSW_PIN_CACHE_SIZE];
+	size_t          batch_size;  /* Allocated size of batch array */
+	HnswBatchItem*  batch;       /* Elements sorted by blocks in hnsw_dist_batch */
+	BlockNumber*    batch_blocks; /* Blocks read by hnsw_dist_batch using read stream */
+} HnswIndex;
+
+/*
+ * This information in each HNSW page allows to detectincorrect metadata modification (ALTER INDEX)
+ * which affects index format
+ */
+typedef struct
+{
+	uint16_t dims;
+	uint16_t maxM;
+	uint16_t layout;
+	uint16_t flags;
+} HnswPageOpaque;
+
+/* Page opaque flags */
+#define HNSW_PAGE_SLOTTED          1
+#define HNSW_PAGE_COMPRESSED_LINKS 2
+#define HNSW_PAGE_META             4 /* metapage: not copied from index options, so not checked by hnsw_check_meta */
+#define HNSW_PAGE_QUANTIZATION(q)  ((q) << 3) /* format of vectors (quantization_t) */
+#define HNSW_PAGE_LINK_CODES       64 /* link lists contain codes of neighbors */
+#define HNSW_PAGE_IVF              128 /* index is partitioned into posting lists */
+#define HNSW_PAGE_POSTING          256 /* page of posting list: not checked by hnsw_check_meta */
+
+/*
+ * Metapage is the first page of the main fork. Indexes created by older versions have no metapage:
+ * their elements start at the first page.
+ */
+#define HNSW_META_MAGIC   0x484E5357 /* "HNSW" */
+#define HNSW_META_VERSION 3 /* version 1 has no quantization parameters, version 2 has no number of IVF lists */
+
+typedef struct
+{
+	uint32  magic;
+	uint32  version;
+	uint32  max_level;   /* graph has single layer, so it is always 0 now */
+	idx_t   entry_point; /* element from which search is started */
+	uint64  n_elements;  /* number of elements (including deleted) */
+	uint32  pq_subvectors; /* number of PQ subvectors or projection dimensions: it is checked because it affects format of elements */
+	float4  sq_scale;    /* int8 quantization parameters trained at index build */
+	uint32  n_lists;     /* number of IVF posting lists */
+	float4  sq_offsets[FLEXIBLE_ARRAY_MEMBER];
+} HnswMetaPageData;
+
+/* In metapage of version 2 quantization offsets immediately follow the scale */
+#define HnswMetaGetOffsets(metad) ((metad)->version < 3 ? (float4*)&(metad)->n_lists : (metad)->sq_offsets)
+
+/* Maximal number of dimensions for which quantization parameters fit in the metapage */
+#define HNSW_MAX_QUANTIZED_DIMS ((BLCKSZ - MAXALIGN(SizeOfPageHeaderData) - MAXALIGN(sizeof(HnswPageOpaque)) \
+								  - offsetof(HnswMetaPageData, sq_offsets)) / sizeof(float4))
+
+#define HnswPageGetMeta(page) ((HnswMetaPageData*)PageGetContents(page))
+
+/*
+ * Codebook of product quantizer or projection matrix is stored in pages following the metapage
+ */
+#define HNSW_CODEBOOK_PER_PAGE ((BLCKSZ - MAXALIGN(SizeOfPageHeaderData) - MAXALIGN(sizeof(HnswPageOpaque))) / sizeof(float4))
+#define HNSW_CODEBOOK_SIZE(hnsw) ((hnsw)->meta.quantization == QUANT_PQ ? (hnsw)->meta.dim * HNSW_PQ_CENTROIDS \
+	: (hnsw)->meta.quantization == QUANT_PROJECTION ? (hnsw)->meta.dim * (hnsw)->meta.projection_dim : 0)
+#define HNSW_CODEBOOK_PAGES(hnsw) ((HNSW_CODEBOOK_SIZE(hnsw) + HNSW_CODEBOOK_PER_PAGE - 1) / HNSW_CODEBOOK_PER_PAGE)
+
+/*
+ * Element pages are divided into groups. Group starts with the label page, which contains labels of all
+ * elements of the group, followed by element pages and, with split layout, vector pages of its elements.
+ * Pages are appended to the relation when the first element located in them is inserted, so the last group
+ * may be incomplete. Indexes created by older versions have no label pages: their elements start at the
+ * first page and labels are stored only in the elements.
+ *
+ * Element and vector pages of the group are placed in the order in which they are needed by insertion
+ * (element page first if both are needed by the same element). So the j-th element page is preceded by
+ * ceil(j*elems_per_page/vectors_per_page) vector pages, and the p-th vector page is preceded by
+ * floor(p*vectors_per_page/elems_per_page)+1 element pages.
+ */
+static inline BlockNumber
+HnswGroupStart(HnswIndex* hnsw, idx_t idx)
+{
+	return hnsw->elements_start + (BlockNumber)(idx / hnsw->group_elems) * hnsw->group_pages;
+}
+
+static inline BlockNumber
+HnswElementBlock(HnswIndex* hnsw, idx_t idx)
+{
+	size_t page;
+	if (hnsw->group_elems == 0)
+		return hnsw->elements_start + idx / hnsw->meta.elems_per_page;
+	page = idx % hnsw->group_elems / hnsw->meta.elems_per_page;
+	if (hnsw->vectors_per_page != 0)
+		page += (page * hnsw->meta.elems_per_page + hnsw->vectors_per_page - 1) / hnsw->vectors_per_page;
+	return HnswGroupStart(hnsw, idx) + 1 + page;
+}
+
+static inline BlockNumber
+HnswVectorBlock(HnswIndex* hnsw, idx_t idx)
+{
+	size_t page = idx % hnsw->group_elems / hnsw->vectors_per_page;
+	return HnswGroupStart(hnsw, idx) + 1 + page * hnsw->vectors_per_page / hnsw->meta.elems_per_page + 1 + page;
+}
+
+#define HnswLabelBlock(hnsw, idx) HnswGroupStart(hnsw, idx)
+#define HnswLabelPos(hnsw, idx)   ((idx) % (hnsw)->group_elems)
+
+/*
+ * End of pages containing the first n_elems elements. Index build creates the first label page
+ * and empty element page, so search in empty index doesn't need to check if they exist.
+ * Vector page is created by insertion of its first element.
+ */
+static inline BlockNumber
+HnswElementsEnd(HnswIndex* hnsw, idx_t n_elems)
+{
+	BlockNumber end;
+	if (n_elems == 0)
+		return hnsw->elements_start + 2;
+	end = HnswElementBlock(hnsw, n_elems - 1) + 1;
+	if (hnsw->vectors_per_page != 0)
+		end = Max(end, HnswVectorBlock(hnsw, n_elems - 1) + 1);
+	return end;
+}
+
+/*
+ * IVF posting lists are chains of pages. Head pages of all lists are created by index build after
+ * pages of centroid elements, so the head of list i is block HnswPostingStart(hnsw) + i.
+ */
+#define HnswPostingStart(hnsw) HnswElementsEnd(hnsw, (idx_t)(hnsw)->n_lists)
+
+typedef struct
+{
+	HnswPageOpaque base;
+	BlockNumber    next;  /* next page of the list */
+	BlockNumber    tail;  /* last page of the list: maintained only in the head page */
+} HnswPostingOpaque;
+
+/*
+ * Compressed link list: uint16 number of links followed by sorted identifiers encoded as varint deltas.
+ * Space reserved for it in the element allows 2.5 bytes per link, while delta takes up to 5 bytes.
+ * Deltas between sorted identifiers of maxM neighbors are about n_elements/maxM on average, so in large
+ * indexes not all maxM links fit: insertion then drops the farthest neighbors (see hnsw_links_fit),
+ * link lists are never truncated when they are stored.
+ */
+#define HNSW_COMPRESSED_LINKS_SIZE(maxM) TYPEALIGN(sizeof(idx_t), sizeof(uint16) + (maxM) * 5 / 2)
+
+/* Maximal number of links: link list of element should fit in the page */
+#define HNSW_MAX_LINKS (BLCKSZ / sizeof(idx_t))
+
+/*
+ * Size of opaque data before layout field was added: it is used in calculation of elements_per_page
+ * of indexes created by older versions, so that their element identifiers are preserved.
+ * Page opaque data is MAXALIGNed, so layout field is zero in existed pages.
+ */
+#define HNSW_INLINE_OPAQUE_SIZE offsetof(HnswPageOpaque, layout)
+
+/*
+ * WAL records.
+ *
+ * All changes of index pages done by insertion of one element are logged by single XLOG_HNSW_INSERT record
+ * (unless number of affected pages exceeds XLR_MAX_BLOCK_ID). Data of each registered block is sequence
+ * of logical operations, each starting with HnswXLogOp header followed by "len" bytes of operation data.
+ * The same operations are used to perform changes at primary, so they are applied to the page in the same way.
+ */
+#define XLOG_HNSW_INSERT 0x00
+
+/*
+ * Custom resource manager identifier. It is stored in WAL, so it must never be changed and must not be used
+ * by other extensions: RM_EXPERIMENTAL_ID is shared by all extensions under development.
+ * Identifiers of extensions are listed at https://wiki.postgresql.org/wiki/CustomWALResourceManagers
+ */
+#define HNSW_RMGR_ID     142
+
+typedef enum
+{
+	HNSW_OP_INIT_PAGE,      /* initialize element page, data: HnswPageOpaque */
+	HNSW_OP_APPEND_ELEMENT, /* add new element, offset: its offset number, data: element */
+	HNSW_OP_SET_LINKS,      /* replace link list, offset: its position in the page, data: link list */
+	HNSW_OP_SET_LABEL,      /* set label in label page, offset: its position in the page, data: label */
+	HNSW_OP_SET_VECTOR,     /* set vector in vector page, offset: its position in the page, data: vector */
+	HNSW_OP_INIT_ARRAY_PAGE, /* initialize label or vector page, offset: end of items array */
+	HNSW_OP_APPEND_SLOT,    /* add new element to slotted page, offset: position of its slot, data: slot */
+	HNSW_OP_SET_META        /* update metapage, offset: position of metadata, data: HnswMetaPageData */
+} HnswXLogOpKind;
+
+typedef struct
+{
+	uint8  kind;
+	uint16 offset;
+	uint16 len;
+} HnswXLogOp;
+
+/* Main data of XLOG_HNSW_INSERT record */
+typedef struct
+{
+	idx_t  idx; /* identifier of inserted element */
+} xl_hnsw_insert;
+
+/*
+ * Shared cache
+ */
+typedef enum
+{
+	HNSW_CACHE_LINKS,
+	HNSW_CACHE_VECTOR
+} HnswCacheKind;
+
+extern void   hnsw_cache_init(void);
+extern bool   hnsw_cache_enabled(void);
+extern uint64 hnsw_cache_version(HnswIndex* hnsw);
+extern void   hnsw_cache_invalidate(HnswIndex* hnsw);
+extern bool   hnsw_cache_lookup(HnswIndex* hnsw, idx_t idx, HnswCacheKind kind, void* dst, size_t size);
+extern void   hnsw_cache_store(HnswIndex* hnsw, idx_t idx, HnswCacheKind kind, uint64 version, void const* src, size_t size);
+
+extern void   hnsw_prewarm_init(void);
+extern void   hnsw_prewarm_register(Relation index, uint32* generation);
+
+extern void   hnsw_ivf_init_lists(HnswIndex* hnsw);
+extern void   hnsw_ivf_append(HnswIndex* hnsw, idx_t list, void const* code, label_t label);
+extern bool   hnsw_ivf_scan(HnswIndex* hnsw, coord_t const* point, label_t const* lists, size_t n_lists, size_t k,
+							size_t* n_results, label_t** results, dist_t** dists);
+extern void   hnsw_ivf_bulkdelete(HnswIndex* hnsw, IndexVacuumInfo* info, IndexBulkDeleteResult* stats,
+								  IndexBulkDeleteCallback callback, void* callback_state);
+
+extern void hnsw_init_page_opaque(HnswIndex* hnsw, HnswPageOpaque* opq);
+extern dist_func_t hnsw_resolve_dist_func(Relation index);
+extern void hnsw_log_fork(Relation index, ForkNumber forknum);
+
+extern void   flat_init(void);
+extern bool   flat_is_index(Relation index);
+extern size_t hnsw_get_scan_limit(Relation index);
+
+extern bool hnsw_rmgr_registered;
+
+extern void hnsw_register_rmgr(void);
+extern void hnsw_xlog_add_op(StringInfo ops, HnswXLogOpKind kind, uint16 offset, void const* data, uint16 len);
+extern void hnsw_xlog_apply_ops(Page page, char const* ops, Size len);
+extern void hnsw_init_array_page(Page page, Size end);
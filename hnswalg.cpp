@@ -27,30 +27,57 @@
 #include <map>
 #include <cmath>
 #include <queue>
+#include <algorithm>
 #include <stdexcept>
 
 extern "C" {
 #include "embedding.h"
 }
 
+// Number of next candidates which link list pages are prefetched
+#define HNSW_LOOKAHEAD 4
+
+// Number of elements which distances are calculated by one hnsw_dist_batch call during exact search
+#define HNSW_EXACT_BATCH 1024
+
+// Priority queue providing access to its heap. Only the first element of the heap is guaranteed to be
+// the best candidate: the following ones are just near the top of the heap (children of the root and
+// their children), which is good enough to select candidates for lookahead prefetch.
+template<typename T>
+class CandidateQueue : public std::priority_queue<T>
+{
+  public:
+	T const& peek(size_t i) const { return this->c[i]; }
+};
+
 inline dist_t
 calc_dist_func(HnswMetadata* meta, coord_t const* ax, coord_t const* bx)
 {
-	return hnsw_dist_func(meta->dist_func, ax, bx, meta->dim);
+	return hnsw_vector_dist(meta, ax, bx);
 }
 
 static std::priority_queue<std::pair<dist_t, idx_t>>
-searchBaseLayer(HnswMetadata* meta, const coord_t *point, size_t ef)
+searchBaseLayer(HnswMetadata* meta, const coord_t *point, size_t ef, bool bounded)
 {
+	size_t n_dist_calcs = 1;
+	size_t n_expansions = 0;
+	size_t n_stale = 0; // number of consecutive expansions which have not changed top results
 	std::vector<uint32_t> visited;
+	std::vector<uint32_t> prefetched;
 	const size_t init_visited_size = 64*1024;
 	coord_t* p_coords;
 	idx_t* p_indexes;
+	std::vector<idx_t> neighbors;
+	std::vector<idx_t> unvisited;
+	std::vector<dist_t> dists;
+	std::vector<HnswLinkCode> codes;
+	bool useCodes = bounded && meta->link_codes;
 
 	visited.resize(init_visited_size);
+	prefetched.resize(init_visited_size);
 
     std::priority_queue<std::pair<dist_t, idx_t >> topResults;
-    std::priority_queue<std::pair<dist_t, idx_t >> candidateSet;
+    CandidateQueue<std::pair<dist_t, idx_t >> candidateSet;
 
 	idx_t enterpoint_node = meta->enterpoint_node;
 	if (!hnsw_begin_read(meta, enterpoint_node, NULL, &p_coords, NULL))
@@ -70,46 +97,90 @@ searchBaseLayer(HnswMetadata* meta, const coord_t *point, size_t ef)
         if (-curr_el_pair.first > lowerBound)
             break;
 
+		// Search budget is exhausted: return best results found so far
+		if (bounded && ((meta->max_dist_calcs != 0 && n_dist_calcs >= meta->max_dist_calcs)
+						|| hnsw_search_expired(meta))) {
+			hnsw_search_stats.budget_stops += 1;
+			break;
+		}
+		// Top results are not improved during last expansions: most likely they are already final
+		if (bounded && meta->patience != 0 && n_stale >= meta->patience) {
+			hnsw_search_stats.patience_stops += 1;
+			break;
+		}
+
         candidateSet.pop();
         idx_t curNodeNum = curr_el_pair.second;
 
-		hnsw_begin_read(meta, curNodeNum, &p_indexes, NULL, NULL);
-        size_t size = p_indexes[0];
+		// Issue I/O for link lists of the next candidates, so that it is performed while
+		// distances to neighbors of the current node are calculated
+		for (size_t i = 0; i < HNSW_LOOKAHEAD && i < candidateSet.size(); i++) {
+			idx_t next = candidateSet.peek(i).second;
+			if (prefetched.size() <= (next >> 5))
+				prefetched.resize((next >> 5) + 1);
+			if (!(prefetched[next >> 5] & (1 << (next & 31)))) {
+				prefetched[next >> 5] |= 1 << (next & 31);
+				hnsw_prefetch_links(meta, next);
+			}
+		}
 
-        for (size_t j = 0; j < size; ++j) {
-            size_t tnum = p_indexes[1 + j];
+		// Copy link list and release the page before reading neighbors: searching backend holds
+		// at most one buffer lock, so it can not deadlock with inserter updating several pages
+		if (!hnsw_begin_read(meta, curNodeNum, &p_indexes, NULL, NULL))
+			continue;
+		neighbors.assign(p_indexes + 1, p_indexes + 1 + p_indexes[0]);
+		if (useCodes) {
+			codes.resize(neighbors.size());
+			memcpy(codes.data(), HNSW_LINK_CODES(meta, p_indexes), neighbors.size() * sizeof(HnswLinkCode));
+		}
+		hnsw_end_read(meta);
 
+        unvisited.clear();
+        for (size_t i = 0; i < neighbors.size(); i++) {
+			idx_t tnum = neighbors[i];
 			if (visited.size() <= (tnum >> 5))
 				visited.resize((tnum >> 5) + 1);
 
             if (!(visited[tnum >> 5] & (1 << (tnum & 31)))) {
+				// Neighbor which can not get into full results is skipped without reading its page.
+				// Bound is estimated (see hnsw_link_code_bound), so skipped neighbor is not marked as visited:
+				// it is checked again when it is reached from other elements.
+				if (useCodes && topResults.size() >= ef && hnsw_link_code_bound(meta, &codes[i]) > lowerBound)
+					continue;
+				visited[tnum >> 5] |= 1 << (tnum & 31);
+				unvisited.push_back(tnum);
 				hnsw_prefetch(meta, tnum);
 			}
 		}
-        for (size_t j = 0; j < size; ++j) {
-            size_t tnum = p_indexes[1 + j];
+        // Distances are calculated in batch, locking each page only once
+        dists.resize(unvisited.size());
+        hnsw_dist_batch(meta, point, unvisited.data(), unvisited.size(), dists.data());
+        n_dist_calcs += unvisited.size();
+        n_expansions += 1;
+        n_stale += 1;
 
-            if (!(visited[tnum >> 5] & (1 << (tnum & 31)))) {
-				visited[tnum >> 5] |= 1 << (tnum & 31);
-
-				hnsw_begin_read(meta, tnum, NULL, &p_coords, NULL);
-                dist = calc_dist_func(meta, point, p_coords);
-				hnsw_end_read(meta);
+        for (size_t j = 0; j < unvisited.size(); j++) {
+            idx_t tnum = unvisited[j];
+            dist = dists[j];
 
-                if (topResults.top().first > dist || topResults.size() < ef) {
-                    candidateSet.emplace(-dist, tnum);
+            if (topResults.top().first > dist || topResults.size() < ef) {
+                candidateSet.emplace(-dist, tnum);
 
-                    topResults.emplace(dist, tnum);
+                topResults.emplace(dist, tnum);
 
-                    if (topResults.size() > ef)
-                        topResults.pop();
+                if (topResults.size() > ef)
+                    topResults.pop();
 
-                    lowerBound = topResults.top().first;
-                }
+                lowerBound = topResults.top().first;
+                n_stale = 0;
             }
         }
-		hnsw_end_read(meta);
     }
+	if (bounded) {
+		hnsw_search_stats.searches += 1;
+		hnsw_search_stats.expansions += n_expansions;
+		hnsw_search_stats.distance_computations += n_dist_calcs;
+	}
     return topResults;
 }
 
@@ -141,7 +212,7 @@ void getNeighborsByHeuristic(HnswMetadata* meta, std::priority_queue<std::pair<d
             dist_t curdist = calc_dist_func(meta, p_coords2, p_coords);
 			hnsw_end_read(meta);
 			hnsw_end_read(meta);
-            if (curdist < dist_to_query) {
+            if (meta->alpha * curdist < dist_to_query) {
                 good = false;
                 break;
             }
@@ -152,6 +223,14 @@ void getNeighborsByHeuristic(HnswMetadata* meta, std::priority_queue<std::pair<d
         topResults.emplace(-elem.first, elem.second);
 }
 
+// Drop the farthest links until compressed link list fits in the element
+static void
+fitLinks(HnswMetadata* meta, std::vector<idx_t>& links)
+{
+    while (!links.empty() && !hnsw_links_fit(meta, links.data(), links.size()))
+        links.pop_back();
+}
+
 void mutuallyConnectNewElement(HnswMetadata* meta, const coord_t *point, idx_t cur_c,
                                std::priority_queue<std::pair<dist_t, idx_t>> topResults)
 {
@@ -160,65 +239,60 @@ void mutuallyConnectNewElement(HnswMetadata* meta, const coord_t *point, idx_t c
 	idx_t   *p_indexes;
 	coord_t *p_coord, *p_coord2;
     std::vector<idx_t> res;
+    std::vector<idx_t> links;
     res.reserve(meta->M);
     while (topResults.size() > 0) {
         res.push_back(topResults.top().second);
         topResults.pop();
     }
-    {
-		hnsw_begin_write(meta, cur_c, &p_indexes, NULL, NULL);
-        if (*p_indexes)
-            throw std::runtime_error("Should be blank");
-
-        *p_indexes++ = res.size();
+    // Link lists are not modified in place: new lists are collected and written
+    // to the pages together with the new element at the end of insertion.
+    // Links are ordered by preference (closest first): compressed link list
+    // may not fit all of them, then the farthest ones are dropped.
+    std::reverse(res.begin(), res.end());
+    fitLinks(meta, res);
+	hnsw_set_links(meta, cur_c, res.data(), res.size());
 
-        for (size_t idx = 0; idx < res.size(); idx++) {
-            if (p_indexes[idx])
-                throw std::runtime_error("Should be blank");
-            p_indexes[idx] = res[idx];
-        }
-		hnsw_end_write(meta);
-    }
     for (size_t idx = 0; idx < res.size(); idx++) {
         if (res[idx] == cur_c)
             throw std::runtime_error("Connection to the same element");
 
         size_t resMmax = meta->maxM;
-		hnsw_begin_write(meta, res[idx], &p_indexes, &p_coord, NULL);
+		if (!hnsw_begin_read(meta, res[idx], &p_indexes, &p_coord, NULL))
+            throw std::runtime_error("Neighbor not found");
         idx_t sz_link_list_other = *p_indexes;
 
         if (sz_link_list_other > resMmax || sz_link_list_other < 0)
             throw std::runtime_error("Bad sz_link_list_other");
 
-        if (sz_link_list_other < resMmax) {
-            p_indexes[1 + sz_link_list_other] = cur_c;
-            *p_indexes = sz_link_list_other + 1;
-        } else {
+        links.assign(p_indexes + 1, p_indexes + 1 + sz_link_list_other);
+        links.push_back(cur_c);
+        if (sz_link_list_other >= resMmax || !hnsw_links_fit(meta, links.data(), links.size())) {
+            links.pop_back();
             // finding the "weakest" element to replace it with the new one
-			hnsw_begin_read(meta, cur_c, NULL, &p_coord2, NULL);
-            dist_t d_max = calc_dist_func(meta, p_coord2, p_coord);
-			hnsw_end_read(meta);
+            dist_t d_max = calc_dist_func(meta, point, p_coord);
             // Heuristic:
             std::priority_queue<std::pair<dist_t, idx_t>> candidates;
             candidates.emplace(d_max, cur_c);
 
             for (size_t j = 0; j < sz_link_list_other; j++)
 			{
-				hnsw_begin_read(meta, p_indexes[1 + j], NULL, &p_coord2, NULL);
-				candidates.emplace(calc_dist_func(meta, p_coord2, p_coord), p_indexes[1 + j]);
+				hnsw_begin_read(meta, links[j], NULL, &p_coord2, NULL);
+				candidates.emplace(calc_dist_func(meta, p_coord2, p_coord), links[j]);
 				hnsw_end_read(meta);
 			}
             getNeighborsByHeuristic(meta, candidates, resMmax);
 
-            size_t indx = 0;
+            links.clear();
             while (!candidates.empty()) {
-                p_indexes[1 + indx] = candidates.top().second;
+                links.push_back(candidates.top().second);
                 candidates.pop();
-                indx++;
             }
-            *p_indexes = indx;
+            std::reverse(links.begin(), links.end());
+            fitLinks(meta, links);
         }
-		hnsw_end_write(meta);
+		hnsw_end_read(meta);
+		hnsw_set_links(meta, res[idx], links.data(), links.size());
     }
 }
 
@@ -226,48 +300,171 @@ void bindPoint(HnswMetadata* meta, coord_t const* point, idx_t cur_c)
 {
     // Do nothing for the first element
     if (cur_c != 0) {
-        std::priority_queue <std::pair<dist_t, idx_t>> topResults = searchBaseLayer(meta, point, meta->efConstruction);
+        std::priority_queue <std::pair<dist_t, idx_t>> topResults = searchBaseLayer(meta, point, meta->efConstruction, false);
         mutuallyConnectNewElement(meta, point, cur_c, topResults);
     }
 }
 
-std::priority_queue<std::pair<dist_t, label_t>> searchKnn(HnswMetadata* meta, const coord_t *query, size_t k)
+// Replace identifiers of found elements with labels, excluding deleted elements.
+// If lower bounds of distances are requested, results are ordered by them.
+static std::priority_queue<std::pair<dist_t, label_t>>
+labelResults(HnswMetadata* meta, std::priority_queue<std::pair<dist_t, idx_t>>& topCandidates)
 {
 	std::priority_queue<std::pair<dist_t, label_t>> topResults;
-	auto topCandidates = searchBaseLayer(meta, query, k);
-    while (topCandidates.size() > k) {
-        topCandidates.pop();
-	}
 	while (!topCandidates.empty()) {
 		std::pair<dist_t, idx_t> rez = topCandidates.top();
+		dist_t dist = rez.first;
 		label_t label;
-		hnsw_begin_read(meta, rez.second, NULL, NULL, &label);
+		if (meta->pq_bounds) {
+			coord_t* p_coords;
+			if (!hnsw_begin_read(meta, rez.second, NULL, &p_coords, NULL)) {
+				topCandidates.pop();
+				continue;
+			}
+			dist = hnsw_distance_lower_bound(meta, dist, p_coords);
+			hnsw_end_read(meta);
+		}
+		// Deleted flag is set in label pages, so label is not taken from the element
+		hnsw_get_label(meta, rez.second, &label);
 		if (!hnsw_is_deleted(label))
-			topResults.push(std::pair<dist_t, label_t>(rez.first, label));
+			topResults.push(std::pair<dist_t, label_t>(dist, label));
 		topCandidates.pop();
-		hnsw_end_read(meta);
 	}
+	return topResults;
+}
 
-    return topResults;
+// Candidates found using Hamming distance of binary codes, projected vectors or prefixes are rescored
+// using full precision vectors read from vector pages, and k nearest of them are kept
+static void
+rerankCandidates(HnswMetadata* meta, const coord_t *query, std::priority_queue<std::pair<dist_t, idx_t>>& topCandidates, size_t k)
+{
+	std::priority_queue<std::pair<dist_t, idx_t>> reranked;
+	std::vector<coord_t> vector(meta->dim);
+
+	hnsw_search_stats.distance_computations += topCandidates.size();
+	while (!topCandidates.empty()) {
+		idx_t idx = topCandidates.top().second;
+		topCandidates.pop();
+		if (!hnsw_read_full_vector(meta, idx, vector.data()))
+			continue;
+		reranked.emplace(hnsw_dist_func(meta->dist_func, HNSW_FULL_VECTOR(meta, query), vector.data(), meta->dim), idx);
+		if (reranked.size() > k)
+			reranked.pop();
+	}
+	topCandidates.swap(reranked);
 }
 
+// Number of candidates collected by search for k results
+static size_t
+candidatesCount(HnswMetadata* meta, size_t k)
+{
+	return HNSW_RESCORED(meta) && meta->rerank_factor != 0 ? k * meta->rerank_factor : k;
+}
+
+std::priority_queue<std::pair<dist_t, label_t>> searchKnn(HnswMetadata* meta, const coord_t *query, size_t k)
+{
+	auto topCandidates = searchBaseLayer(meta, query, candidatesCount(meta, k), true);
+	if (candidatesCount(meta, k) != k)
+		rerankCandidates(meta, query, topCandidates, k);
+    while (topCandidates.size() > k) {
+        topCandidates.pop();
+	}
+    return labelResults(meta, topCandidates);
+}
 
 
-bool hnsw_search(HnswMetadata* meta, const coord_t *point, size_t* n_results, label_t** results)
+
+// Copy results to malloced arrays in order of increasing distance
+static bool
+returnResults(std::priority_queue<std::pair<dist_t, label_t>>& result, size_t* n_results, label_t** results, dist_t** dists)
+{
+	size_t nResults = result.size();
+	*results = (label_t*)malloc(nResults*sizeof(label_t));
+	*dists = (dist_t*)malloc(nResults*sizeof(dist_t));
+	if (*results == NULL || *dists == NULL)
+	{
+		free(*results);
+		free(*dists);
+		return false;
+	}
+	for (size_t i = nResults; i-- != 0;)
+	{
+		(*results)[i] = result.top().second;
+		(*dists)[i] = result.top().first;
+		result.pop();
+	}
+	*n_results = nResults;
+	return true;
+}
+
+bool hnsw_search(HnswMetadata* meta, const coord_t *point, size_t* n_results, label_t** results, dist_t** dists)
 {
 	try
 	{
 		auto result = searchKnn(meta, point, meta->efSearch);
-		size_t nResults = result.size();
-		*results = (label_t*)malloc(nResults*sizeof(label_t));
-		if (*results == NULL)
-			return false;
-		for (size_t i = nResults; i-- != 0;)
-		{
-			(*results)[i] = result.top().second;
-			result.pop();
+		return returnResults(result, n_results, results, dists);
+	}
+	catch (std::exception& x)
+	{
+		return false;
+	}
+}
+
+// Linear scan of all elements keeping efSearch nearest alive ones. Elements are read in order of
+// their identifiers, so pages are accessed sequentially and each page is locked once per batch.
+bool hnsw_exact_search(HnswMetadata* meta, const coord_t *point, idx_t n_elems, size_t* n_results, label_t** results, dist_t** dists)
+{
+	try
+	{
+		size_t k = candidatesCount(meta, meta->efSearch);
+		std::priority_queue<std::pair<dist_t, idx_t>> topCandidates;
+		std::vector<idx_t> ids(HNSW_EXACT_BATCH);
+		std::vector<dist_t> batchDists(HNSW_EXACT_BATCH);
+
+		for (idx_t start = 0; start < n_elems; start += HNSW_EXACT_BATCH) {
+			size_t n = std::min((size_t)(n_elems - start), (size_t)HNSW_EXACT_BATCH);
+			for (size_t i = 0; i < n; i++)
+				ids[i] = start + (idx_t)i;
+			hnsw_dist_batch(meta, point, ids.data(), n, batchDists.data());
+
+			for (size_t i = 0; i < n; i++) {
+				// Label is read only for elements which get into top results
+				if (topCandidates.size() < k || batchDists[i] < topCandidates.top().first) {
+					label_t label;
+					hnsw_get_label(meta, ids[i], &label);
+					if (hnsw_is_deleted(label))
+						continue;
+					topCandidates.emplace(batchDists[i], ids[i]);
+					if (topCandidates.size() > k)
+						topCandidates.pop();
+				}
+			}
 		}
-		*n_results = nResults;
+		hnsw_search_stats.searches += 1;
+		hnsw_search_stats.distance_computations += n_elems;
+
+		if (k != meta->efSearch)
+			rerankCandidates(meta, point, topCandidates, meta->efSearch);
+		auto topResults = labelResults(meta, topCandidates);
+		return returnResults(topResults, n_results, results, dists);
+	}
+	catch (std::exception& x)
+	{
+		return false;
+	}
+}
+
+// Find element nearest to the point, including deleted ones
+bool hnsw_find_nearest(HnswMetadata* meta, const coord_t *point, idx_t* idx)
+{
+	try
+	{
+		auto topCandidates = searchBaseLayer(meta, point, meta->efConstruction, false);
+		if (topCandidates.empty())
+			return false;
+		while (topCandidates.size() > 1)
+			topCandidates.pop();
+		*idx = topCandidates.top().second;
 		return true;
 	}
 	catch (std::exception& x)
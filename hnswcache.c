@@ -0,0 +1,275 @@
+// Copyright 2023 Neon Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*
+ * Shared cache of link lists and vectors of HNSW elements.
+ *
+ * Cache is direct-mapped array of buckets in shared memory. Bucket is large enough to hold vector
+ * or link list of any element, and entries are packed in it using their actual size, so a bucket holds
+ * many small entries. When there is no more space in the bucket, all its entries are evicted.
+ * Each bucket is protected by sequence counter (seqlock): writer makes it odd while updating the bucket
+ * and readers copy data and check that counter was not changed. So readers never block and never take
+ * buffer locks for cached elements.
+ *
+ * Vectors of elements are never changed, but link lists are updated by insertions.
+ * Each index is assigned change counter, which is incremented after each insertion.
+ * Cached link list is valid only if it was loaded with current value of change counter.
+ * Insertions replayed by standby don't increment the counter (generic WAL records can not be intercepted),
+ * so link lists are not cached during recovery.
+ */
+#include "postgres.h"
+
+#include "access/xlog.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "storage/ipc.h"
+#include "storage/shmem.h"
+#include "utils/guc.h"
+
+#include "hnsw.h"
+
+#define HNSW_CACHE_BUCKET_SIZE  BLCKSZ
+#define HNSW_CACHE_N_COUNTERS   1024
+
+typedef struct
+{
+	Oid         dbid;
+	Oid         relnode;
+	idx_t       idx;
+	uint16      kind;
+	uint16      len;
+	uint64      version;   /* value of change counter when link list was loaded */
+} HnswCacheEntry;
+
+#define HNSW_CACHE_ENTRY_SIZE(len) MAXALIGN(MAXALIGN(sizeof(HnswCacheEntry)) + (len))
+
+typedef struct
+{
+	pg_atomic_uint32 seq;  /* odd while bucket is updated */
+	uint32      used;      /* size of entries stored in the bucket */
+	char        data[HNSW_CACHE_BUCKET_SIZE];
+} HnswCacheBucket;
+
+typedef struct
+{
+	pg_atomic_uint64 counters[HNSW_CACHE_N_COUNTERS];
+	HnswCacheBucket  buckets[FLEXIBLE_ARRAY_MEMBER];
+} HnswCache;
+
+static int hnsw_shared_cache_size;
+static HnswCache* hnsw_cache;
+static size_t hnsw_cache_n_buckets;
+
+static shmem_startup_hook_type prev_shmem_startup_hook;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook;
+#endif
+
+static Size
+hnsw_cache_shmem_size(void)
+{
+	return offsetof(HnswCache, buckets) + (Size)hnsw_shared_cache_size * 1024 / sizeof(HnswCacheBucket) * sizeof(HnswCacheBucket);
+}
+
+#if PG_VERSION_NUM >= 150000
+static void
+hnsw_cache_shmem_request(void)
+{
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+	RequestAddinShmemSpace(hnsw_cache_shmem_size());
+}
+#endif
+
+static void
+hnsw_cache_shmem_startup(void)
+{
+	bool found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	hnsw_cache = (HnswCache*)ShmemInitStruct("embedding shared cache", hnsw_cache_shmem_size(), &found);
+	hnsw_cache_n_buckets = (Size)hnsw_shared_cache_size * 1024 / sizeof(HnswCacheBucket);
+	if (!found)
+	{
+		for (size_t i = 0; i < HNSW_CACHE_N_COUNTERS; i++)
+			pg_atomic_init_u64(&hnsw_cache->counters[i], 0);
+		for (size_t i = 0; i < hnsw_cache_n_buckets; i++)
+		{
+			pg_atomic_init_u32(&hnsw_cache->buckets[i].seq, 0);
+			hnsw_cache->buckets[i].used = 0;
+		}
+	}
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Define cache size GUC and request shared memory. Cache can be used only if extension is preloaded.
+ */
+void hnsw_cache_init(void)
+{
+	DefineCustomIntVariable("embedding.shared_cache_size",
+							"Size of shared cache of HNSW link lists and vectors.",
+							"Cache is used only if extension is loaded by shared_preload_libraries.",
+							&hnsw_shared_cache_size,
+							0, 0, INT_MAX,
+							PGC_POSTMASTER,
+							GUC_UNIT_KB,
+							NULL, NULL, NULL);
+
+	if (!process_shared_preload_libraries_in_progress || (Size)hnsw_shared_cache_size * 1024 < sizeof(HnswCacheBucket))
+		return;
+
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = hnsw_cache_shmem_request;
+#else
+	RequestAddinShmemSpace(hnsw_cache_shmem_size());
+#endif
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = hnsw_cache_shmem_startup;
+}
+
+bool hnsw_cache_enabled(void)
+{
+	return hnsw_cache != NULL && hnsw_cache_n_buckets != 0;
+}
+
+static Oid
+hnsw_cache_relnode(HnswIndex* hnsw)
+{
+	/* Relation file number is changed by TRUNCATE and REINDEX, so stale elements are never matched */
+#if PG_VERSION_NUM >= 160000
+	return hnsw->rel->rd_locator.relNumber;
+#else
+	return hnsw->rel->rd_node.relNode;
+#endif
+}
+
+static pg_atomic_uint64*
+hnsw_cache_counter(HnswIndex* hnsw)
+{
+	return &hnsw_cache->counters[hnsw_cache_relnode(hnsw) % HNSW_CACHE_N_COUNTERS];
+}
+
+static HnswCacheBucket*
+hnsw_cache_bucket(HnswIndex* hnsw, idx_t idx, HnswCacheKind kind)
+{
+	uint64 h = ((uint64)hnsw_cache_relnode(hnsw) * 0x9E3779B97F4A7C15) ^ ((uint64)idx * 2 + kind) * 0xC2B2AE3D27D4EB4F;
+	return &hnsw_cache->buckets[(h >> 17) % hnsw_cache_n_buckets];
+}
+
+/*
+ * Value of change counter should be obtained before reading the page which content is stored in the cache
+ */
+uint64 hnsw_cache_version(HnswIndex* hnsw)
+{
+	return pg_atomic_read_u64(hnsw_cache_counter(hnsw));
+}
+
+/*
+ * Invalidate cached link lists of the index: it should be done after page modification
+ */
+void hnsw_cache_invalidate(HnswIndex* hnsw)
+{
+	if (hnsw_cache_enabled())
+		pg_atomic_fetch_add_u64(hnsw_cache_counter(hnsw), 1);
+}
+
+/*
+ * Copy cached data to dst. Returns false if element is not cached.
+ * Bucket may be concurrently updated, so sizes of entries are checked before they are used:
+ * data copied from inconsistent bucket is discarded by checking the sequence counter.
+ */
+bool hnsw_cache_lookup(HnswIndex* hnsw, idx_t idx, HnswCacheKind kind, void* dst, size_t size)
+{
+	HnswCacheBucket* bucket;
+	uint32 seq;
+	uint32 used;
+	uint64 version;
+	HnswCacheEntry* found = NULL;
+
+	if (kind == HNSW_CACHE_LINKS && RecoveryInProgress())
+		return false;
+
+	bucket = hnsw_cache_bucket(hnsw, idx, kind);
+	seq = pg_atomic_read_u32(&bucket->seq);
+	if (seq & 1)
+		return false;
+
+	version = kind == HNSW_CACHE_LINKS ? hnsw_cache_version(hnsw) : 0;
+	pg_read_barrier();
+	used = Min(bucket->used, HNSW_CACHE_BUCKET_SIZE);
+	for (uint32 offs = 0; offs + MAXALIGN(sizeof(HnswCacheEntry)) <= used;)
+	{
+		HnswCacheEntry* entry = (HnswCacheEntry*)(bucket->data + offs);
+		uint32 entry_size = HNSW_CACHE_ENTRY_SIZE(entry->len);
+
+		if (offs + entry_size > used)
+			break;
+		/* The last stored entry is the most recent one */
+		if (entry->dbid == MyDatabaseId
+			&& entry->relnode == hnsw_cache_relnode(hnsw)
+			&& entry->idx == idx
+			&& entry->kind == kind)
+		{
+			found = entry;
+		}
+		offs += entry_size;
+	}
+	if (found != NULL && found->version == version && found->len <= size)
+		memcpy(dst, (char*)found + MAXALIGN(sizeof(HnswCacheEntry)), found->len);
+	else
+		found = NULL;
+	pg_read_barrier();
+
+	return found != NULL && pg_atomic_read_u32(&bucket->seq) == seq;
+}
+
+/*
+ * Store data in the cache. Version should be obtained by hnsw_cache_version before reading data from the page.
+ * If bucket is concurrently updated by some other backend, then data is just not cached.
+ */
+void hnsw_cache_store(HnswIndex* hnsw, idx_t idx, HnswCacheKind kind, uint64 version, void const* src, size_t size)
+{
+	HnswCacheBucket* bucket;
+	HnswCacheEntry* entry;
+	uint32 seq;
+
+	if (HNSW_CACHE_ENTRY_SIZE(size) > HNSW_CACHE_BUCKET_SIZE || (kind == HNSW_CACHE_LINKS && RecoveryInProgress()))
+		return;
+
+	bucket = hnsw_cache_bucket(hnsw, idx, kind);
+	seq = pg_atomic_read_u32(&bucket->seq);
+	if ((seq & 1) || !pg_atomic_compare_exchange_u32(&bucket->seq, &seq, seq + 1))
+		return;
+
+	/* Evict all entries of the bucket if there is no space for the new one */
+	if (bucket->used + HNSW_CACHE_ENTRY_SIZE(size) > HNSW_CACHE_BUCKET_SIZE)
+		bucket->used = 0;
+	entry = (HnswCacheEntry*)(bucket->data + bucket->used);
+	entry->dbid = MyDatabaseId;
+	entry->relnode = hnsw_cache_relnode(hnsw);
+	entry->idx = idx;
+	entry->kind = kind;
+	entry->len = (uint16)size;
+	entry->version = kind == HNSW_CACHE_LINKS ? version : 0;
+	memcpy((char*)entry + MAXALIGN(sizeof(HnswCacheEntry)), src, size);
+	bucket->used += HNSW_CACHE_ENTRY_SIZE(size);
+
+	pg_write_barrier();
+	pg_atomic_write_u32(&bucket->seq, seq + 2);
+}
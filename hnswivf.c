@@ -0,0 +1,344 @@
+// Copyright 2023 Neon Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*
+ * Posting lists of IVF mode.
+ *
+ * In IVF mode elements of the graph are centroids of clusters of indexed vectors, and label of element
+ * is the number of its cluster. Vectors themselves are stored in posting lists: chains of pages containing
+ * entries (label of heap tuple followed by vector in index format). Search locates the nearest centroids
+ * using the graph and scans their lists, so it reads pages of few lists instead of random graph hops
+ * over the whole data set.
+ *
+ * Entries are appended to the last page of the list, referenced by the head page. Appends to the list are
+ * serialized by exclusive lock on its head page, so appends to different lists are performed concurrently.
+ * Pages are locked in order head, tail, new page and readers lock only one page at a time. Like elements
+ * of the graph, entries are never removed: vacuum just marks them as deleted.
+ */
+#include "postgres.h"
+
+#include "access/generic_xlog.h"
+#include "miscadmin.h"
+#include "storage/lmgr.h"
+
+#include "hnsw.h"
+
+typedef struct
+{
+	HnswLabel label;
+	char      data[FLEXIBLE_ARRAY_MEMBER]; /* vector in index format */
+} HnswPostingEntry;
+
+#define HnswPostingPageGetOpaque(page) ((HnswPostingOpaque*)PageGetSpecialPointer(page))
+#define HNSW_POSTING_ENTRY_SIZE(hnsw) (offsetof(HnswPostingEntry, data) + (hnsw)->meta.data_size)
+
+static void hnsw_ivf_init_page(HnswIndex* hnsw, Page page)
+{
+	HnswPostingOpaque* opq;
+
+	PageInit(page, BLCKSZ, sizeof(HnswPostingOpaque));
+	opq = HnswPostingPageGetOpaque(page);
+	hnsw_init_page_opaque(hnsw, &opq->base);
+	opq->base.flags |= HNSW_PAGE_POSTING;
+	opq->next = InvalidBlockNumber;
+	opq->tail = InvalidBlockNumber;
+}
+
+/*
+ * Create empty head pages of all posting lists. It is done by index build after centroids are inserted.
+ */
+void hnsw_ivf_init_lists(HnswIndex* hnsw)
+{
+	for (size_t i = 0; i < hnsw->n_lists; i++)
+	{
+		Buffer buf = ReadBuffer(hnsw->rel, P_NEW);
+		Page page;
+
+		Assert(BufferGetBlockNumber(buf) == HnswPostingStart(hnsw) + i);
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+		page = BufferGetPage(buf);
+		hnsw_ivf_init_page(hnsw, page);
+		HnswPostingPageGetOpaque(page)->tail = BufferGetBlockNumber(buf);
+		MarkBufferDirty(buf);
+		UnlockReleaseBuffer(buf);
+	}
+}
+
+static void hnsw_ivf_check_lists(HnswIndex* hnsw)
+{
+	/* After crash unlogged index is reset to the init fork, which has no centroids */
+	if (RelationGetNumberOfBlocks(hnsw->rel) < HnswPostingStart(hnsw) + hnsw->n_lists)
+		elog(ERROR, "IVF lists of HNSW index \"%s\" are not initialized: index should be rebuilt by REINDEX",
+			 RelationGetRelationName(hnsw->rel));
+}
+
+/*
+ * Append entry to the posting list. Centroids are not changed after index build, so the first page
+ * of the index is not locked: appends to the list are serialized by lock of its head page.
+ */
+void hnsw_ivf_append(HnswIndex* hnsw, idx_t list, void const* code, label_t label)
+{
+	BlockNumber head_blkno = HnswPostingStart(hnsw) + list;
+	BlockNumber tail_blkno;
+	Size size = HNSW_POSTING_ENTRY_SIZE(hnsw);
+	Buffer head;
+	Buffer tail;
+	Buffer buf = InvalidBuffer;
+	Page page;
+	GenericXLogState *state = NULL;
+	char entry[BLCKSZ];
+
+	hnsw_ivf_check_lists(hnsw);
+	memcpy(entry, &label, sizeof(label));
+	memcpy(entry + offsetof(HnswPostingEntry, data), code, hnsw->meta.data_size);
+
+	head = ReadBuffer(hnsw->rel, head_blkno);
+	LockBuffer(head, BUFFER_LOCK_EXCLUSIVE);
+	tail_blkno = HnswPostingPageGetOpaque(BufferGetPage(head))->tail;
+	if (tail_blkno != head_blkno)
+	{
+		tail = ReadBuffer(hnsw->rel, tail_blkno);
+		LockBuffer(tail, BUFFER_LOCK_EXCLUSIVE);
+	}
+	else
+		tail = head;
+
+	if (!hnsw->unlogged)
+		state = GenericXLogStart(hnsw->rel);
+
+	if (PageGetFreeSpace(BufferGetPage(tail)) < MAXALIGN(size))
+	{
+		/* Tail page is full: new page is added to the relation and linked to the list */
+		Page tail_page;
+		Page head_page;
+
+		/* Other lists can be extended concurrently */
+		LockRelationForExtension(hnsw->rel, ExclusiveLock);
+		buf = ReadBuffer(hnsw->rel, P_NEW);
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+		UnlockRelationForExtension(hnsw->rel, ExclusiveLock);
+		page = state ? GenericXLogRegisterBuffer(state, buf, GENERIC_XLOG_FULL_IMAGE) : BufferGetPage(buf);
+		hnsw_ivf_init_page(hnsw, page);
+
+		tail_page = state ? GenericXLogRegisterBuffer(state, tail, 0) : BufferGetPage(tail);
+		HnswPostingPageGetOpaque(tail_page)->next = BufferGetBlockNumber(buf);
+		head_page = tail == head ? tail_page
+			: state ? GenericXLogRegisterBuffer(state, head, 0) : BufferGetPage(head);
+		HnswPostingPageGetOpaque(head_page)->tail = BufferGetBlockNumber(buf);
+		MarkBufferDirty(buf);
+		MarkBufferDirty(head);
+	}
+	else
+		page = state ? GenericXLogRegisterBuffer(state, tail, 0) : BufferGetPage(tail);
+
+	if (PageAddItem(page, (Item)entry, size, InvalidOffsetNumber, false, false) == InvalidOffsetNumber)
+		elog(ERROR, "Failed to add entry to IVF list of HNSW index \"%s\"", RelationGetRelationName(hnsw->rel));
+
+	MarkBufferDirty(tail);
+	if (state)
+		GenericXLogFinish(state);
+
+	if (buf != InvalidBuffer)
+		UnlockReleaseBuffer(buf);
+	if (tail != head)
+		UnlockReleaseBuffer(tail);
+	UnlockReleaseBuffer(head);
+}
+
+/*
+ * Best entries found so far are kept in max-heap: its root is the farthest of them.
+ * Place new entry at the root of the heap of n entries and sift it down.
+ */
+static void hnsw_ivf_sift_down(label_t* labels, dist_t* dists, size_t n, label_t label, dist_t dist)
+{
+	size_t i = 0;
+
+	while (i * 2 + 1 < n)
+	{
+		size_t child = i * 2 + 1;
+		if (child + 1 < n && dists[child + 1] > dists[child])
+			child += 1;
+		if (dists[child] <= dist)
+			break;
+		labels[i] = labels[child];
+		dists[i] = dists[child];
+		i = child;
+	}
+	labels[i] = label;
+	dists[i] = dist;
+}
+
+static void hnsw_ivf_push(label_t* labels, dist_t* dists, size_t* n, size_t k, label_t label, dist_t dist)
+{
+	size_t i;
+
+	if (*n == k)
+	{
+		/* Replace the farthest entry */
+		if (dist < dists[0])
+			hnsw_ivf_sift_down(labels, dists, k, label, dist);
+		return;
+	}
+	i = (*n)++;
+	while (i > 0 && dists[(i - 1) / 2] < dist)
+	{
+		labels[i] = labels[(i - 1) / 2];
+		dists[i] = dists[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	labels[i] = label;
+	dists[i] = dist;
+}
+
+/*
+ * Scan the given posting lists and return k nearest alive entries ordered by distance.
+ * Like results of graph search, result arrays are allocated by malloc: they are copied from the heap
+ * after the scan, so that they are not leaked if the scan is interrupted by error.
+ */
+bool hnsw_ivf_scan(HnswIndex* hnsw, coord_t const* point, label_t const* lists, size_t n_lists, size_t k,
+				   size_t* n_results, label_t** results, dist_t** dists)
+{
+	HnswMetadata* meta = &hnsw->meta;
+	label_t* heap_labels;
+	dist_t* heap_dists;
+	size_t n = 0;
+
+	hnsw_ivf_check_lists(hnsw);
+	heap_labels = (label_t*)palloc_extended(Max(k, 1) * sizeof(label_t), MCXT_ALLOC_HUGE);
+	heap_dists = (dist_t*)palloc_extended(Max(k, 1) * sizeof(dist_t), MCXT_ALLOC_HUGE);
+
+	/* Chains can not be prefetched, but heads of all lists can */
+	for (size_t i = 0; i < n_lists; i++)
+		PrefetchBuffer(hnsw->rel, MAIN_FORKNUM, HnswPostingStart(hnsw) + (BlockNumber)lists[i]);
+
+	for (size_t i = 0; i < n_lists; i++)
+	{
+		BlockNumber blkno = HnswPostingStart(hnsw) + (BlockNumber)lists[i];
+
+		while (blkno != InvalidBlockNumber)
+		{
+			Buffer buf = ReadBuffer(hnsw->rel, blkno);
+			Page page;
+			OffsetNumber max_offs;
+
+			CHECK_FOR_INTERRUPTS();
+			LockBuffer(buf, BUFFER_LOCK_SHARE);
+			page = BufferGetPage(buf);
+			max_offs = PageGetMaxOffsetNumber(page);
+			for (OffsetNumber offs = FirstOffsetNumber; offs <= max_offs; offs++)
+			{
+				HnswPostingEntry* entry = (HnswPostingEntry*)PageGetItem(page, PageGetItemId(page, offs));
+				dist_t dist;
+
+				if (entry->label.pg.flags & DELETED_FLAG)
+					continue;
+				dist = hnsw_vector_dist(meta, point, entry->data);
+				if (meta->pq_bounds)
+					dist = hnsw_distance_lower_bound(meta, dist, entry->data);
+				hnsw_ivf_push(heap_labels, heap_dists, &n, k, entry->label.label, dist);
+			}
+			hnsw_search_stats.distance_computations += max_offs;
+			blkno = HnswPostingPageGetOpaque(page)->next;
+			UnlockReleaseBuffer(buf);
+		}
+	}
+
+	/* Heap is sorted by moving its root after the remaining entries */
+	*n_results = n;
+	for (size_t m = n; m > 1; m--)
+	{
+		label_t label = heap_labels[m - 1];
+		dist_t dist = heap_dists[m - 1];
+
+		heap_labels[m - 1] = heap_labels[0];
+		heap_dists[m - 1] = heap_dists[0];
+		hnsw_ivf_sift_down(heap_labels, heap_dists, m - 1, label, dist);
+	}
+	*results = (label_t*)malloc(Max(n, 1) * sizeof(label_t));
+	*dists = (dist_t*)malloc(Max(n, 1) * sizeof(dist_t));
+	if (*results == NULL || *dists == NULL)
+	{
+		free(*results);
+		free(*dists);
+		pfree(heap_labels);
+		pfree(heap_dists);
+		return false;
+	}
+	memcpy(*results, heap_labels, n * sizeof(label_t));
+	memcpy(*dists, heap_dists, n * sizeof(dist_t));
+	pfree(heap_labels);
+	pfree(heap_dists);
+	return true;
+}
+
+/*
+ * Mark entries referencing dead tuples as deleted. All pages following the head pages of the lists
+ * are posting pages, so they are scanned sequentially. Callback is invoked without holding any buffer lock.
+ */
+void hnsw_ivf_bulkdelete(HnswIndex* hnsw, IndexVacuumInfo* info, IndexBulkDeleteResult* stats,
+						 IndexBulkDeleteCallback callback, void* callback_state)
+{
+	BlockNumber n_blocks = RelationGetNumberOfBlocks(hnsw->rel);
+	HnswLabel labels[MaxOffsetNumber];
+	bool deleted[MaxOffsetNumber];
+
+	for (BlockNumber blkno = HnswPostingStart(hnsw); blkno < n_blocks; blkno++)
+	{
+		Buffer buf = ReadBufferExtended(hnsw->rel, MAIN_FORKNUM, blkno, RBM_NORMAL, info->strategy);
+		Page page;
+		OffsetNumber max_offs;
+		size_t n_deleted = 0;
+
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		max_offs = PageIsNew(page) ? InvalidOffsetNumber : PageGetMaxOffsetNumber(page);
+		for (OffsetNumber offs = FirstOffsetNumber; offs <= max_offs; offs++)
+			labels[offs - 1] = ((HnswPostingEntry*)PageGetItem(page, PageGetItemId(page, offs)))->label;
+		LockBuffer(buf, BUFFER_LOCK_UNLOCK);
+
+		for (OffsetNumber offs = FirstOffsetNumber; offs <= max_offs; offs++)
+		{
+			HnswLabel* label = &labels[offs - 1];
+			deleted[offs - 1] = false;
+			if (label->pg.flags & DELETED_FLAG)
+				continue;
+			if (callback(&label->pg.tid, callback_state))
+			{
+				deleted[offs - 1] = true;
+				stats->tuples_removed++;
+				n_deleted++;
+			}
+			else
+				stats->num_index_tuples++;
+		}
+		if (n_deleted > 0)
+		{
+			/* Entries are never removed, so their offsets are not changed while page was unlocked */
+			GenericXLogState *state;
+
+			LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+			state = GenericXLogStart(hnsw->rel);
+			page = GenericXLogRegisterBuffer(state, buf, 0);
+			for (OffsetNumber offs = FirstOffsetNumber; offs <= max_offs; offs++)
+			{
+				if (deleted[offs - 1])
+					((HnswPostingEntry*)PageGetItem(page, PageGetItemId(page, offs)))->label.pg.flags |= DELETED_FLAG;
+			}
+			MarkBufferDirty(buf);
+			GenericXLogFinish(state);
+			LockBuffer(buf, BUFFER_LOCK_UNLOCK);
+		}
+		ReleaseBuffer(buf);
+	}
+}
@@ -0,0 +1,787 @@
+// Copyright 2023 Neon Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*
+ * Warming up of HNSW indexes.
+ *
+ * hnsw_prewarm(regclass) reads all pages of the index sequentially, so that following searches
+ * do not perform random reads.
+ *
+ * Autoprewarm background worker periodically saves list of HNSW index blocks present in shared
+ * buffers and loads them after restart. Unlike pg_prewarm's autoprewarm it saves only blocks of
+ * HNSW indexes registered in shared memory registry (indexes accessed since server start).
+ * Like autoprewarm, blocks are loaded by workers connected to each database in turn: they open
+ * the index with AccessShareLock, so index can not be concurrently dropped or truncated.
+ */
+#include "postgres.h"
+
+#include <signal.h>
+#include <unistd.h>
+
+#include "access/genam.h"
+#include "access/xact.h"
+#include "catalog/objectaddress.h"
+#include "catalog/pg_class.h"
+#include "commands/defrem.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "storage/buf_internals.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/shmem.h"
+#include "storage/smgr.h"
+#include "storage/spin.h"
+#include "tcop/tcopprot.h"
+#if PG_VERSION_NUM >= 170000
+#include "storage/read_stream.h"
+#endif
+#include "utils/acl.h"
+#include "utils/guc.h"
+#include "utils/lsyscache.h"
+#if PG_VERSION_NUM >= 160000
+#include "utils/relfilenumbermap.h"
+#else
+#include "utils/relfilenodemap.h"
+#endif
+
+#include "hnsw.h"
+
+#define HNSW_PREWARM_FILE        "hnsw_prewarm.blocks"
+#define HNSW_PREWARM_RESTART     10  /* seconds before restart of failed worker */
+#define HNSW_PREWARM_DISTANCE    64  /* number of blocks prefetched ahead */
+
+#if PG_VERSION_NUM >= 160000
+#define HnswTagGetSpcOid(tag) ((tag).spcOid)
+#define HnswTagGetDbOid(tag)  ((tag).dbOid)
+#define HnswTagGetRelNode(tag) ((tag).relNumber)
+#define HnswRelidByRelNode(spcid, relnode) RelidByRelfilenumber(spcid, relnode)
+#define HnswRelGetRelNode(rel) ((rel)->rd_locator.relNumber)
+#else
+#define HnswTagGetSpcOid(tag) ((tag).rnode.spcNode)
+#define HnswTagGetDbOid(tag)  ((tag).rnode.dbNode)
+#define HnswTagGetRelNode(tag) ((tag).rnode.relNode)
+#define HnswRelidByRelNode(spcid, relnode) RelidByRelfilenode(spcid, relnode)
+#define HnswRelGetRelNode(rel) ((rel)->rd_node.relNode)
+#endif
+
+/*
+ * Physical identifier of HNSW index relation
+ */
+typedef struct
+{
+	Oid         spcid;
+	Oid         dbid;
+	Oid         relnode;
+} HnswPrewarmRel;
+
+typedef struct
+{
+	HnswPrewarmRel rel;
+	ForkNumber  forknum;
+	BlockNumber blkno;
+} HnswPrewarmBlock;
+
+/*
+ * Registry of HNSW indexes accessed since server start.
+ * Backends register index once, when its descriptor is cached in relcache entry. Dropped indexes are
+ * removed from the registry by autoprewarm worker: then generation is incremented, so that backends
+ * register their indexes again.
+ */
+typedef struct
+{
+	slock_t     mutex;
+	pg_atomic_uint32 generation;
+	bool        loaded;         /* saved blocks were loaded (worker may be restarted) */
+	bool        overflow_reported;
+	int         n_rels;
+	HnswPrewarmRel rels[FLEXIBLE_ARRAY_MEMBER];
+} HnswPrewarmState;
+
+static bool hnsw_autoprewarm;
+static int  hnsw_autoprewarm_interval;
+static int  hnsw_autoprewarm_max_indexes;
+static HnswPrewarmState* hnsw_prewarm_state;
+
+static volatile sig_atomic_t got_sigterm = false;
+static volatile sig_atomic_t got_sighup = false;
+
+static shmem_startup_hook_type prev_shmem_startup_hook;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook;
+#endif
+
+PGDLLEXPORT void hnsw_autoprewarm_main(Datum main_arg);
+PGDLLEXPORT void hnsw_autoprewarm_database_main(Datum main_arg);
+PGDLLEXPORT PG_FUNCTION_INFO_V1(hnsw_prewarm);
+
+static int
+hnsw_compare_prewarm_rels(const void* a, const void* b)
+{
+	HnswPrewarmRel const* r1 = (HnswPrewarmRel const*)a;
+	HnswPrewarmRel const* r2 = (HnswPrewarmRel const*)b;
+
+	if (r1->dbid != r2->dbid)
+		return r1->dbid < r2->dbid ? -1 : 1;
+	if (r1->spcid != r2->spcid)
+		return r1->spcid < r2->spcid ? -1 : 1;
+	if (r1->relnode != r2->relnode)
+		return r1->relnode < r2->relnode ? -1 : 1;
+	return 0;
+}
+
+static int
+hnsw_compare_prewarm_blocks(const void* a, const void* b)
+{
+	HnswPrewarmBlock const* b1 = (HnswPrewarmBlock const*)a;
+	HnswPrewarmBlock const* b2 = (HnswPrewarmBlock const*)b;
+	int diff = hnsw_compare_prewarm_rels(&b1->rel, &b2->rel);
+
+	if (diff != 0)
+		return diff;
+	if (b1->forknum != b2->forknum)
+		return b1->forknum < b2->forknum ? -1 : 1;
+	if (b1->blkno != b2->blkno)
+		return b1->blkno < b2->blkno ? -1 : 1;
+	return 0;
+}
+
+static Size
+hnsw_prewarm_shmem_size(void)
+{
+	return add_size(offsetof(HnswPrewarmState, rels), mul_size(hnsw_autoprewarm_max_indexes, sizeof(HnswPrewarmRel)));
+}
+
+/*
+ * Remember index in registry, so that autoprewarm saves its blocks.
+ * Returns false if there is no space in the registry.
+ */
+static bool
+hnsw_prewarm_register_rel(HnswPrewarmRel const* rel)
+{
+	HnswPrewarmState* state = hnsw_prewarm_state;
+	bool report = false;
+	int i;
+
+	SpinLockAcquire(&state->mutex);
+	for (i = 0; i < state->n_rels; i++)
+	{
+		if (hnsw_compare_prewarm_rels(&state->rels[i], rel) == 0)
+			break;
+	}
+	if (i == state->n_rels)
+	{
+		if (i < hnsw_autoprewarm_max_indexes)
+			state->rels[state->n_rels++] = *rel;
+		else if (!state->overflow_reported)
+			report = state->overflow_reported = true;
+	}
+	SpinLockRelease(&state->mutex);
+
+	if (report)
+		ereport(LOG,
+				(errmsg("blocks of more than %d HNSW indexes can not be saved by autoprewarm", hnsw_autoprewarm_max_indexes),
+				 errhint("Increase embedding.autoprewarm_max_indexes.")));
+	return i < hnsw_autoprewarm_max_indexes;
+}
+
+/*
+ * Register index in autoprewarm registry if it was not yet registered in the current generation of
+ * the registry. Generation is kept by caller (in cached index descriptor), so it is cheap to call it
+ * for each operation. If registry is full, index is registered again after some indexes are removed from it.
+ */
+void
+hnsw_prewarm_register(Relation index, uint32* generation)
+{
+	HnswPrewarmRel rel;
+	uint32 current;
+
+	/* Buffers of unlogged indexes are not saved: such indexes are reset after crash anyway */
+	if (hnsw_prewarm_state == NULL || index->rd_rel->relpersistence != RELPERSISTENCE_PERMANENT)
+		return;
+
+	current = pg_atomic_read_u32(&hnsw_prewarm_state->generation);
+	if (*generation == current)
+		return;
+
+#if PG_VERSION_NUM >= 160000
+	rel.spcid = index->rd_locator.spcOid;
+	rel.dbid = index->rd_locator.dbOid;
+	rel.relnode = index->rd_locator.relNumber;
+#else
+	rel.spcid = index->rd_node.spcNode;
+	rel.dbid = index->rd_node.dbNode;
+	rel.relnode = index->rd_node.relNode;
+#endif
+	hnsw_prewarm_register_rel(&rel);
+	*generation = current;
+}
+
+/*
+ * Remove indexes which have no blocks in shared buffers: buffers of dropped or truncated index are discarded.
+ * Alive indexes are registered again by backends accessing them.
+ */
+static void
+hnsw_prewarm_prune(HnswPrewarmRel const* rels, bool const* used, int n_rels)
+{
+	HnswPrewarmState* state = hnsw_prewarm_state;
+	bool pruned = false;
+
+	SpinLockAcquire(&state->mutex);
+	for (int i = 0; i < n_rels; i++)
+	{
+		if (used[i])
+			continue;
+		for (int j = 0; j < state->n_rels; j++)
+		{
+			if (hnsw_compare_prewarm_rels(&state->rels[j], &rels[i]) == 0)
+			{
+				state->rels[j] = state->rels[--state->n_rels];
+				pruned = true;
+				break;
+			}
+		}
+	}
+	if (pruned)
+	{
+		state->overflow_reported = false;
+		pg_atomic_fetch_add_u32(&state->generation, 1);
+	}
+	SpinLockRelease(&state->mutex);
+}
+
+#if PG_VERSION_NUM >= 170000
+typedef struct
+{
+	BlockNumber blkno;
+	BlockNumber n_blocks;
+} HnswPrewarmStream;
+
+static BlockNumber
+hnsw_prewarm_next_block(ReadStream* stream, void* callback_private_data, void* per_buffer_data)
+{
+	HnswPrewarmStream* p = (HnswPrewarmStream*)callback_private_data;
+	return p->blkno < p->n_blocks ? p->blkno++ : InvalidBlockNumber;
+}
+#endif
+
+/*
+ * Read all blocks of the fork in sequential order
+ */
+static int64
+hnsw_prewarm_fork(Relation index, ForkNumber forknum)
+{
+	BlockNumber n_blocks;
+	BlockNumber blkno;
+
+	if (!smgrexists(RelationGetSmgr(index), forknum))
+		return 0;
+
+	n_blocks = smgrnblocks(RelationGetSmgr(index), forknum);
+#if PG_VERSION_NUM >= 170000
+	{
+		HnswPrewarmStream p;
+		ReadStream* stream;
+
+		p.blkno = 0;
+		p.n_blocks = n_blocks;
+		stream = read_stream_begin_relation(READ_STREAM_FULL, NULL, index, forknum,
+											hnsw_prewarm_next_block, &p, 0);
+		for (blkno = 0; blkno < n_blocks; blkno++)
+		{
+			CHECK_FOR_INTERRUPTS();
+			ReleaseBuffer(read_stream_next_buffer(stream, NULL));
+		}
+		read_stream_end(stream);
+	}
+#else
+	for (blkno = 0; blkno < Min(n_blocks, HNSW_PREWARM_DISTANCE); blkno++)
+		PrefetchBuffer(index, forknum, blkno);
+	for (blkno = 0; blkno < n_blocks; blkno++)
+	{
+		CHECK_FOR_INTERRUPTS();
+		if (blkno + HNSW_PREWARM_DISTANCE < n_blocks)
+			PrefetchBuffer(index, forknum, blkno + HNSW_PREWARM_DISTANCE);
+		ReleaseBuffer(ReadBufferExtended(index, forknum, blkno, RBM_NORMAL, NULL));
+	}
+#endif
+	return n_blocks;
+}
+
+/*
+ * Load all pages of HNSW index in shared buffers. Returns number of loaded blocks.
+ */
+Datum
+hnsw_prewarm(PG_FUNCTION_ARGS)
+{
+	Oid         relid = PG_GETARG_OID(0);
+	Relation    index;
+	AclResult   aclresult;
+	int64       n_blocks = 0;
+	uint32      generation = 0;
+
+	index = index_open(relid, AccessShareLock);
+	if (index->rd_rel->relam != get_index_am_oid("hnsw", false))
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not an HNSW index", RelationGetRelationName(index))));
+
+	aclresult = pg_class_aclcheck(relid, GetUserId(), ACL_SELECT);
+	if (aclresult != ACLCHECK_OK)
+		aclcheck_error(aclresult, get_relkind_objtype(index->rd_rel->relkind), get_rel_name(relid));
+
+	n_blocks += hnsw_prewarm_fork(index, MAIN_FORKNUM);
+
+	hnsw_prewarm_register(index, &generation);
+	index_close(index, AccessShareLock);
+
+	PG_RETURN_INT64(n_blocks);
+}
+
+/*
+ * Save blocks of registered HNSW indexes present in shared buffers.
+ * Errors are reported with LOG level to keep worker running.
+ */
+static void
+hnsw_autoprewarm_dump(void)
+{
+	HnswPrewarmRel* rels;
+	bool*       used;
+	HnswPrewarmBlock* blocks;
+	int         n_rels;
+	size_t      n_blocks = 0;
+	FILE*       file;
+
+	rels = (HnswPrewarmRel*)palloc(hnsw_autoprewarm_max_indexes * sizeof(HnswPrewarmRel));
+	SpinLockAcquire(&hnsw_prewarm_state->mutex);
+	n_rels = hnsw_prewarm_state->n_rels;
+	memcpy(rels, hnsw_prewarm_state->rels, n_rels * sizeof(HnswPrewarmRel));
+	SpinLockRelease(&hnsw_prewarm_state->mutex);
+
+	if (n_rels == 0)
+	{
+		pfree(rels);
+		return;
+	}
+	qsort(rels, n_rels, sizeof(HnswPrewarmRel), hnsw_compare_prewarm_rels);
+	used = (bool*)palloc0(n_rels * sizeof(bool));
+
+	blocks = (HnswPrewarmBlock*)palloc_extended((Size)NBuffers * sizeof(HnswPrewarmBlock), MCXT_ALLOC_HUGE);
+	for (int i = 0; i < NBuffers; i++)
+	{
+		BufferDesc* hdr = GetBufferDescriptor(i);
+		HnswPrewarmBlock* block = &blocks[n_blocks];
+		uint32      buf_state = LockBufHdr(hdr);
+		bool        valid = (buf_state & BM_TAG_VALID) && (buf_state & BM_PERMANENT);
+
+		if (valid)
+		{
+			block->rel.spcid = HnswTagGetSpcOid(hdr->tag);
+			block->rel.dbid = HnswTagGetDbOid(hdr->tag);
+			block->rel.relnode = HnswTagGetRelNode(hdr->tag);
+			block->forknum = hdr->tag.forkNum;
+			block->blkno = hdr->tag.blockNum;
+		}
+		UnlockBufHdr(hdr, buf_state);
+
+		if (valid)
+		{
+			HnswPrewarmRel* rel = (HnswPrewarmRel*)bsearch(&block->rel, rels, n_rels, sizeof(HnswPrewarmRel), hnsw_compare_prewarm_rels);
+			if (rel != NULL)
+			{
+				used[rel - rels] = true;
+				n_blocks += 1;
+			}
+		}
+	}
+	hnsw_prewarm_prune(rels, used, n_rels);
+	pfree(used);
+	pfree(rels);
+
+	/* Blocks are loaded in order of their location in files */
+	qsort(blocks, n_blocks, sizeof(HnswPrewarmBlock), hnsw_compare_prewarm_blocks);
+
+	file = AllocateFile(HNSW_PREWARM_FILE ".tmp", PG_BINARY_W);
+	if (file == NULL)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\": %m", HNSW_PREWARM_FILE ".tmp")));
+		pfree(blocks);
+		return;
+	}
+
+	fprintf(file, "%zu\n", n_blocks);
+	for (size_t i = 0; i < n_blocks; i++)
+		fprintf(file, "%u,%u,%u,%d,%u\n",
+				blocks[i].rel.spcid, blocks[i].rel.dbid, blocks[i].rel.relnode,
+				blocks[i].forknum, blocks[i].blkno);
+	pfree(blocks);
+
+	if (ferror(file))
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m", HNSW_PREWARM_FILE ".tmp")));
+		FreeFile(file);
+		return;
+	}
+	if (FreeFile(file) != 0)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not close file \"%s\": %m", HNSW_PREWARM_FILE ".tmp")));
+		return;
+	}
+	if (durable_rename(HNSW_PREWARM_FILE ".tmp", HNSW_PREWARM_FILE, LOG) == 0)
+		elog(DEBUG1, "saved %zu HNSW index blocks", n_blocks);
+}
+
+/*
+ * Open file saved by hnsw_autoprewarm_dump and read number of saved blocks
+ */
+static FILE*
+hnsw_prewarm_open_file(size_t* n_saved)
+{
+	FILE* file = AllocateFile(HNSW_PREWARM_FILE, PG_BINARY_R);
+
+	if (file == NULL)
+	{
+		if (errno != ENOENT)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not read file \"%s\": %m", HNSW_PREWARM_FILE)));
+		return NULL;
+	}
+	if (fscanf(file, "%zu\n", n_saved) != 1)
+	{
+		ereport(LOG, (errmsg("HNSW prewarm file \"%s\" is corrupted", HNSW_PREWARM_FILE)));
+		FreeFile(file);
+		return NULL;
+	}
+	return file;
+}
+
+/*
+ * Read next saved block. Returns false if file is corrupted.
+ */
+static bool
+hnsw_prewarm_read_block(FILE* file, HnswPrewarmBlock* block)
+{
+	int forknum;
+
+	if (fscanf(file, "%u,%u,%u,%d,%u\n", &block->rel.spcid, &block->rel.dbid, &block->rel.relnode,
+			   &forknum, &block->blkno) != 5 || forknum < 0 || forknum > MAX_FORKNUM)
+	{
+		ereport(LOG, (errmsg("HNSW prewarm file \"%s\" is corrupted", HNSW_PREWARM_FILE)));
+		return false;
+	}
+	block->forknum = (ForkNumber)forknum;
+	return true;
+}
+
+/*
+ * Load saved blocks of indexes of one database. Worker is connected to the database, so indexes are
+ * opened with AccessShareLock: blocks of dropped indexes or indexes which were rebuilt since blocks
+ * were saved are skipped.
+ */
+void
+hnsw_autoprewarm_database_main(Datum main_arg)
+{
+	Oid         dbid = DatumGetObjectId(main_arg);
+	Oid         hnsw_am;
+	FILE*       file;
+	HnswPrewarmBlock block;
+	HnswPrewarmBlock prev;
+	Relation    rel = NULL;
+	BlockNumber n_blocks = 0;
+	size_t      n_loaded = 0;
+	size_t      n_saved;
+
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+	BackgroundWorkerInitializeConnectionByOid(dbid, InvalidOid, 0);
+
+	file = hnsw_prewarm_open_file(&n_saved);
+	if (file == NULL)
+		return;
+
+	StartTransactionCommand();
+	hnsw_am = get_index_am_oid("hnsw", true);
+
+	memset(&prev, 0, sizeof(prev));
+	prev.forknum = InvalidForkNumber;
+	for (size_t i = 0; i < n_saved && hnsw_prewarm_read_block(file, &block); i++)
+	{
+		CHECK_FOR_INTERRUPTS();
+
+		if (block.rel.dbid != dbid)
+			continue;
+
+		/* Do not evict other pages: stop when there are no more free buffers */
+		if (!have_free_buffer())
+			break;
+
+		if (hnsw_compare_prewarm_rels(&block.rel, &prev.rel) != 0)
+		{
+			Oid relid;
+
+			if (rel != NULL)
+			{
+				relation_close(rel, AccessShareLock);
+				rel = NULL;
+			}
+			/* Lock is held only while blocks of one index are loaded */
+			CommitTransactionCommand();
+			StartTransactionCommand();
+
+			relid = HnswRelidByRelNode(block.rel.spcid, block.rel.relnode);
+			if (OidIsValid(relid))
+				rel = try_relation_open(relid, AccessShareLock);
+			if (rel != NULL && (rel->rd_rel->relam != hnsw_am || HnswRelGetRelNode(rel) != block.rel.relnode))
+			{
+				relation_close(rel, AccessShareLock);
+				rel = NULL;
+			}
+			if (rel != NULL)
+			{
+				uint32 generation = 0;
+				hnsw_prewarm_register(rel, &generation);
+			}
+			prev.forknum = InvalidForkNumber;
+		}
+		if (block.forknum != prev.forknum)
+			n_blocks = rel != NULL && smgrexists(RelationGetSmgr(rel), block.forknum)
+				? RelationGetNumberOfBlocksInFork(rel, block.forknum) : 0;
+		prev = block;
+
+		if (block.blkno < n_blocks)
+		{
+			ReleaseBuffer(ReadBufferExtended(rel, block.forknum, block.blkno, RBM_NORMAL, NULL));
+			n_loaded += 1;
+		}
+	}
+	if (rel != NULL)
+		relation_close(rel, AccessShareLock);
+	CommitTransactionCommand();
+	FreeFile(file);
+
+	ereport(LOG, (errmsg("loaded %zu HNSW index blocks of database %u", n_loaded, dbid)));
+}
+
+/*
+ * Start worker loading blocks of the database and wait for its completion
+ */
+static bool
+hnsw_autoprewarm_load_database(Oid dbid)
+{
+	BackgroundWorker worker;
+	BackgroundWorkerHandle* handle;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_ConsistentState;
+	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	strcpy(worker.bgw_library_name, "embedding");
+	strcpy(worker.bgw_function_name, "hnsw_autoprewarm_database_main");
+	snprintf(worker.bgw_name, sizeof(worker.bgw_name), "hnsw autoprewarm of database %u", dbid);
+	strcpy(worker.bgw_type, "hnsw autoprewarm");
+	worker.bgw_main_arg = ObjectIdGetDatum(dbid);
+	worker.bgw_notify_pid = MyProcPid;
+
+	if (!RegisterDynamicBackgroundWorker(&worker, &handle))
+	{
+		ereport(LOG,
+				(errmsg("could not start HNSW autoprewarm worker"),
+				 errhint("Consider increasing max_worker_processes.")));
+		return false;
+	}
+	return WaitForBackgroundWorkerShutdown(handle) == BGWH_STOPPED;
+}
+
+/*
+ * Load blocks saved by hnsw_autoprewarm_dump. Blocks are sorted by database, and blocks of each database
+ * are loaded by separate worker. It is done only once: restarted worker doesn't load blocks again.
+ */
+static void
+hnsw_autoprewarm_load(void)
+{
+	FILE*       file;
+	HnswPrewarmBlock block;
+	Oid         dbid = InvalidOid;
+	size_t      n_saved;
+	bool        loaded;
+
+	SpinLockAcquire(&hnsw_prewarm_state->mutex);
+	loaded = hnsw_prewarm_state->loaded;
+	hnsw_prewarm_state->loaded = true;
+	SpinLockRelease(&hnsw_prewarm_state->mutex);
+	if (loaded)
+		return;
+
+	file = hnsw_prewarm_open_file(&n_saved);
+	if (file == NULL)
+		return;
+
+	for (size_t i = 0; i < n_saved && !got_sigterm && hnsw_prewarm_read_block(file, &block); i++)
+	{
+		if (block.rel.dbid == dbid || !OidIsValid(block.rel.dbid))
+			continue;
+		if (!have_free_buffer())
+			break;
+		dbid = block.rel.dbid;
+		if (!hnsw_autoprewarm_load_database(dbid))
+			break;
+	}
+	FreeFile(file);
+}
+
+static void
+hnsw_autoprewarm_sigterm(SIGNAL_ARGS)
+{
+	int save_errno = errno;
+
+	got_sigterm = true;
+	SetLatch(MyLatch);
+	errno = save_errno;
+}
+
+static void
+hnsw_autoprewarm_sighup(SIGNAL_ARGS)
+{
+	int save_errno = errno;
+
+	got_sighup = true;
+	SetLatch(MyLatch);
+	errno = save_errno;
+}
+
+void
+hnsw_autoprewarm_main(Datum main_arg)
+{
+	pqsignal(SIGTERM, hnsw_autoprewarm_sigterm);
+	pqsignal(SIGHUP, hnsw_autoprewarm_sighup);
+	BackgroundWorkerUnblockSignals();
+
+	hnsw_autoprewarm_load();
+
+	while (!got_sigterm)
+	{
+		long timeout = hnsw_autoprewarm_interval * 1000L;
+		int rc = WaitLatch(MyLatch,
+						   WL_LATCH_SET | WL_EXIT_ON_PM_DEATH | (timeout > 0 ? WL_TIMEOUT : 0),
+						   timeout, PG_WAIT_EXTENSION);
+
+		ResetLatch(MyLatch);
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+		if (rc & WL_TIMEOUT)
+			hnsw_autoprewarm_dump();
+	}
+	/* Save blocks at shutdown */
+	hnsw_autoprewarm_dump();
+}
+
+#if PG_VERSION_NUM >= 150000
+static void
+hnsw_prewarm_shmem_request(void)
+{
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+	RequestAddinShmemSpace(hnsw_prewarm_shmem_size());
+}
+#endif
+
+static void
+hnsw_prewarm_shmem_startup(void)
+{
+	bool found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	hnsw_prewarm_state = (HnswPrewarmState*)ShmemInitStruct("embedding prewarm", hnsw_prewarm_shmem_size(), &found);
+	if (!found)
+	{
+		SpinLockInit(&hnsw_prewarm_state->mutex);
+		/* Generation of indexes not yet registered is 0 */
+		pg_atomic_init_u32(&hnsw_prewarm_state->generation, 1);
+		hnsw_prewarm_state->loaded = false;
+		hnsw_prewarm_state->overflow_reported = false;
+		hnsw_prewarm_state->n_rels = 0;
+	}
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Define autoprewarm GUCs and start background worker. Worker can be started only if extension is preloaded.
+ */
+void
+hnsw_prewarm_init(void)
+{
+	BackgroundWorker worker;
+
+	DefineCustomBoolVariable("embedding.autoprewarm",
+							 "Starts background worker saving and restoring HNSW index blocks present in shared buffers.",
+							 "Worker is started only if extension is loaded by shared_preload_libraries.",
+							 &hnsw_autoprewarm,
+							 false,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL, NULL, NULL);
+	DefineCustomIntVariable("embedding.autoprewarm_interval",
+							"Interval between saving HNSW index blocks present in shared buffers.",
+							"If 0, blocks are saved only at shutdown.",
+							&hnsw_autoprewarm_interval,
+							300, 0, INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL, NULL, NULL);
+	DefineCustomIntVariable("embedding.autoprewarm_max_indexes",
+							"Maximal number of HNSW indexes which blocks are saved by autoprewarm.",
+							NULL,
+							&hnsw_autoprewarm_max_indexes,
+							256, 1, INT_MAX / sizeof(HnswPrewarmRel),
+							PGC_POSTMASTER,
+							0,
+							NULL, NULL, NULL);
+
+	if (!process_shared_preload_libraries_in_progress || !hnsw_autoprewarm)
+		return;
+
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = hnsw_prewarm_shmem_request;
+#else
+	RequestAddinShmemSpace(hnsw_prewarm_shmem_size());
+#endif
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = hnsw_prewarm_shmem_startup;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	worker.bgw_start_time = BgWorkerStart_ConsistentState;
+	/* Worker is restarted after failure, saved blocks are loaded only by its first start */
+	worker.bgw_restart_time = HNSW_PREWARM_RESTART;
+	strcpy(worker.bgw_library_name, "embedding");
+	strcpy(worker.bgw_function_name, "hnsw_autoprewarm_main");
+	strcpy(worker.bgw_name, "hnsw autoprewarm");
+	strcpy(worker.bgw_type, "hnsw autoprewarm");
+	RegisterBackgroundWorker(&worker);
+}
@@ -0,0 +1,203 @@
+// Copyright 2023 Neon Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*
+ * WAL logging of HNSW index changes using custom resource manager.
+ * Custom resource managers are supported since Postgres 15 and should be registered
+ * while shared_preload_libraries are loaded. Otherwise generic WAL records are used.
+ */
+#include "postgres.h"
+
+#include "access/bufmask.h"
+#include "access/rmgr.h"
+#include "access/xlog.h"
+#include "access/xloginsert.h"
+#include "access/xlogreader.h"
+#include "access/xlogutils.h"
+#include "miscadmin.h"
+
+#include "hnsw.h"
+
+bool hnsw_rmgr_registered;
+
+void hnsw_xlog_add_op(StringInfo ops, HnswXLogOpKind kind, uint16 offset, void const* data, uint16 len)
+{
+	HnswXLogOp op;
+	op.kind = kind;
+	op.offset = offset;
+	op.len = len;
+	appendBinaryStringInfo(ops, (char*)&op, sizeof(op));
+	if (len != 0)
+		appendBinaryStringInfo(ops, (char*)data, len);
+}
+
+/*
+ * Label and vector pages contain just array of fixed size items, pd_lower is set to the end of this array
+ */
+void hnsw_init_array_page(Page page, Size end)
+{
+	PageInit(page, BLCKSZ, 0);
+	((PageHeader) page)->pd_lower = end;
+}
+
+/*
+ * Apply operations to the page. It is done in the same way at primary and during recovery.
+ */
+void hnsw_xlog_apply_ops(Page page, char const* ops, Size len)
+{
+	char const* end = ops + len;
+	HnswXLogOp op;
+
+	while (ops < end)
+	{
+		memcpy(&op, ops, sizeof(op));
+		ops += sizeof(op);
+		switch (op.kind)
+		{
+			case HNSW_OP_INIT_PAGE:
+				PageInit(page, BLCKSZ, sizeof(HnswPageOpaque));
+				memcpy(PageGetSpecialPointer(page), ops, op.len);
+				if (((HnswPageOpaque*)PageGetSpecialPointer(page))->flags & HNSW_PAGE_SLOTTED)
+					((PageHeader) page)->pd_lower = HNSW_SLOTS_OFFSET;
+				break;
+			case HNSW_OP_INIT_ARRAY_PAGE:
+				hnsw_init_array_page(page, op.offset);
+				break;
+			case HNSW_OP_APPEND_ELEMENT:
+				if (PageAddItem(page, (Item)ops, op.len, op.offset, false, false) != op.offset)
+					elog(ERROR, "Failed to add HNSW element at offset %d", op.offset);
+				break;
+			case HNSW_OP_APPEND_SLOT:
+				if (((PageHeader) page)->pd_lower != op.offset)
+					elog(ERROR, "Failed to add HNSW element at position %d", op.offset);
+				memcpy((char*)page + op.offset, ops, op.len);
+				((PageHeader) page)->pd_lower += op.len;
+				break;
+			case HNSW_OP_SET_LINKS:
+			case HNSW_OP_SET_LABEL:
+			case HNSW_OP_SET_VECTOR:
+			case HNSW_OP_SET_META:
+				memcpy((char*)page + op.offset, ops, op.len);
+				break;
+			default:
+				elog(ERROR, "Unknown HNSW WAL operation %d", op.kind);
+		}
+		ops += op.len;
+	}
+}
+
+#if PG_VERSION_NUM >= 150000 && !defined(NEON_SMGR)
+
+static void
+hnsw_redo(XLogReaderState *record)
+{
+	uint8		info = XLogRecGetInfo(record) & ~XLR_INFO_MASK;
+	XLogRecPtr	lsn = record->EndRecPtr;
+	Buffer		buffers[XLR_MAX_BLOCK_ID + 1];
+	int			n_buffers = 0;
+
+	if (info != XLOG_HNSW_INSERT)
+		elog(PANIC, "hnsw_redo: unknown op code %u", info);
+
+	/* Keep all pages locked until the end to make insertion atomic for hot standby queries */
+	for (uint8 block_id = 0; block_id <= XLogRecMaxBlockId(record); block_id++)
+	{
+		Size		len;
+		char	   *ops;
+		HnswXLogOp	op;
+		Buffer		buf;
+
+		if (!XLogRecHasBlockRef(record, block_id))
+			continue;
+
+		ops = XLogRecGetBlockData(record, block_id, &len);
+		if (ops != NULL && len >= sizeof(op))
+			memcpy(&op, ops, sizeof(op));
+		else
+			op.kind = HNSW_OP_SET_LINKS; /* no data is stored with full page image */
+
+		if (op.kind == HNSW_OP_INIT_PAGE || op.kind == HNSW_OP_INIT_ARRAY_PAGE)
+		{
+			buf = XLogInitBufferForRedo(record, block_id);
+			hnsw_xlog_apply_ops(BufferGetPage(buf), ops, len);
+			PageSetLSN(BufferGetPage(buf), lsn);
+			MarkBufferDirty(buf);
+		}
+		else if (XLogReadBufferForRedo(record, block_id, &buf) == BLK_NEEDS_REDO)
+		{
+			hnsw_xlog_apply_ops(BufferGetPage(buf), ops, len);
+			PageSetLSN(BufferGetPage(buf), lsn);
+			MarkBufferDirty(buf);
+		}
+		buffers[n_buffers++] = buf;
+	}
+	while (n_buffers != 0)
+	{
+		if (BufferIsValid(buffers[--n_buffers]))
+			UnlockReleaseBuffer(buffers[n_buffers]);
+	}
+}
+
+static void
+hnsw_desc(StringInfo buf, XLogReaderState *record)
+{
+	uint8		info = XLogRecGetInfo(record) & ~XLR_INFO_MASK;
+
+	if (info == XLOG_HNSW_INSERT)
+	{
+		xl_hnsw_insert *xlrec = (xl_hnsw_insert *) XLogRecGetData(record);
+		appendStringInfo(buf, "element %u, %d pages", xlrec->idx, XLogRecMaxBlockId(record) + 1);
+	}
+}
+
+static const char *
+hnsw_identify(uint8 info)
+{
+	if ((info & ~XLR_INFO_MASK) == XLOG_HNSW_INSERT)
+		return "INSERT";
+	return NULL;
+}
+
+static void
+hnsw_mask(char *pagedata, BlockNumber blkno)
+{
+	mask_page_lsn_and_checksum(pagedata);
+	mask_unused_space(pagedata);
+}
+
+static const RmgrData hnsw_rmgr = {
+	.rm_name = "hnsw",
+	.rm_redo = hnsw_redo,
+	.rm_desc = hnsw_desc,
+	.rm_identify = hnsw_identify,
+	.rm_mask = hnsw_mask
+};
+
+#endif
+
+/*
+ * Register custom resource manager. It is not possible for Postgres versions prior to 15.
+ * Neon page server is not able to reconstruct pages using custom resource managers,
+ * so generic WAL records are always used in Neon.
+ */
+void hnsw_register_rmgr(void)
+{
+#if PG_VERSION_NUM >= 150000 && !defined(NEON_SMGR)
+	if (process_shared_preload_libraries_in_progress)
+	{
+		RegisterCustomRmgr(HNSW_RMGR_ID, &hnsw_rmgr);
+		hnsw_rmgr_registered = true;
+	}
+#endif
+}
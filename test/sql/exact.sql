@@ -0,0 +1,31 @@
+SET enable_seqscan = off;
+
+CREATE TABLE t (val real[]);
+INSERT INTO t (val) VALUES ('{0,0,0}'), ('{1,2,3}'), ('{1,1,1}'), ('{2,2,2}'), ('{3,3,4}');
+CREATE INDEX ON t USING hnsw (val) WITH (dims=3, m=3);
+
+-- small index is scanned sequentially
+SET embedding.exact_search_threshold = 1000;
+SELECT hnsw_reset_search_statistic();
+SELECT * FROM t ORDER BY val <-> array[3,3,3] LIMIT 3;
+SELECT searches, expansions, distance_computations FROM hnsw_search_statistic();
+
+-- deleted elements are skipped
+DELETE FROM t WHERE val = '{3,3,4}';
+VACUUM t;
+SELECT * FROM t ORDER BY val <-> array[3,3,3] LIMIT 3;
+
+-- exact search can be forced for index of any size
+SET embedding.exact_search_threshold = 0;
+SET embedding.exact_search = on;
+SET embedding.ef_search = 1;
+SET embedding.ef_limit_factor = 0;
+SELECT hnsw_reset_search_statistic();
+SELECT * FROM t ORDER BY val <-> array[1,1,1];
+SELECT searches, expansions, distance_computations FROM hnsw_search_statistic();
+RESET embedding.ef_limit_factor;
+RESET embedding.ef_search;
+RESET embedding.exact_search;
+RESET embedding.exact_search_threshold;
+
+DROP TABLE t;
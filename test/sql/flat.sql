@@ -0,0 +1,53 @@
+SET enable_seqscan = off;
+
+-- all vectors are scanned, so results are exact
+CREATE TABLE t (id integer, val real[]);
+INSERT INTO t SELECT i, array[i, i % 7] FROM generate_series(1, 100) i;
+CREATE INDEX ON t USING flat (val) WITH (dims=2);
+explain (costs off) SELECT id FROM t ORDER BY val <-> array[50.2, 3];
+SELECT id FROM t ORDER BY val <-> array[50.2, 3] LIMIT 3;
+
+-- without LIMIT index is scanned again with doubled number of results, starting after the last returned tuple
+SELECT id FROM t ORDER BY val <-> array[0, 0] OFFSET 95;
+
+-- inserted vector is appended to the last page
+INSERT INTO t VALUES (101, '{50.2,3}');
+SELECT id FROM t ORDER BY val <-> array[50.2, 3] LIMIT 3;
+
+-- deleted entries are skipped
+DELETE FROM t WHERE id = 101;
+VACUUM t;
+SELECT id FROM t ORDER BY val <-> array[50.2, 3] LIMIT 3;
+DROP INDEX t_val_idx;
+
+-- slots of entries removed by vacuum are reused: vector of 2000 dimensions fills the whole page
+CREATE TABLE w (id integer, val real[]);
+CREATE INDEX w_val_idx ON w USING flat (val) WITH (dims=2000);
+INSERT INTO w SELECT i, array_fill(i::real, array[2000]) FROM generate_series(1, 3) i;
+DELETE FROM w WHERE id = 2;
+VACUUM w;
+INSERT INTO w VALUES (4, array_fill(4::real, array[2000]));
+SELECT pg_relation_size('w_val_idx') / current_setting('block_size')::integer AS pages;
+SELECT id FROM w ORDER BY val <-> array_fill(3.9::real, array[2000]) LIMIT 2;
+DROP TABLE w;
+
+-- equal distances are ordered by TID
+CREATE INDEX ON t USING flat (val ann_cos_ops) WITH (dims=2);
+SELECT id FROM t ORDER BY val <=> array[1, 0] LIMIT 3;
+DROP INDEX t_val_idx;
+
+CREATE INDEX ON t USING flat (val) WITH (dims=2, quantization=float16);
+SELECT id FROM t ORDER BY val <-> array[50.2, 3] LIMIT 3;
+DROP INDEX t_val_idx;
+
+CREATE INDEX ON t USING flat (val) WITH (dims=2, quantization=int8);
+CREATE INDEX ON t USING flat (val);
+
+-- index of unlogged table
+CREATE UNLOGGED TABLE u (val real[]);
+CREATE INDEX ON u USING flat (val) WITH (dims=2);
+INSERT INTO u (val) VALUES ('{0,1}'), ('{1,0}'), (NULL), ('{2,2}');
+SELECT * FROM u ORDER BY val <-> array[2, 1] LIMIT 2;
+
+DROP TABLE u;
+DROP TABLE t;
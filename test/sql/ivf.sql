@@ -0,0 +1,38 @@
+SET enable_seqscan = off;
+
+-- vectors are partitioned in posting lists, graph is built for their centroids
+CREATE TABLE t (id integer, val real[]);
+INSERT INTO t SELECT i, array[i, i % 7] FROM generate_series(1, 100) i;
+CREATE INDEX ON t USING hnsw (val) WITH (dims=2, m=3, lists=4);
+
+-- all lists are scanned, so results are exact
+SET embedding.nprobe = 4;
+SELECT id FROM t ORDER BY val <-> array[50.2, 3] LIMIT 3;
+
+-- inserted vector is appended to the list of the nearest centroid
+INSERT INTO t VALUES (101, '{50.2,3}');
+SELECT id FROM t ORDER BY val <-> array[50.2, 3] LIMIT 3;
+
+-- deleted entries are skipped
+DELETE FROM t WHERE id = 101;
+VACUUM t;
+SELECT id FROM t ORDER BY val <-> array[50.2, 3] LIMIT 3;
+DROP INDEX t_val_idx;
+
+-- vectors in posting lists can be quantized
+CREATE INDEX ON t USING hnsw (val) WITH (dims=2, m=3, lists=4, quantization=int8);
+SELECT id FROM t ORDER BY val <-> array[50.2, 3] LIMIT 3;
+DROP INDEX t_val_idx;
+
+CREATE INDEX ON t USING hnsw (val) WITH (dims=2, m=3, lists=4, prefix_dims=1);
+CREATE INDEX ON t USING hnsw (val) WITH (dims=2, m=3, lists=4, quantization=binary);
+
+-- centroids of index built for empty table are coordinate axes
+CREATE TABLE e (val real[]);
+CREATE INDEX ON e USING hnsw (val) WITH (dims=2, m=3, lists=2);
+INSERT INTO e (val) VALUES ('{0,1}'), ('{1,0}'), ('{2,2}');
+SELECT * FROM e ORDER BY val <-> array[2, 1] LIMIT 2;
+
+RESET embedding.nprobe;
+DROP TABLE e;
+DROP TABLE t;
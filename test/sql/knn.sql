@@ -6,16 +6,16 @@ CREATE INDEX ON t USING hnsw (val) WITH (dims=3, m=3);
 
 INSERT INTO t (val) VALUES (array[1,2,4]);
 
-explain SELECT * FROM t ORDER BY val <-> array[3,3,3];
+explain (costs off) SELECT * FROM t ORDER BY val <-> array[3,3,3];
 SELECT * FROM t ORDER BY val <-> array[3,3,3];
 SELECT COUNT(*) FROM t;
 
 CREATE INDEX ON t USING hnsw (val ann_cos_ops) WITH (dims=3, m=3);
-explain SELECT * FROM t ORDER BY val <=> array[3,3,3];
+explain (costs off) SELECT * FROM t ORDER BY val <=> array[3,3,3];
 SELECT * FROM t ORDER BY val <=> array[3,3,3];
 
 CREATE INDEX ON t USING hnsw (val ann_manhattan_ops) WITH (dims=3, m=3);
-explain SELECT * FROM t ORDER BY val <~> array[3,3,3];
+explain (costs off) SELECT * FROM t ORDER BY val <~> array[3,3,3];
 SELECT * FROM t ORDER BY val <~> array[3,3,3];
 
 SET enable_seqscan = on;
@@ -0,0 +1,52 @@
+SET enable_seqscan = off;
+
+CREATE TABLE t (val real[]);
+INSERT INTO t (val) VALUES ('{0,1,2}'), ('{1,2,3}'), ('{1,1,1}'), (NULL);
+CREATE INDEX ON t USING hnsw (val) WITH (dims=3, m=3, layout=split);
+
+INSERT INTO t (val) VALUES (array[1,2,4]);
+
+SELECT * FROM t ORDER BY val <-> array[3,3,3];
+
+DELETE FROM t WHERE val = '{1,1,1}';
+VACUUM t;
+SELECT * FROM t ORDER BY val <-> array[3,3,3];
+
+CREATE INDEX ON t USING hnsw (val) WITH (dims=3, m=3, layout=columnar);
+
+DROP INDEX t_val_idx;
+CREATE INDEX ON t USING hnsw (val) WITH (dims=3, m=3, slotted=true);
+INSERT INTO t (val) VALUES (array[1,1,1]);
+SELECT * FROM t ORDER BY val <-> array[3,3,3];
+
+DROP INDEX t_val_idx;
+CREATE INDEX ON t USING hnsw (val) WITH (dims=3, m=3, layout=split, slotted=true);
+INSERT INTO t (val) VALUES (array[2,2,2]);
+SELECT * FROM t ORDER BY val <-> array[3,3,3];
+
+DROP INDEX t_val_idx;
+CREATE INDEX ON t USING hnsw (val) WITH (dims=3, m=3, compress_links=true);
+INSERT INTO t (val) VALUES (array[3,3,4]);
+SELECT * FROM t ORDER BY val <-> array[3,3,3];
+
+DROP INDEX t_val_idx;
+CREATE INDEX ON t USING hnsw (val) WITH (dims=3, m=3, link_codes=true);
+INSERT INTO t (val) VALUES (array[3,3,3.5]);
+SELECT * FROM t ORDER BY val <-> array[3,3,3];
+-- neighbors are skipped using their codes once results are full: recall is checked against exact results
+SET enable_indexscan = off;
+CREATE TEMP TABLE exact AS SELECT val FROM t ORDER BY val <-> array[3,3,3] LIMIT 3;
+RESET enable_indexscan;
+SET embedding.ef_search = 1;
+SELECT count(*) AS recall FROM (SELECT val FROM t ORDER BY val <-> array[3,3,3] LIMIT 3) r WHERE val IN (SELECT val FROM exact);
+RESET embedding.ef_search;
+DROP TABLE exact;
+CREATE INDEX ON t USING hnsw (val) WITH (dims=3, m=3, link_codes=true, compress_links=true);
+
+-- Vamana build: pruning keeps more long links and search starts from medoid
+DROP INDEX t_val_idx;
+CREATE INDEX ON t USING hnsw (val) WITH (dims=3, m=3, alpha=1.2);
+SELECT * FROM t ORDER BY val <-> array[3,3,3];
+CREATE INDEX ON t USING hnsw (val) WITH (dims=3, m=3, alpha=0.5);
+
+DROP TABLE t;
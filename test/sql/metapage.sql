@@ -0,0 +1,21 @@
+SET enable_seqscan = off;
+
+CREATE TABLE t (val real[]);
+INSERT INTO t (val) VALUES ('{0,1,2}'), ('{1,2,3}'), ('{1,1,1}'), ('{2,2,2}');
+CREATE INDEX ON t USING hnsw (val) WITH (dims=3, m=3);
+
+-- entry point is moved when the first element is deleted
+DELETE FROM t WHERE val = '{0,1,2}';
+VACUUM t;
+SELECT * FROM t ORDER BY val <-> array[0,0,0];
+
+INSERT INTO t (val) VALUES (array[0,0,1]);
+SELECT * FROM t ORDER BY val <-> array[0,0,0];
+
+-- cached index descriptor is invalidated by ALTER INDEX
+ALTER INDEX t_val_idx SET (dims=4);
+SELECT * FROM t ORDER BY val <-> array[0,0,0,0];
+ALTER INDEX t_val_idx SET (dims=3);
+SELECT * FROM t ORDER BY val <-> array[3,3,3];
+
+DROP TABLE t;
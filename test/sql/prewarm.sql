@@ -0,0 +1,13 @@
+CREATE TABLE t (val real[]);
+INSERT INTO t (val) SELECT array[i, i + 1, i + 2] FROM generate_series(1, 100) i;
+CREATE INDEX t_hnsw_idx ON t USING hnsw (val) WITH (dims=3, m=3);
+CREATE INDEX t_btree_idx ON t (val);
+
+SELECT hnsw_prewarm('t_hnsw_idx') > 0;
+SELECT hnsw_prewarm('t_btree_idx');
+
+DROP INDEX t_hnsw_idx;
+CREATE INDEX t_hnsw_idx ON t USING hnsw (val) WITH (dims=3, m=3, layout=split);
+SELECT hnsw_prewarm('t_hnsw_idx') > 0;
+
+DROP TABLE t;
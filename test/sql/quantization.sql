@@ -0,0 +1,74 @@
+SET enable_seqscan = off;
+
+CREATE TABLE t (val real[]);
+INSERT INTO t (val) VALUES ('{0,0,0}'), ('{1,2,3}'), ('{1,1,1}'), ('{2,2,2}'), ('{2.01,2,2}'), ('{3,3,4}');
+
+CREATE INDEX ON t USING hnsw (val) WITH (dims=3, m=3, quantization=int8);
+-- vectors with the same code are returned in order of exact distances
+SELECT * FROM t ORDER BY val <-> array[3,3,3] LIMIT 3;
+
+-- inserted vectors are encoded using trained parameters
+INSERT INTO t (val) VALUES ('{2.5,2.5,2.5}'), ('{5,5,5}');
+SELECT * FROM t ORDER BY val <-> array[3,3,3] LIMIT 3;
+DROP INDEX t_val_idx;
+
+CREATE INDEX ON t USING hnsw (val ann_manhattan_ops) WITH (dims=3, m=3, quantization=int8);
+SELECT * FROM t ORDER BY val <~> array[3,3,3] LIMIT 3;
+DROP INDEX t_val_idx;
+
+-- half precision coordinates
+CREATE INDEX ON t USING hnsw (val) WITH (dims=3, m=3, quantization=float16);
+SELECT * FROM t ORDER BY val <-> array[3,3,3] LIMIT 3;
+DROP INDEX t_val_idx;
+CREATE TABLE t2 (val real[]);
+INSERT INTO t2 (val) VALUES ('{1,2,3}'), ('{1,1,1}'), ('{3,3,4}'), ('{-1,0,1}');
+CREATE INDEX ON t2 USING hnsw (val ann_cos_ops) WITH (dims=3, m=3, quantization=bfloat16);
+SELECT * FROM t2 ORDER BY val <=> array[1,2,3] LIMIT 2;
+DROP TABLE t2;
+
+-- product quantization: vectors of small table are used as centroids
+CREATE INDEX ON t USING hnsw (val) WITH (dims=3, m=3, quantization=pq, pq_subvectors=3);
+SELECT * FROM t ORDER BY val <-> array[3,3,3] LIMIT 3;
+ALTER INDEX t_val_idx SET (pq_subvectors=1);
+SELECT * FROM t ORDER BY val <-> array[3,3,3] LIMIT 3;
+DROP INDEX t_val_idx;
+CREATE INDEX ON t USING hnsw (val) WITH (dims=3, m=3, quantization=pq, pq_subvectors=4);
+
+-- binary quantization: candidates found using sign bits are rescored
+CREATE INDEX ON t USING hnsw (val) WITH (dims=3, m=3, quantization=binary);
+SELECT * FROM t ORDER BY val <-> array[3,3,3] LIMIT 3;
+DROP INDEX t_val_idx;
+
+-- graph is built and searched using the first coordinate, candidates are rescored using all of them
+CREATE INDEX ON t USING hnsw (val) WITH (dims=3, m=3, prefix_dims=1);
+SELECT * FROM t ORDER BY val <-> array[3,3,3] LIMIT 3;
+DROP INDEX t_val_idx;
+CREATE INDEX ON t USING hnsw (val) WITH (dims=3, m=3, prefix_dims=4);
+CREATE INDEX ON t USING hnsw (val) WITH (dims=3, m=3, prefix_dims=2, quantization=int8);
+
+-- graph is built and searched using projected vectors, candidates are rescored using original ones
+CREATE INDEX ON t USING hnsw (val) WITH (dims=3, m=3, projection=pca, projection_dims=1);
+SELECT * FROM t ORDER BY val <-> array[3,3,3] LIMIT 3;
+-- inserted vectors are projected using the stored matrix
+INSERT INTO t (val) VALUES ('{3,3,3.1}');
+SELECT * FROM t ORDER BY val <-> array[3,3,3] LIMIT 3;
+DELETE FROM t WHERE val = '{3,3,3.1}';
+DROP INDEX t_val_idx;
+CREATE INDEX ON t USING hnsw (val) WITH (dims=3, m=3, projection=random, projection_dims=2);
+SELECT * FROM t ORDER BY val <-> array[3,3,3] LIMIT 3;
+DROP INDEX t_val_idx;
+CREATE INDEX ON t USING hnsw (val) WITH (dims=3, m=3, projection=svd);
+CREATE INDEX ON t USING hnsw (val) WITH (dims=3, m=3, projection=pca, quantization=int8);
+CREATE INDEX ON t USING hnsw (val) WITH (dims=3, m=3, projection=pca, projection_dims=4);
+
+CREATE INDEX ON t USING hnsw (val) WITH (dims=3, m=3, quantization=int4);
+
+-- element with 3072 float coordinates doesn't fit in the page, but fits with half precision
+CREATE TABLE t3 (val real[]);
+CREATE INDEX ON t3 USING hnsw (val) WITH (dims=3072);
+CREATE INDEX ON t3 USING hnsw (val) WITH (dims=3072, quantization=float16);
+INSERT INTO t3 (val) SELECT array_fill(i::real, array[3072]) FROM generate_series(1, 3) i;
+SELECT val[1] FROM t3 ORDER BY val <-> array_fill(2.2::real, array[3072]) LIMIT 2;
+DROP TABLE t3;
+
+DROP TABLE t;
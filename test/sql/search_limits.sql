@@ -0,0 +1,54 @@
+SET enable_seqscan = off;
+
+CREATE TABLE t (val real[]);
+INSERT INTO t (val) VALUES ('{0,0,0}'), ('{1,2,3}'), ('{1,1,1}'), ('{2,2,2}');
+CREATE INDEX ON t USING hnsw (val) WITH (dims=3, m=3);
+
+-- only distance to the entry point is calculated
+SET embedding.max_distance_computations = 1;
+SELECT * FROM t ORDER BY val <-> array[3,3,3];
+RESET embedding.max_distance_computations;
+
+BEGIN;
+SET LOCAL embedding.ef_search = 1;
+SET LOCAL embedding.search_deadline = 10000000;
+SELECT * FROM t ORDER BY val <-> array[3,3,3] LIMIT 2;
+COMMIT;
+SHOW embedding.ef_search;
+
+DROP TABLE t;
+
+-- size of candidate list is derived from LIMIT, so there is no need to restart search
+CREATE TABLE t (val real[]);
+INSERT INTO t (val) VALUES ('{0,0,0}'), ('{1,2,3}'), ('{1,1,1}'), ('{2,2,2}');
+CREATE INDEX ON t USING hnsw (val) WITH (dims=3, m=3);
+SET embedding.ef_search = 1;
+SELECT hnsw_reset_search_statistic();
+SELECT * FROM t ORDER BY val <-> array[3,3,3] LIMIT 3;
+SELECT searches FROM hnsw_search_statistic();
+-- offset is added to the limit
+SELECT hnsw_reset_search_statistic();
+SELECT * FROM t ORDER BY val <-> array[3,3,3] LIMIT 2 OFFSET 1;
+SELECT searches FROM hnsw_search_statistic();
+SET embedding.ef_limit_factor = 0;
+SELECT hnsw_reset_search_statistic();
+SELECT * FROM t ORDER BY val <-> array[3,3,3] LIMIT 3;
+SELECT searches > 1 AS restarted FROM hnsw_search_statistic();
+RESET embedding.ef_limit_factor;
+RESET embedding.ef_search;
+
+DROP TABLE t;
+
+-- search is stopped by deadline on a large graph, but the best results found so far are returned
+CREATE TABLE t (val real[]);
+INSERT INTO t (val) SELECT array[i % 101, i % 103, i % 107] FROM generate_series(1, 5000) i;
+CREATE INDEX ON t USING hnsw (val) WITH (dims=3, m=3);
+SET embedding.ef_search = 1000;
+SET embedding.search_deadline = 1;
+SELECT hnsw_reset_search_statistic();
+SELECT count(*) > 0 AS found FROM (SELECT * FROM t ORDER BY val <-> array[50,50,50] LIMIT 10) s;
+SELECT budget_stops > 0 AS stopped FROM hnsw_search_statistic();
+RESET embedding.search_deadline;
+RESET embedding.ef_search;
+
+DROP TABLE t;
@@ -0,0 +1,33 @@
+SET enable_seqscan = off;
+
+CREATE TABLE t (val real[]);
+INSERT INTO t (val) VALUES ('{0,0,0}'), ('{1,2,3}'), ('{1,1,1}'), ('{2,2,2}');
+CREATE INDEX ON t USING hnsw (val) WITH (dims=3, m=3);
+
+SELECT hnsw_reset_search_statistic();
+SELECT * FROM t ORDER BY val <-> array[3,3,3];
+SELECT searches, expansions > 0 AS expanded, distance_computations, patience_stops, budget_stops FROM hnsw_search_statistic();
+
+-- search is stopped by limit of distance computations
+SELECT hnsw_reset_search_statistic();
+SET embedding.max_distance_computations = 1;
+SELECT * FROM t ORDER BY val <-> array[3,3,3];
+RESET embedding.max_distance_computations;
+SELECT searches, expansions, distance_computations, patience_stops, budget_stops FROM hnsw_search_statistic();
+
+-- search is stopped when results are not improved: expansion of {2,2,2} finds no new neighbors
+-- while {1,1,1} is still in the candidate list
+SELECT hnsw_reset_search_statistic();
+SET embedding.search_patience = 1;
+SELECT count(*) > 0 AS found FROM (SELECT * FROM t ORDER BY val <-> array[3,3,3] LIMIT 4) r;
+RESET embedding.search_patience;
+SELECT searches, patience_stops, budget_stops FROM hnsw_search_statistic();
+
+-- search is completed before patience is exhausted
+SELECT hnsw_reset_search_statistic();
+SET embedding.search_patience = 100;
+SELECT count(*) > 0 AS found FROM (SELECT * FROM t ORDER BY val <-> array[3,3,3] LIMIT 4) r;
+RESET embedding.search_patience;
+SELECT searches, patience_stops, budget_stops FROM hnsw_search_statistic();
+
+DROP TABLE t;